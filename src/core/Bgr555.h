@@ -37,13 +37,20 @@ struct Bgr555
         return (blue << 10) | (green << 5) | red;
     }
 
+    // Expands a 5 bit channel value to 8 bits, and dims it by brightness, which is 0-15 like INIDISP.
+    static inline uint8_t ToOutputLevel(uint8_t value, uint8_t brightness)
+    {
+        return (((value << 3) | (value >> 2)) * brightness) / 15;
+    }
+
+    // Alpha is always 0xFF. Brightness is applied to the color channels.
     inline uint32_t ToARGB888(uint8_t brightness)
     {
-        uint8_t r = (red << 3) | ((red >> 2) & 0x07);
-        uint8_t g = (green << 3) | ((green >> 2) & 0x07);
-        uint8_t b = (blue << 3) | ((blue >> 2) & 0x07);
+        uint8_t r = ToOutputLevel(red, brightness);
+        uint8_t g = ToOutputLevel(green, brightness);
+        uint8_t b = ToOutputLevel(blue, brightness);
 
-        return ((brightness * 17) << 24) | Bytes::Make24Bit(r, g, b);
+        return 0xFF000000 | Bytes::Make24Bit(r, g, b);
     }
 
     inline void Add(Bgr555 other, bool halve)
@@ -1,23 +1,11 @@
 #include <fstream>
-#include <unordered_set>
 
 #include "Cartridge.h"
 #include "Bytes.h"
 
-static const size_t LOROM_HEADER_OFFSET = 0x7FC0;
-static const size_t HIROM_HEADER_OFFSET = 0xFFC0;
-static const size_t EXHIROM_HEADER_OFFSET = 0x40FFC0;
 
-static const ssize_t EXTENDED_HEADER_OFSET = -0x10;
-
-
-static const std::unordered_set<uint8_t> romModeLookup = {
-    Cartridge::ERomType::eLoROM,
-    Cartridge::ERomType::eLoROMSDD1,
-    Cartridge::ERomType::eLoROMSA1,
-    Cartridge::ERomType::eHiROM,
-    Cartridge::ERomType::eExHiROM
-};
+const RomImage::StandardHeader Cartridge::emptyStandardHeader;
+const RomImage::ExtendedHeader Cartridge::emptyExtendedHeader;
 
 
 Cartridge::Cartridge()
@@ -26,19 +14,19 @@ Cartridge::Cartridge()
 }
 
 
+Cartridge::~Cartridge()
+{
+    StopSramWriter();
+}
+
+
 bool Cartridge::LoadRom(const std::string &filename)
 {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file)
-    {
-        LogError("Unable to open file %s", filename.c_str());
+    image = RomImage::Load(filename);
+    if (!image)
         return false;
-    }
-    std::istreambuf_iterator<char> start(file), end;
-    rom = std::vector<uint8_t>(start, end);
 
-    if (!Validate())
-        return false;
+    const StandardHeader &standardHeader = image->GetStandardHeader();
 
     if (standardHeader.ramSize != 0)
     {
@@ -63,223 +51,213 @@ bool Cartridge::LoadRom(const std::string &filename)
         }
     }
 
+    GenerateSlotTable();
+
     return true;
 }
 
 
 bool Cartridge::SaveSram()
 {
-    std::ofstream file(sramFilename, std::ios::binary);
-    if (!file.is_open())
-    {
-        LogError("Error opening sram file %s", sramFilename.c_str());
-        return false;
-    }
-
-    file.write(reinterpret_cast<char *>(sram.data()), sram.size());
-    file.close();
-
-    LogInfo("Saved SRAM");
-
-    return true;
+    sramDirty = false;
+    return WriteSramFile(sram);
 }
 
 
-void Cartridge::Reset()
+void Cartridge::StartSramWriter(std::chrono::milliseconds interval)
 {
-    rom.clear();
-    sram.clear();
-    sramFilename = "";
-    isInterleaved = false;
-    romType = ERomType::eLoROM;
-    isLoRom = true;
-    isFastSpeed = false;
-    standardHeader = StandardHeader();
-    extendedHeader = ExtendedHeader();
+    StopSramWriter();
+
+    if (sram.empty())
+        return;
+
+    sramWriterInterval = interval;
+    nextSramCopy = std::chrono::steady_clock::now() + interval;
+    isSramCopyReady = false;
+    stopSramWriter = false;
+    sramWriterThread = std::thread(&Cartridge::SramWriterFunc, this);
 }
 
 
-uint32_t Cartridge::MapAddress(uint32_t addr, std::vector<uint8_t> **mem)
+void Cartridge::StopSramWriter()
 {
-    // This assumes that accesses to special addresses like wram and io ports have already been filtered out before getting here.
+    if (!sramWriterThread.joinable())
+        return;
 
-    if (isLoRom)
     {
-        if (standardHeader.ramSize != 0 && (addr & 0x708000) == 0x700000 && (addr & 0xFE0000) != 0x7E0000)
-        {
-            // This is a read from SRAM. 70-7D:0000-7FFF, F0-FF:0000-7FFF
-            *mem = &sram;
-
-            // Remove the high bit of the offset and shift the bank right one so that LSBit of bank is MSBit of offset.
-            // Ignore the high nybble of bank.
-            uint32_t mappedAddr = (((addr & 0x0F0000) >> 1) | (addr & 0x7FFF)) & sramSizeMask;
-            return mappedAddr;
-        }
-
-        // This is a read from LoROM area. 00-7D:8000-FFFF, 80-FF:8000-FFFF
-        // or
-        // This is a read from HiROM area. 40-7D:0000-7FFF, C0-FF:0000-7FFF
-        *mem = &rom;
-
-        // Remove the high bit of the offset and shift the bank right one so that LSBit of bank is MSBit of offset.
-        // Ignore the high bit of bank, which selects WS1/WS2.
-        uint32_t mappedAddr = ((addr & 0x7F0000) >> 1) | (addr & 0x7FFF);
-        return mappedAddr;
+        std::lock_guard<std::mutex> lock(sramWriterMutex);
+        stopSramWriter = true;
     }
-    else
-    {
-        if (standardHeader.ramSize != 0 && (addr & 0x40E000) == 0x006000)
-        {
-            // This is a read from SRAM. 30-3F:6000-7FFF, B0-BF:6000-7FFF
-            *mem = &sram;
-
-            // Shift the bank down to fill the unused top 3 bits of the offset.
-            uint32_t mappedAddr = (((addr & 0xFF0000) >> 3) | (addr & 0x1FFF)) & sramSizeMask;
-            return mappedAddr;
-        }
+    sramWriterCv.notify_one();
+    sramWriterThread.join();
 
-        // This is a read from HiROM area. 40-7D:0000-FFFF, C0-FF:0000-FFFF
-        // or
-        // This is a read from LoROM area. 00-3F:8000-FFFF, 80-BF:8000-FFFF
-        *mem = &rom;
-
-        // Clear bits 22 and 23.
-        uint32_t mappedAddr = addr & 0x3FFFFF;
-        return mappedAddr;
-    }
+    // Anything written since the last copy is still only in SRAM.
+    if (sramDirty)
+        SaveSram();
 }
 
 
-uint8_t Cartridge::ReadByte(uint32_t addr)
+void Cartridge::ProcessVBlankStart()
 {
-    std::vector<uint8_t> *mem;
-    uint32_t mappedAddr = MapAddress(addr, &mem);
-
-    return (*mem)[mappedAddr];
-}
-
+    if (!sramDirty || !sramWriterThread.joinable())
+        return;
 
-void Cartridge::WriteByte(uint32_t addr, uint8_t byte)
-{
-    std::vector<uint8_t> *mem;
-    uint32_t mappedAddr = MapAddress(addr, &mem);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < nextSramCopy)
+        return;
 
-    if (mem == &rom)
-    {
-        LogError("Write to ROM address %06X(%06X) = %02X", addr, mappedAddr, byte);
-        //throw std::range_error(fmt("Write to ROM address %06X(%06X)", addr, mappedAddr));
+    // Don't wait on the writer thread. If it has the lock, try again next frame.
+    std::unique_lock<std::mutex> lock(sramWriterMutex, std::try_to_lock);
+    if (!lock.owns_lock())
         return;
-    }
 
-    (*mem)[mappedAddr] = byte;
+    // Assigning reuses the copy's memory once the writer thread has swapped it back.
+    sramCopy = sram;
+    isSramCopyReady = true;
+    lock.unlock();
+    sramWriterCv.notify_one();
+
+    sramDirty = false;
+    nextSramCopy = now + sramWriterInterval;
 }
 
 
-uint8_t *Cartridge::GetBytePtr(uint32_t addr)
+void Cartridge::SramWriterFunc()
 {
-    std::vector<uint8_t> *mem;
-    uint32_t mappedAddr = MapAddress(addr, &mem);
+    std::vector<uint8_t> data;
+    std::unique_lock<std::mutex> lock(sramWriterMutex);
 
-    return &(*mem)[mappedAddr];
+    // A copy that is ready when stopping is still saved.
+    while (true)
+    {
+        sramWriterCv.wait(lock, [this]{return isSramCopyReady || stopSramWriter;});
+        if (!isSramCopyReady)
+            break;
+
+        data.swap(sramCopy);
+        isSramCopyReady = false;
+        lock.unlock();
+        WriteSramFile(data);
+        lock.lock();
+    }
 }
 
 
-bool Cartridge::Validate()
+bool Cartridge::WriteSramFile(const std::vector<uint8_t> &data)
 {
-    // Check for and strip useless header added by cartridge copying devices.
-    size_t copierHeaderLen = rom.size() % 1024;
-    if (copierHeaderLen != 0)
+    // Write to a temporary file and rename it over the old one, so a crash while saving can't corrupt the save.
+    std::string tempFilename = sramFilename + ".tmp";
+    std::ofstream file(tempFilename, std::ios::binary);
+    if (!file.is_open())
     {
-        LogInfo("Detected copier header of length %d", copierHeaderLen);
-        rom.erase(rom.begin(), rom.begin() + copierHeaderLen);
+        LogError("Error opening sram file %s", tempFilename.c_str());
+        return false;
     }
 
-    size_t offset = 0;
-
-    if ((rom.size() >= LOROM_HEADER_OFFSET + 32) && FindHeader(LOROM_HEADER_OFFSET))
-    {
-        offset = LOROM_HEADER_OFFSET;
-    }
-    else if ((rom.size() >= HIROM_HEADER_OFFSET + 32) && FindHeader(HIROM_HEADER_OFFSET))
-    {
-        offset = HIROM_HEADER_OFFSET;
-    }
-    else
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+    file.close();
+    if (!file)
     {
-        //Skip checking ExHiROM, since it's only 2 Japanese games.
-        LogError("Unable to determine cartridge type");
-        //return false;
-        // Default to LoROM for now.
-        offset = LOROM_HEADER_OFFSET;
-        memcpy(&standardHeader, &rom[offset], sizeof(StandardHeader));
+        LogError("Error writing sram file %s", tempFilename.c_str());
+        return false;
     }
 
-    LogInfo("Title = %.21s", standardHeader.title);
-
-    romType = static_cast<ERomType>(standardHeader.mode & 0x0F);
-    isLoRom = (romType == ERomType::eLoROM || romType == ERomType::eLoROMSA1 || romType == ERomType::eLoROMSDD1);
-    isFastSpeed = (standardHeader.mode >> 4) & 1;
-    
-    // Interleaved ROMs can be hiROM, but have the header at the LoROM file offset.
-    isInterleaved = (offset == LOROM_HEADER_OFFSET) && !isLoRom;
-    if (isInterleaved)
+    if (rename(tempFilename.c_str(), sramFilename.c_str()) != 0)
     {
-        LogError("Interleaved ROM NYI");
+        LogError("Error renaming %s to %s", tempFilename.c_str(), sramFilename.c_str());
         return false;
     }
-    
-    if (standardHeader.devId == 0x33 || standardHeader.title[20] == 0)
-    {
-        // If the last byte of the title is null, this is an early extended header where only the chip subtype byte is valid.
-        // If devId is 0x33, this is a later extended header where all fields are valid.
-        size_t extOffset = offset + EXTENDED_HEADER_OFSET;
-        memcpy(&extendedHeader, &rom[extOffset], sizeof(ExtendedHeader));
-    }
+
+    LogInfo("Saved SRAM");
 
     return true;
 }
 
 
-bool Cartridge::FindHeader(size_t headerOffset)
+void Cartridge::Reset()
 {
-    StandardHeader header;
-    memcpy(&header, &rom[headerOffset], sizeof(StandardHeader));
+    StopSramWriter();
+    image.reset();
+    sram.clear();
+    sramFilename = "";
+    sramSizeMask = 0;
+    slots = SlotTable();
+}
+
 
-    LogInfo("Checking for standard header at %04X", headerOffset);
+bool Cartridge::IsSramAddress(uint32_t addr) const
+{
+    if (sramSizeMask == 0)
+        return false;
 
-    // Check that title field is all ASCII. The last byte can be null.
-    for (int i = 0; i < 20; i++)
+    if (image->IsLoRom())
     {
-        if (header.title[i] < 0x20 || header.title[i] > 0x7E)
-        {
-            LogError("Non-ASCII value (%02X) in Title at %04X", header.title[i], headerOffset + i);
-            return false;
-        }
+        // 70-7D:0000-7FFF, F0-FF:0000-7FFF
+        return (addr & 0x708000) == 0x700000 && (addr & 0xFE0000) != 0x7E0000;
     }
-    if ((header.title[20] > 0 && header.title[20] < 0x20) || header.title[20] > 0x7E)
+    else
     {
-        LogError("Non-ASCII value (%02X) in Title at %04X", header.title[20], headerOffset + 20);
-        return false;
+        // 30-3F:6000-7FFF, B0-BF:6000-7FFF. ExHiROM uses the same area.
+        return (addr & 0x40E000) == 0x006000;
     }
+}
 
-    // Look for a mode-like byte. This succeeds at the wrong offset with FF5 which is why the rest of the checks are necesasry.
-    if (romModeLookup.find(header.mode & 0x0F) == romModeLookup.end())
+
+void Cartridge::GenerateSlotTable()
+{
+    // This assumes that accesses to special addresses like wram and io ports have already been filtered out before getting here.
+
+    for (uint32_t i = 0; i < RomImage::SLOT_COUNT; i++)
     {
-        LogError("Bad mode (%02X) at %04X", header.mode, headerOffset + offsetof(StandardHeader, mode));
-        return false;
+        uint32_t addr = i << RomImage::SLOT_SHIFT;
+        MappedSlot &slot = slots[i];
+
+        if (IsSramAddress(addr))
+        {
+            uint32_t mappedAddr;
+            if (image->IsLoRom())
+            {
+                // Remove the high bit of the offset and shift the bank right one so that LSBit of bank is MSBit of offset.
+                // Ignore the high nybble of bank.
+                mappedAddr = ((addr & 0x0F0000) >> 1) | (addr & 0x7FFF);
+            }
+            else
+            {
+                // Shift the bank down to fill the unused top 3 bits of the offset.
+                mappedAddr = ((addr & 0xFF0000) >> 3) | (addr & 0x1FFF);
+            }
+
+            // The slot base and the offset within the slot don't share any bits, so they can be masked separately.
+            slot.sram = &sram[mappedAddr & sramSizeMask];
+            slot.mem = slot.sram;
+            slot.mask = (RomImage::SLOT_SIZE - 1) & sramSizeMask;
+            slot.isRom = false;
+        }
+        else
+        {
+            // Everything that isn't SRAM is ROM. The image knows where each slot is for the ROM's mapping mode.
+            slot.mem = image->GetSlotData(addr);
+            slot.sram = nullptr;
+            slot.mask = RomImage::SLOT_SIZE - 1;
+            slot.isRom = true;
+        }
     }
+}
+
+
+void Cartridge::WriteByte(uint32_t addr, uint8_t byte)
+{
+    const MappedSlot &slot = slots[addr >> RomImage::SLOT_SHIFT];
 
-    // Check checksums. This doesn't actually verify all ROM data in case this is a hacked ROM.
-    if ((header.checksum ^ header.checksumComplement) != 0xFFFF &&
-        !(header.checksum == 0x5343 && header.checksumComplement == 0x4343) && // Some test roms use these hardcoded values.
-        !(header.checksum == 0x0000 && header.checksumComplement == 0x0000)) // Some test roms have all zeros.
+    if (slot.isRom)
     {
-        LogError("Bad checksum at %04X", headerOffset);
-        return false;
+        uint32_t mappedAddr = image->GetRomOffset(addr);
+        LogError("Write to ROM address %06X(%06X) = %02X", addr, mappedAddr, byte);
+        //throw std::range_error(fmt("Write to ROM address %06X(%06X)", addr, mappedAddr));
+        return;
     }
 
-    LogInfo("Found valid standard header at %04X", headerOffset);
-    standardHeader = header;
+    slot.sram[addr & slot.mask] = byte;
+    sramDirty = true;
+}
 
-    return true;
-}
\ No newline at end of file
@@ -1,82 +1,113 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "Zlsnes.h"
 #include "Address.h"
+#include "RomImage.h"
+#include "TimerObserver.h"
 
 
-class Cartridge
+class Cartridge : public VBlankObserver
 {
 public:
-    enum ERomType
-    {
-        eLoROM = 0x00,
-        eHiROM = 0x01,
-        eLoROMSDD1 = 0x02,
-        eLoROMSA1 = 0x03,
-        eExHiROM = 0x05,
-        //eHiRomSPC7110 = 0x0A
-    };
-
-#pragma pack(1)
-    struct StandardHeader
-    {
-        char title[21] = {0};
-        uint8_t mode = 0;
-        uint8_t chipset = 0;
-        uint8_t romSize = 0;
-        uint8_t ramSize = 0;
-        uint8_t country = 0;
-        uint8_t devId = 0;
-        uint8_t romVersion = 0;
-        uint16_t checksumComplement = 0;
-        uint16_t checksum = 0;
-    };
-
-    struct ExtendedHeader
-    {
-        char makerCode[2] = {0};
-        char gameCode[4] = {0};
-        char reserved[6] = {0};
-        uint8_t expansionFlashSize = 0;
-        uint8_t expansionRamSize = 0;
-        uint8_t specialVersion = 0;
-        uint8_t chipsetSubtype = 0;
-    };
-#pragma pack()
+    using ERomType = RomImage::ERomType;
+    using StandardHeader = RomImage::StandardHeader;
+    using ExtendedHeader = RomImage::ExtendedHeader;
 
     Cartridge();
+    virtual ~Cartridge();
 
     bool LoadRom(const std::string &filename);
     bool SaveSram();
     void Reset();
 
-    uint32_t MapAddress(uint32_t addr, std::vector<uint8_t> **mem);
-    uint8_t ReadByte(uint32_t addr);
+    // Saves SRAM from a background thread at most once per interval, and only if it has been written to. Stopping the
+    // writer saves any writes that haven't been saved yet, so it has to be stopped from the emulation thread or after
+    // the emulation thread is done.
+    void StartSramWriter(std::chrono::milliseconds interval = std::chrono::seconds(5));
+    void StopSramWriter();
+
+    // Inherited from VBlankObserver. The emulation thread copies SRAM for the writer thread here, since nothing writes
+    // to SRAM while it's in here.
+    void ProcessVBlankStart() override;
+    void ProcessVBlankEnd() override {}
+
+    // Where one 8KB slot of the address space is in host memory. Addresses within the slot are masked with mask, which
+    // mirrors SRAM that is smaller than the slot.
+    struct MappedSlot
+    {
+        const uint8_t *mem = nullptr;
+        // The same as mem for SRAM. Null for ROM, since ROM is mapped read-only.
+        uint8_t *sram = nullptr;
+        uint32_t mask = 0;
+        bool isRom = true;
+    };
+
+    using SlotTable = std::array<MappedSlot, RomImage::SLOT_COUNT>;
+
+    uint8_t ReadByte(uint32_t addr) const
+    {
+        const MappedSlot &slot = slots[addr >> RomImage::SLOT_SHIFT];
+        return slot.mem[addr & slot.mask];
+    }
     void WriteByte(uint32_t addr, uint8_t byte);
 
-    uint8_t *GetBytePtr(uint32_t addr);
-    const StandardHeader &GetStandardHeader() const {return standardHeader;}
-    const ExtendedHeader &GetExtendedHeader() const {return extendedHeader;}
-    ERomType GetRomType() const {return romType;}
-    bool IsLoRom() const {return isLoRom;}
-    bool IsFastSpeed() const {return isFastSpeed;}
-    bool IsInterleaved() const {return isInterleaved;}
+    const uint8_t *GetBytePtr(uint32_t addr) const
+    {
+        const MappedSlot &slot = slots[addr >> RomImage::SLOT_SHIFT];
+        return &slot.mem[addr & slot.mask];
+    }
+    // Null for ROM addresses.
+    uint8_t *GetSramPtr(uint32_t addr)
+    {
+        const MappedSlot &slot = slots[addr >> RomImage::SLOT_SHIFT];
+        return slot.isRom ? nullptr : &slot.sram[addr & slot.mask];
+    }
+
+    // The table is only rebuilt by LoadRom and Reset, so a bus can use it directly between those.
+    const SlotTable &GetSlotTable() const {return slots;}
+
+    // These return defaults when no ROM is loaded.
+    const StandardHeader &GetStandardHeader() const {return image ? image->GetStandardHeader() : emptyStandardHeader;}
+    const ExtendedHeader &GetExtendedHeader() const {return image ? image->GetExtendedHeader() : emptyExtendedHeader;}
+    ERomType GetRomType() const {return image ? image->GetRomType() : ERomType::eLoROM;}
+    bool IsLoRom() const {return image ? image->IsLoRom() : true;}
+    bool IsFastSpeed() const {return image ? image->IsFastSpeed() : false;}
+    bool IsInterleaved() const {return image ? image->IsInterleaved() : false;}
 
 protected:
-    bool Validate();
-    bool FindHeader(size_t headerOffset);
+    void GenerateSlotTable();
+    bool IsSramAddress(uint32_t addr) const;
+    void SramWriterFunc();
+    bool WriteSramFile(const std::vector<uint8_t> &data);
+
+    static const StandardHeader emptyStandardHeader;
+    static const ExtendedHeader emptyExtendedHeader;
+
+    // The ROM is shared with any other Cartridge that loaded the same file. Only SRAM belongs to this Cartridge.
+    std::shared_ptr<const RomImage> image;
 
-    std::vector<uint8_t> rom;
     std::vector<uint8_t> sram;
     std::string sramFilename;
     uint32_t sramSizeMask = 0;
 
-    StandardHeader standardHeader;
-    ExtendedHeader extendedHeader;
+    // Only used by the emulation thread. Set by WriteByte and cleared when SRAM is copied for the writer thread.
+    bool sramDirty = false;
+    std::chrono::milliseconds sramWriterInterval{0};
+    std::chrono::steady_clock::time_point nextSramCopy;
+
+    // The writer thread only ever sees the copy, so it never reads SRAM while the emulation thread is writing to it.
+    std::thread sramWriterThread;
+    std::mutex sramWriterMutex;
+    std::condition_variable sramWriterCv;
+    std::vector<uint8_t> sramCopy;
+    bool isSramCopyReady = false;
+    bool stopSramWriter = false;
 
-    ERomType romType = ERomType::eLoROM;
-    bool isLoRom = true;
-    bool isFastSpeed = false;
-    bool isInterleaved = false;
+    SlotTable slots;
 };
\ No newline at end of file
@@ -0,0 +1,366 @@
+#if defined(__x86_64__) || defined(__i386__)
+#define COLOR_MATH_X86
+#include <immintrin.h>
+#endif
+
+#include "Bgr555.h"
+#include "ColorMath.h"
+
+// The vector blending kernels work on 16 bit lanes, one pixel per lane, with each channel separated out. They give the
+// same results as Bgr555::Add, Bgr555::Subtract, and Bgr555::ToARGB888. The conversion kernels work on 32 bit lanes,
+// and pack the results down to 16 bits. The interleaving kernels unpack 32 bit lanes of two lines into one.
+
+namespace ColorMath
+{
+    static void BlendLineScalar(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                                bool subtract, uint8_t brightness, uint32_t *out)
+    {
+        for (int x = 0; x < count; x++)
+        {
+            if ((flags[x] & COLOR_MATH) == 0)
+                continue;
+
+            Bgr555 color(mainColors[x]);
+            bool halve = flags[x] & HALVE;
+
+            if (subtract)
+                color.Subtract(subColors[x], halve);
+            else
+                color.Add(subColors[x], halve);
+
+            out[x] = color.ToARGB888(brightness);
+        }
+    }
+
+
+    static void ConvertLineScalar(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out)
+    {
+        // Keep the top 5 or 6 bits of each 8 bit channel.
+        for (int x = 0; x < count; x++)
+        {
+            const uint32_t color = colors[x];
+
+            if (format == EPixelFormat::RGB565)
+                out[x] = ((color >> 8) & 0xF800) | ((color >> 5) & 0x07E0) | ((color >> 3) & 0x001F);
+            else
+                out[x] = ((color >> 19) & 0x001F) | ((color >> 6) & 0x03E0) | ((color << 7) & 0x7C00);
+        }
+    }
+
+
+    static void InterleaveLineScalar(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out)
+    {
+        for (int x = 0; x < count; x++)
+        {
+            out[x * 2] = even[x];
+            out[x * 2 + 1] = odd[x];
+        }
+    }
+
+
+#ifdef COLOR_MATH_X86
+    // Multiplying by this and shifting right by 19 is the same as dividing by 15, for every value up to 255 * 15.
+    static const uint16_t DIVIDE_BY_15 = 0x8889;
+
+
+    // Returns the 8 bit output level of the channel at Shift, for 8 pixels.
+    template <int Shift>
+    __attribute__((target("sse2")))
+    static inline __m128i BlendChannelSse2(__m128i mainColors, __m128i subColors, __m128i isHalve, bool subtract,
+                                           __m128i brightness)
+    {
+        const __m128i channelMask = _mm_set1_epi16(0x1F);
+        __m128i main = _mm_and_si128(_mm_srli_epi16(mainColors, Shift), channelMask);
+        __m128i sub = _mm_and_si128(_mm_srli_epi16(subColors, Shift), channelMask);
+
+        // Subtracting stops at 0. Adding is limited to 31 after halving.
+        __m128i value = subtract ? _mm_subs_epu16(main, sub) : _mm_add_epi16(main, sub);
+        value = _mm_or_si128(_mm_and_si128(isHalve, _mm_srli_epi16(value, 1)), _mm_andnot_si128(isHalve, value));
+        value = _mm_min_epi16(value, channelMask);
+
+        // Expand to 8 bits, then scale by brightness / 15.
+        value = _mm_or_si128(_mm_slli_epi16(value, 3), _mm_srli_epi16(value, 2));
+        value = _mm_mullo_epi16(value, brightness);
+        return _mm_srli_epi16(_mm_mulhi_epu16(value, _mm_set1_epi16(static_cast<short>(DIVIDE_BY_15))), 3);
+    }
+
+
+    __attribute__((target("sse2")))
+    static void BlendLineSse2(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                              bool subtract, uint8_t brightness, uint32_t *out)
+    {
+        const __m128i mathBit = _mm_set1_epi16(COLOR_MATH);
+        const __m128i halveBit = _mm_set1_epi16(HALVE);
+        const __m128i scale = _mm_set1_epi16(brightness);
+        const __m128i alpha = _mm_set1_epi16(static_cast<short>(0xFF00));
+
+        int x = 0;
+        for (; x + 8 <= count; x += 8)
+        {
+            __m128i pixelFlags = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&flags[x])),
+                                                   _mm_setzero_si128());
+            __m128i isMath = _mm_cmpeq_epi16(_mm_and_si128(pixelFlags, mathBit), mathBit);
+            if (_mm_movemask_epi8(isMath) == 0)
+                continue;
+
+            __m128i isHalve = _mm_cmpeq_epi16(_mm_and_si128(pixelFlags, halveBit), halveBit);
+            __m128i main = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&mainColors[x]));
+            __m128i sub = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&subColors[x]));
+
+            __m128i red = BlendChannelSse2<0>(main, sub, isHalve, subtract, scale);
+            __m128i green = BlendChannelSse2<5>(main, sub, isHalve, subtract, scale);
+            __m128i blue = BlendChannelSse2<10>(main, sub, isHalve, subtract, scale);
+
+            // Interleave into 0xAARRGGBB, then keep the old value for pixels without color math.
+            __m128i greenBlue = _mm_or_si128(_mm_slli_epi16(green, 8), blue);
+            __m128i alphaRed = _mm_or_si128(alpha, red);
+            __m128i *dest = reinterpret_cast<__m128i *>(&out[x]);
+
+            for (int half = 0; half < 2; half++)
+            {
+                __m128i color = half == 0 ? _mm_unpacklo_epi16(greenBlue, alphaRed) :
+                                            _mm_unpackhi_epi16(greenBlue, alphaRed);
+                __m128i mask = half == 0 ? _mm_unpacklo_epi16(isMath, isMath) : _mm_unpackhi_epi16(isMath, isMath);
+                __m128i old = _mm_loadu_si128(&dest[half]);
+                _mm_storeu_si128(&dest[half], _mm_or_si128(_mm_and_si128(mask, color), _mm_andnot_si128(mask, old)));
+            }
+        }
+
+        BlendLineScalar(&mainColors[x], &subColors[x], &flags[x], count - x, subtract, brightness, &out[x]);
+    }
+
+
+    // Converts 4 pixels, sign extended to 32 bits so they can be packed with signed saturation.
+    __attribute__((target("sse2")))
+    static inline __m128i ConvertPixelsSse2(__m128i colors, EPixelFormat format)
+    {
+        __m128i value;
+        if (format == EPixelFormat::RGB565)
+        {
+            value = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(colors, 8), _mm_set1_epi32(0xF800)),
+                                 _mm_and_si128(_mm_srli_epi32(colors, 5), _mm_set1_epi32(0x07E0)));
+            value = _mm_or_si128(value, _mm_and_si128(_mm_srli_epi32(colors, 3), _mm_set1_epi32(0x001F)));
+        }
+        else
+        {
+            value = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(colors, 19), _mm_set1_epi32(0x001F)),
+                                 _mm_and_si128(_mm_srli_epi32(colors, 6), _mm_set1_epi32(0x03E0)));
+            value = _mm_or_si128(value, _mm_and_si128(_mm_slli_epi32(colors, 7), _mm_set1_epi32(0x7C00)));
+        }
+
+        return _mm_srai_epi32(_mm_slli_epi32(value, 16), 16);
+    }
+
+
+    __attribute__((target("sse2")))
+    static void ConvertLineSse2(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out)
+    {
+        int x = 0;
+        for (; x + 8 <= count; x += 8)
+        {
+            const __m128i *in = reinterpret_cast<const __m128i *>(&colors[x]);
+            __m128i low = ConvertPixelsSse2(_mm_loadu_si128(&in[0]), format);
+            __m128i high = ConvertPixelsSse2(_mm_loadu_si128(&in[1]), format);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[x]), _mm_packs_epi32(low, high));
+        }
+
+        ConvertLineScalar(&colors[x], count - x, format, &out[x]);
+    }
+
+
+    __attribute__((target("sse2")))
+    static void InterleaveLineSse2(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out)
+    {
+        int x = 0;
+        for (; x + 4 <= count; x += 4)
+        {
+            __m128i evenColors = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&even[x]));
+            __m128i oddColors = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&odd[x]));
+            __m128i *dest = reinterpret_cast<__m128i *>(&out[x * 2]);
+            _mm_storeu_si128(&dest[0], _mm_unpacklo_epi32(evenColors, oddColors));
+            _mm_storeu_si128(&dest[1], _mm_unpackhi_epi32(evenColors, oddColors));
+        }
+
+        InterleaveLineScalar(&even[x], &odd[x], count - x, &out[x * 2]);
+    }
+
+
+    // Returns the 8 bit output level of the channel at Shift, for 16 pixels.
+    template <int Shift>
+    __attribute__((target("avx2")))
+    static inline __m256i BlendChannelAvx2(__m256i mainColors, __m256i subColors, __m256i isHalve, bool subtract,
+                                           __m256i brightness)
+    {
+        const __m256i channelMask = _mm256_set1_epi16(0x1F);
+        __m256i main = _mm256_and_si256(_mm256_srli_epi16(mainColors, Shift), channelMask);
+        __m256i sub = _mm256_and_si256(_mm256_srli_epi16(subColors, Shift), channelMask);
+
+        __m256i value = subtract ? _mm256_subs_epu16(main, sub) : _mm256_add_epi16(main, sub);
+        value = _mm256_blendv_epi8(value, _mm256_srli_epi16(value, 1), isHalve);
+        value = _mm256_min_epi16(value, channelMask);
+
+        value = _mm256_or_si256(_mm256_slli_epi16(value, 3), _mm256_srli_epi16(value, 2));
+        value = _mm256_mullo_epi16(value, brightness);
+        return _mm256_srli_epi16(_mm256_mulhi_epu16(value, _mm256_set1_epi16(static_cast<short>(DIVIDE_BY_15))), 3);
+    }
+
+
+    __attribute__((target("avx2")))
+    static void BlendLineAvx2(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                              bool subtract, uint8_t brightness, uint32_t *out)
+    {
+        const __m256i mathBit = _mm256_set1_epi16(COLOR_MATH);
+        const __m256i halveBit = _mm256_set1_epi16(HALVE);
+        const __m256i scale = _mm256_set1_epi16(brightness);
+        const __m256i alpha = _mm256_set1_epi16(static_cast<short>(0xFF00));
+
+        int x = 0;
+        for (; x + 16 <= count; x += 16)
+        {
+            __m256i pixelFlags = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&flags[x])));
+            __m256i isMath = _mm256_cmpeq_epi16(_mm256_and_si256(pixelFlags, mathBit), mathBit);
+            if (_mm256_movemask_epi8(isMath) == 0)
+                continue;
+
+            __m256i isHalve = _mm256_cmpeq_epi16(_mm256_and_si256(pixelFlags, halveBit), halveBit);
+            __m256i main = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&mainColors[x]));
+            __m256i sub = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&subColors[x]));
+
+            __m256i red = BlendChannelAvx2<0>(main, sub, isHalve, subtract, scale);
+            __m256i green = BlendChannelAvx2<5>(main, sub, isHalve, subtract, scale);
+            __m256i blue = BlendChannelAvx2<10>(main, sub, isHalve, subtract, scale);
+
+            __m256i greenBlue = _mm256_or_si256(_mm256_slli_epi16(green, 8), blue);
+            __m256i alphaRed = _mm256_or_si256(alpha, red);
+
+            // Unpacking works within each 128 bit lane, so the low result has pixels 0-3 and 8-11, and the high result
+            // has pixels 4-7 and 12-15.
+            __m256i low = _mm256_unpacklo_epi16(greenBlue, alphaRed);
+            __m256i high = _mm256_unpackhi_epi16(greenBlue, alphaRed);
+            __m256i lowMask = _mm256_unpacklo_epi16(isMath, isMath);
+            __m256i highMask = _mm256_unpackhi_epi16(isMath, isMath);
+            const __m256i colors[2] = {_mm256_permute2x128_si256(low, high, 0x20),
+                                       _mm256_permute2x128_si256(low, high, 0x31)};
+            const __m256i masks[2] = {_mm256_permute2x128_si256(lowMask, highMask, 0x20),
+                                      _mm256_permute2x128_si256(lowMask, highMask, 0x31)};
+
+            __m256i *dest = reinterpret_cast<__m256i *>(&out[x]);
+            for (int half = 0; half < 2; half++)
+            {
+                __m256i old = _mm256_loadu_si256(&dest[half]);
+                _mm256_storeu_si256(&dest[half], _mm256_blendv_epi8(old, colors[half], masks[half]));
+            }
+        }
+
+        BlendLineScalar(&mainColors[x], &subColors[x], &flags[x], count - x, subtract, brightness, &out[x]);
+    }
+
+
+    __attribute__((target("avx2")))
+    static inline __m256i ConvertPixelsAvx2(__m256i colors, EPixelFormat format)
+    {
+        __m256i value;
+        if (format == EPixelFormat::RGB565)
+        {
+            value = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(colors, 8), _mm256_set1_epi32(0xF800)),
+                                    _mm256_and_si256(_mm256_srli_epi32(colors, 5), _mm256_set1_epi32(0x07E0)));
+            value = _mm256_or_si256(value, _mm256_and_si256(_mm256_srli_epi32(colors, 3), _mm256_set1_epi32(0x001F)));
+        }
+        else
+        {
+            value = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(colors, 19), _mm256_set1_epi32(0x001F)),
+                                    _mm256_and_si256(_mm256_srli_epi32(colors, 6), _mm256_set1_epi32(0x03E0)));
+            value = _mm256_or_si256(value, _mm256_and_si256(_mm256_slli_epi32(colors, 7), _mm256_set1_epi32(0x7C00)));
+        }
+
+        return _mm256_srai_epi32(_mm256_slli_epi32(value, 16), 16);
+    }
+
+
+    __attribute__((target("avx2")))
+    static void ConvertLineAvx2(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out)
+    {
+        int x = 0;
+        for (; x + 16 <= count; x += 16)
+        {
+            const __m256i *in = reinterpret_cast<const __m256i *>(&colors[x]);
+            __m256i low = ConvertPixelsAvx2(_mm256_loadu_si256(&in[0]), format);
+            __m256i high = ConvertPixelsAvx2(_mm256_loadu_si256(&in[1]), format);
+
+            // Packing works within each 128 bit lane, which leaves the 64 bit quarters in the order 0, 2, 1, 3.
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[x]), packed);
+        }
+
+        ConvertLineScalar(&colors[x], count - x, format, &out[x]);
+    }
+
+
+    __attribute__((target("avx2")))
+    static void InterleaveLineAvx2(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out)
+    {
+        int x = 0;
+        for (; x + 8 <= count; x += 8)
+        {
+            __m256i evenColors = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&even[x]));
+            __m256i oddColors = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&odd[x]));
+
+            // Unpacking works within each 128 bit lane, so low has pixels 0-1 and 4-5, and high has 2-3 and 6-7.
+            __m256i low = _mm256_unpacklo_epi32(evenColors, oddColors);
+            __m256i high = _mm256_unpackhi_epi32(evenColors, oddColors);
+            __m256i *dest = reinterpret_cast<__m256i *>(&out[x * 2]);
+            _mm256_storeu_si256(&dest[0], _mm256_permute2x128_si256(low, high, 0x20));
+            _mm256_storeu_si256(&dest[1], _mm256_permute2x128_si256(low, high, 0x31));
+        }
+
+        InterleaveLineScalar(&even[x], &odd[x], count - x, &out[x * 2]);
+    }
+#endif
+
+
+    const std::vector<Kernel> &GetKernels()
+    {
+        static const std::vector<Kernel> kernels = []()
+        {
+            std::vector<Kernel> supported = {{"scalar", BlendLineScalar, ConvertLineScalar, InterleaveLineScalar}};
+
+#ifdef COLOR_MATH_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse2"))
+                supported.push_back({"sse2", BlendLineSse2, ConvertLineSse2, InterleaveLineSse2});
+            if (__builtin_cpu_supports("avx2"))
+                supported.push_back({"avx2", BlendLineAvx2, ConvertLineAvx2, InterleaveLineAvx2});
+#endif
+
+            return supported;
+        }();
+
+        return kernels;
+    }
+
+
+    const Kernel &GetKernel()
+    {
+        static const Kernel &kernel = GetKernels().back();
+        return kernel;
+    }
+
+
+    void BlendLine(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                   bool subtract, uint8_t brightness, uint32_t *out)
+    {
+        GetKernel().blendLine(mainColors, subColors, flags, count, subtract, brightness, out);
+    }
+
+
+    void ConvertLine(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out)
+    {
+        GetKernel().convertLine(colors, count, format, out);
+    }
+
+
+    void InterleaveLine(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out)
+    {
+        GetKernel().interleaveLine(even, odd, count, out);
+    }
+}
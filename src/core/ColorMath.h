@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include "Zlsnes.h"
+#include "DisplayInterface.h"
+
+// Blends main and sub screen BGR555 colors, and converts the results to output colors.
+namespace ColorMath
+{
+    // Flags for each pixel of a line.
+    static const uint8_t COLOR_MATH = 0x01;
+    static const uint8_t HALVE = 0x02;
+
+    struct Kernel
+    {
+        const char *name;
+
+        // For each of the count pixels with COLOR_MATH set, adds or subtracts the sub color from the main color, halves
+        // it if HALVE is set, and writes it to out as ARGB8888 at brightness (0-15). Other pixels of out are left alone.
+        void (*blendLine)(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                          bool subtract, uint8_t brightness, uint32_t *out);
+
+        // Converts count ARGB8888 output colors to format, which is one of the 16 bit formats.
+        void (*convertLine)(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out);
+
+        // Interleaves count colors from each of even and odd into 2 * count colors of out, starting with even.
+        void (*interleaveLine)(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out);
+    };
+
+    // Returns the kernels the CPU supports, from slowest to fastest. The first one is the portable scalar kernel.
+    const std::vector<Kernel> &GetKernels();
+
+    // Returns the fastest kernel the CPU supports.
+    const Kernel &GetKernel();
+
+    void BlendLine(const uint16_t *mainColors, const uint16_t *subColors, const uint8_t *flags, int count,
+                   bool subtract, uint8_t brightness, uint32_t *out);
+    void ConvertLine(const uint32_t *colors, int count, EPixelFormat format, uint16_t *out);
+    void InterleaveLine(const uint32_t *even, const uint32_t *odd, int count, uint32_t *out);
+}
@@ -1,18 +1,40 @@
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include "Zlsnes.h"
 
+class TripleBuffer;
+
 const int SCREEN_X = 512;
 const int SCREEN_Y = 480;
 
+enum class EPixelFormat
+{
+    XRGB8888, // 32 bits, with the top byte always 0xFF.
+    RGB565,   // 16 bits.
+    BGR555    // 16 bits, the same layout as CGRAM colors. The INIDISP brightness is still applied.
+};
+
+// Describes a frame. Lines are width pixels long, and each one starts pitch bytes after the one above it. Scaling the
+// frame to the display is left to the DisplayInterface.
+struct FrameDescriptor
+{
+    int width;
+    int height;
+    int pitch;
+    EPixelFormat format;
+};
+
 class DisplayInterface
 {
 public:
     DisplayInterface() {}
 
-    virtual void FrameReady(const std::array<uint32_t, SCREEN_X * SCREEN_Y> &frameBuffer) = 0;
+    // Called by the thread drawing the frames after each one is published. The display can pick up the newest frame
+    // from frames on one thread of its choosing, and can hold on to frames after the Ppu is gone.
+    virtual void FrameReady(const std::shared_ptr<TripleBuffer> &frames) = 0;
     virtual void RequestMessageBox(const std::string &message) = 0;
 
 protected:
@@ -66,17 +66,22 @@ bool Emulator::LoadRom(const std::string &filename)
     // This can't be done in the Memory constructor since Timer doesn't exist yet.
     memory->SetTimer(timer);
     ppu = new Ppu(memory, timer, displayInterface, debuggerInterface);
+    ppu->StartRenderThread();
     memory->SetPpu(ppu);
     input = new Input(memory, timer);
     cpu = new Cpu(memory, timer, interrupts);
     apu = new Apu(memory, timer/*, audioInterface, gameSpeedSubject*/);
 
     memory->SetCartridge(&cartridge);
+    // SRAM is handed to the writer thread at VBlank.
+    timer->AttachVBlankObserver(&cartridge);
 
     // Set enabled layers based on what the GUI has enabled.
     for (int i = 0; i < 5; i++)
         ppu->ToggleLayer(i, enabledLayers[i]);
 
+    cartridge.StartSramWriter();
+
     workThread = std::thread(&Emulator::ThreadFunc, this);
 
     return true;
@@ -138,6 +143,22 @@ void Emulator::ToggleLayer(int layer, bool enabled)
 }
 
 
+bool Emulator::StartPpuCapture(const std::string &filename)
+{
+    // The emulation thread runs and deletes the Ppu while it holds this.
+    std::lock_guard<std::mutex> lock(saveStateMutex);
+    return ppu && ppu->StartCapture(filename);
+}
+
+
+void Emulator::StopPpuCapture()
+{
+    std::lock_guard<std::mutex> lock(saveStateMutex);
+    if (ppu)
+        ppu->StopCapture();
+}
+
+
 void Emulator::SaveState(int slot)
 {
     (void)slot;
@@ -208,7 +229,8 @@ void Emulator::ThreadFunc()
             //quit = true;
         }
 
-        cartridge.SaveSram();
+        // Save any SRAM writes the writer thread hasn't gotten to yet.
+        cartridge.StopSramWriter();
     }
     catch(const std::exception& e)
     {
@@ -227,6 +249,8 @@ void Emulator::ThreadFunc()
     // TODO: Add proper thread sync later. I don't feel like dealing with this now.
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
+    // Capture requests from the GUI thread use the Ppu under this lock, so it can't be deleted out from under them.
+    std::lock_guard<std::mutex> lock(saveStateMutex);
     delete apu;
     apu = nullptr;
     delete cpu;
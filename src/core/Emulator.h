@@ -33,6 +33,9 @@ public:
     void ButtonPressed(Buttons::Button button);
     void ButtonReleased(Buttons::Button button);
     void ToggleLayer(int layer, bool enabled);
+    // Captures what the PPU draws, for PpuBench. The capture stops when the ROM is closed.
+    bool StartPpuCapture(const std::string &filename);
+    void StopPpuCapture();
 
     void SaveState(int slot);
     void LoadState(int slot);
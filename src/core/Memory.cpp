@@ -343,7 +343,15 @@ uint8_t *Memory::GetBytePtr(uint32_t addr)
     if ((addr & 0x40FF00) == 0x4300)
         return &ioPorts43[addr & 0xFF];
 
-    return cart->GetBytePtr(addr);
+    return cart->GetSramPtr(addr);
+}
+
+
+const uint8_t *Memory::GetReadOnlyBytePtr(uint32_t addr)
+{
+    // Everything but ROM is writable.
+    const uint8_t *ptr = GetBytePtr(addr);
+    return ptr ? ptr : cart->GetBytePtr(addr);
 }
 
 
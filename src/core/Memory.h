@@ -40,7 +40,7 @@ public:
     // Bypasses special read code. Only use for Debugger.
     uint8_t ReadRaw8Bit(uint32_t addr) //const
     {
-        return *GetBytePtr(addr);
+        return *GetReadOnlyBytePtr(addr);
     }
 
     // Reads that don't wrap at bank boundaries. E.G. Read16Bit(0x12FFFF) will read from 0x12FFFF and 0x130000.
@@ -127,7 +127,9 @@ public:
 
     // Bypasses checking of reads/writes from/to special addresses. Don't use unless you know what you are doing.
     // Since there is not a flat memory model, incrementing the pointer could do bad things.
+    // ROM is mapped read-only, so this returns null for ROM addresses. Use GetReadOnlyBytePtr to read them.
     uint8_t *GetBytePtr(uint32_t addr);
+    const uint8_t *GetReadOnlyBytePtr(uint32_t addr);
 
     inline uint8_t GetOpenBusValue() const {return openBusValue;}
 
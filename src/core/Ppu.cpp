@@ -1,13 +1,19 @@
+#include <algorithm>
+#include <atomic>
+
 #include "Bgr555.h"
+#include "ColorMath.h"
 #include "IoRegisters.h"
 #include "DebuggerInterface.h"
 #include "Memory.h"
 #include "Ppu.h"
+#include "PpuCapture.h"
 #include "PpuConstants.h"
 #include "Timer.h"
 
 
-uint16_t Ppu::PixelInfo::color0 = 0;
+// Each Ppu gets its own line signature epoch, except the bands of a Ppu, which share one.
+static std::atomic<uint64_t> nextSignatureEpoch{1};
 
 
 Ppu::Ppu(Memory *memory, Timer *timer, DisplayInterface *displayInterface, DebuggerInterface *debuggerInterface) :
@@ -15,73 +21,109 @@ Ppu::Ppu(Memory *memory, Timer *timer, DisplayInterface *displayInterface, Debug
     timer(timer),
     debuggerInterface(debuggerInterface),
     displayInterface(displayInterface),
-    regINIDISP(memory->RequestOwnership(eRegINIDISP, this)),
-    regOBJSEL(memory->RequestOwnership(eRegOBJSEL, this)),
-    regOAMADDL(memory->RequestOwnership(eRegOAMADDL, this)),
-    regOAMADDH(memory->RequestOwnership(eRegOAMADDH, this)),
-    regOAMDATA(memory->RequestOwnership(eRegOAMDATA, this)),
-    regBGMODE(memory->RequestOwnership(eRegBGMODE, this)),
-    regMOSAIC(memory->RequestOwnership(eRegMOSAIC, this)),
-    regBG1SC(memory->RequestOwnership(eRegBG1SC, this)),
-    regBG2SC(memory->RequestOwnership(eRegBG2SC, this)),
-    regBG3SC(memory->RequestOwnership(eRegBG3SC, this)),
-    regBG4SC(memory->RequestOwnership(eRegBG4SC, this)),
-    regBG12NBA(memory->RequestOwnership(eRegBG12NBA, this)),
-    regBG34NBA(memory->RequestOwnership(eRegBG34NBA, this)),
-    regBG1HOFS(memory->RequestOwnership(eRegBG1HOFS, this)),
-    regBG1VOFS(memory->RequestOwnership(eRegBG1VOFS, this)),
-    regBG2HOFS(memory->RequestOwnership(eRegBG2HOFS, this)),
-    regBG2VOFS(memory->RequestOwnership(eRegBG2VOFS, this)),
-    regBG3HOFS(memory->RequestOwnership(eRegBG3HOFS, this)),
-    regBG3VOFS(memory->RequestOwnership(eRegBG3VOFS, this)),
-    regBG4HOFS(memory->RequestOwnership(eRegBG4HOFS, this)),
-    regBG4VOFS(memory->RequestOwnership(eRegBG4VOFS, this)),
-    regVMAIN(memory->RequestOwnership(eRegVMAIN, this)),
-    regVMADDL(memory->RequestOwnership(eRegVMADDL, this)),
-    regVMADDH(memory->RequestOwnership(eRegVMADDH, this)),
-    regVMDATAL(memory->RequestOwnership(eRegVMDATAL, this)),
-    regVMDATAH(memory->RequestOwnership(eRegVMDATAH, this)),
-    regM7SEL(memory->RequestOwnership(eRegM7SEL, this)),
-    regM7A(memory->RequestOwnership(eRegM7A, this)),
-    regM7B(memory->RequestOwnership(eRegM7B, this)),
-    regM7C(memory->RequestOwnership(eRegM7C, this)),
-    regM7D(memory->RequestOwnership(eRegM7D, this)),
-    regM7X(memory->RequestOwnership(eRegM7X, this)),
-    regM7Y(memory->RequestOwnership(eRegM7Y, this)),
-    regCGADD(memory->RequestOwnership(eRegCGADD, this)),
-    regCGDATA(memory->RequestOwnership(eRegCGDATA, this)),
-    regW12SEL(memory->RequestOwnership(eRegW12SEL, this)),
-    regW34SEL(memory->RequestOwnership(eRegW34SEL, this)),
-    regWOBJSEL(memory->RequestOwnership(eRegWOBJSEL, this)),
-    regWH0(memory->RequestOwnership(eRegWH0, this)),
-    regWH1(memory->RequestOwnership(eRegWH1, this)),
-    regWH2(memory->RequestOwnership(eRegWH2, this)),
-    regWH3(memory->RequestOwnership(eRegWH3, this)),
-    regWBGLOG(memory->RequestOwnership(eRegWBGLOG, this)),
-    regWOBJLOG(memory->RequestOwnership(eRegWOBJLOG, this)),
-    regTM(memory->RequestOwnership(eRegTM, this)),
-    regTS(memory->RequestOwnership(eRegTS, this)),
-    regTMW(memory->RequestOwnership(eRegTMW, this)),
-    regTSW(memory->RequestOwnership(eRegTSW, this)),
-    regCGWSEL(memory->RequestOwnership(eRegCGWSEL, this)),
-    regCGADSUB(memory->RequestOwnership(eRegCGADSUB, this)),
-    regCOLDATA(memory->RequestOwnership(eRegCOLDATA, this)),
-    regSETINI(memory->RequestOwnership(eRegSETINI, this)),
-    regMPYL(memory->RequestOwnership(eRegMPYL, this)),
-    regMPYM(memory->RequestOwnership(eRegMPYM, this)),
-    regMPYH(memory->RequestOwnership(eRegMPYH, this)),
-    regSLHV(memory->RequestOwnership(eRegSLHV, this)),
-    regRDOAM(memory->RequestOwnership(eRegRDOAM, this)),
-    regRDVRAML(memory->RequestOwnership(eRegRDVRAML, this)),
-    regRDVRAMH(memory->RequestOwnership(eRegRDVRAMH, this)),
-    regRDCGRAM(memory->RequestOwnership(eRegRDCGRAM, this)),
-    regOPHCT(memory->RequestOwnership(eRegOPHCT, this)),
-    regOPVCT(memory->RequestOwnership(eRegOPVCT, this)),
-    regSTAT77(memory->RequestOwnership(eRegSTAT77, this)),
-    regSTAT78(memory->RequestOwnership(eRegSTAT78, this))
+    regINIDISP(BindRegister(eRegINIDISP)),
+    regOBJSEL(BindRegister(eRegOBJSEL)),
+    regOAMADDL(BindRegister(eRegOAMADDL)),
+    regOAMADDH(BindRegister(eRegOAMADDH)),
+    regOAMDATA(BindRegister(eRegOAMDATA)),
+    regBGMODE(BindRegister(eRegBGMODE)),
+    regMOSAIC(BindRegister(eRegMOSAIC)),
+    regBG1SC(BindRegister(eRegBG1SC)),
+    regBG2SC(BindRegister(eRegBG2SC)),
+    regBG3SC(BindRegister(eRegBG3SC)),
+    regBG4SC(BindRegister(eRegBG4SC)),
+    regBG12NBA(BindRegister(eRegBG12NBA)),
+    regBG34NBA(BindRegister(eRegBG34NBA)),
+    regBG1HOFS(BindRegister(eRegBG1HOFS)),
+    regBG1VOFS(BindRegister(eRegBG1VOFS)),
+    regBG2HOFS(BindRegister(eRegBG2HOFS)),
+    regBG2VOFS(BindRegister(eRegBG2VOFS)),
+    regBG3HOFS(BindRegister(eRegBG3HOFS)),
+    regBG3VOFS(BindRegister(eRegBG3VOFS)),
+    regBG4HOFS(BindRegister(eRegBG4HOFS)),
+    regBG4VOFS(BindRegister(eRegBG4VOFS)),
+    regVMAIN(BindRegister(eRegVMAIN)),
+    regVMADDL(BindRegister(eRegVMADDL)),
+    regVMADDH(BindRegister(eRegVMADDH)),
+    regVMDATAL(BindRegister(eRegVMDATAL)),
+    regVMDATAH(BindRegister(eRegVMDATAH)),
+    regM7SEL(BindRegister(eRegM7SEL)),
+    regM7A(BindRegister(eRegM7A)),
+    regM7B(BindRegister(eRegM7B)),
+    regM7C(BindRegister(eRegM7C)),
+    regM7D(BindRegister(eRegM7D)),
+    regM7X(BindRegister(eRegM7X)),
+    regM7Y(BindRegister(eRegM7Y)),
+    regCGADD(BindRegister(eRegCGADD)),
+    regCGDATA(BindRegister(eRegCGDATA)),
+    regW12SEL(BindRegister(eRegW12SEL)),
+    regW34SEL(BindRegister(eRegW34SEL)),
+    regWOBJSEL(BindRegister(eRegWOBJSEL)),
+    regWH0(BindRegister(eRegWH0)),
+    regWH1(BindRegister(eRegWH1)),
+    regWH2(BindRegister(eRegWH2)),
+    regWH3(BindRegister(eRegWH3)),
+    regWBGLOG(BindRegister(eRegWBGLOG)),
+    regWOBJLOG(BindRegister(eRegWOBJLOG)),
+    regTM(BindRegister(eRegTM)),
+    regTS(BindRegister(eRegTS)),
+    regTMW(BindRegister(eRegTMW)),
+    regTSW(BindRegister(eRegTSW)),
+    regCGWSEL(BindRegister(eRegCGWSEL)),
+    regCGADSUB(BindRegister(eRegCGADSUB)),
+    regCOLDATA(BindRegister(eRegCOLDATA)),
+    regSETINI(BindRegister(eRegSETINI)),
+    regMPYL(BindRegister(eRegMPYL)),
+    regMPYM(BindRegister(eRegMPYM)),
+    regMPYH(BindRegister(eRegMPYH)),
+    regSLHV(BindRegister(eRegSLHV)),
+    regRDOAM(BindRegister(eRegRDOAM)),
+    regRDVRAML(BindRegister(eRegRDVRAML)),
+    regRDVRAMH(BindRegister(eRegRDVRAMH)),
+    regRDCGRAM(BindRegister(eRegRDCGRAM)),
+    regOPHCT(BindRegister(eRegOPHCT)),
+    regOPVCT(BindRegister(eRegOPVCT)),
+    regSTAT77(BindRegister(eRegSTAT77)),
+    regSTAT78(BindRegister(eRegSTAT78))
+{
+    outputPalette.fill(ToOutputColor(0));
+    signatureEpoch = nextSignatureEpoch++;
+
+    if (timer)
+    {
+        timer->AttachHBlankObserver(this);
+        timer->AttachVBlankObserver(this);
+    }
+}
+
+
+Ppu::Ppu(DisplayInterface *displayInterface) :
+    Ppu(nullptr, nullptr, displayInterface)
 {
-    timer->AttachHBlankObserver(this);
-    timer->AttachVBlankObserver(this);
+
+}
+
+
+Ppu::~Ppu()
+{
+    {
+        std::lock_guard<std::mutex> lock(renderMutex);
+        stopRendering = true;
+    }
+    renderCv.notify_all();
+
+    for (std::thread &thread : renderThreads)
+        thread.join();
+}
+
+
+uint8_t &Ppu::BindRegister(EIORegisters ioReg)
+{
+    // The render thread's copy doesn't own any registers in Memory.
+    if (!memory)
+        return shadowRegisters[ioReg - eRegINIDISP];
+
+    return memory->RequestOwnership(ioReg, this);
 }
 
 
@@ -101,7 +143,279 @@ void Ppu::LatchCounters(bool force)
 void Ppu::ToggleLayer(int layer, bool enabled)
 {
     if (layer >= eBG1 && layer <= eOBJ)
+    {
         enableLayer[layer] = enabled;
+        windowChanged = true;
+    }
+
+    for (std::unique_ptr<Ppu> &renderer : renderers)
+        renderer->ToggleLayer(layer, enabled);
+}
+
+
+void Ppu::SetPixelFormat(EPixelFormat format)
+{
+    // The renderers get it from the log when it's latched.
+    nextPixelFormat = format;
+}
+
+
+bool Ppu::StartCapture(const std::string &path)
+{
+    std::unique_ptr<PpuCapture> newCapture(new PpuCapture());
+    if (!newCapture->Create(path))
+        return false;
+
+    capture = std::move(newCapture);
+    return true;
+}
+
+
+void Ppu::StopCapture()
+{
+    capture.reset();
+}
+
+
+void Ppu::InvalidateTileCache()
+{
+    tileCache.InvalidateAll();
+
+    // Memory might have been changed through the debugging pointers, so no line can be reused.
+    writeCount++;
+    vramRegionWrites.fill(writeCount);
+    cgramWrite = writeCount;
+    oamWrite = writeCount;
+
+    if (!renderers.empty())
+    {
+        WaitForRenderer();
+        for (std::unique_ptr<Ppu> &renderer : renderers)
+        {
+            renderer->vram = vram;
+            renderer->InvalidateTileCache();
+        }
+    }
+}
+
+
+void Ppu::StartRenderThread()
+{
+    StartRenderThreads(1);
+}
+
+
+void Ppu::StartBandRendering(unsigned int threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    StartRenderThreads(std::min(threadCount, 224u));
+}
+
+
+void Ppu::StartRenderThreads(unsigned int bandCount)
+{
+    if (!renderers.empty())
+        return;
+
+    // The bands replay the same writes, so their write counts stay the same, and they can share an epoch.
+    const uint64_t bandEpoch = nextSignatureEpoch++;
+
+    for (unsigned int i = 0; i < bandCount; i++)
+    {
+        renderers.emplace_back(new Ppu(displayInterface));
+        renderers[i]->frames = frames;
+        renderers[i]->pixelFormat = pixelFormat;
+        renderers[i]->nextPixelFormat = pixelFormat;
+        renderers[i]->signatureEpoch = bandEpoch;
+        for (int layer = eBG1; layer <= eOBJ; layer++)
+            renderers[i]->ToggleLayer(layer, enableLayer[layer]);
+
+        // The last band also gets any lines past 224.
+        if (bandCount > 1)
+        {
+            renderers[i]->bandStart = (224 * i) / bandCount;
+            renderers[i]->bandEnd = i == bandCount - 1 ? ALL_LINES : (224 * (i + 1)) / bandCount;
+        }
+    }
+
+    bandsRunning = bandCount;
+    nextLog.assign(bandCount, 0);
+    for (unsigned int i = 0; i < bandCount; i++)
+        renderThreads.emplace_back(&Ppu::RenderThreadFunc, this, i);
+}
+
+
+void Ppu::StopBands()
+{
+    if (renderers.size() < 2)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(renderMutex);
+        bandsRunning = 1;
+    }
+    renderCv.notify_all();
+
+    for (size_t i = 1; i < renderThreads.size(); i++)
+        renderThreads[i].join();
+    renderThreads.resize(1);
+
+    // The first renderer takes over the whole frame. The lines the other bands have already drawn are in the shared
+    // back buffer, but it needs the sprite overflow flags they set.
+    Ppu *first = renderers[0].get();
+    for (size_t i = 1; i < renderers.size(); i++)
+        first->regSTAT77 |= renderers[i]->regSTAT77 & 0xC0;
+    first->lastLineSignatures.fill({});
+    first->bandStart = 0;
+    first->bandEnd = ALL_LINES;
+
+    renderers.resize(1);
+    nextLog.resize(1);
+}
+
+
+void Ppu::LogEvent(ELogEvent event, uint16_t ioReg, uint8_t value)
+{
+    const uint16_t dot = timer ? timer->GetHCount() : 0;
+    const LogEntry entry = {static_cast<uint16_t>(scanline), dot, event, value, ioReg};
+
+    if (!renderers.empty())
+        logEntries.push_back(entry);
+    if (capture)
+        capture->RecordEntry(entry);
+}
+
+
+void Ppu::FlushLog()
+{
+    // A single renderer gets the log every line. Bands get it every frame, so only allow one frame to be queued.
+    const size_t maxQueuedLogs = renderers.size() == 1 ? MAX_QUEUED_LINES : 1;
+
+    std::unique_lock<std::mutex> lock(renderMutex);
+    renderCv.wait(lock, [this, maxQueuedLogs]() {return queuedLogs.size() < maxQueuedLogs;});
+
+    queuedLogs.push_back(std::make_shared<const std::vector<LogEntry>>(std::move(logEntries)));
+    logEntries.clear();
+
+    renderCv.notify_all();
+}
+
+
+void Ppu::WaitForRenderer()
+{
+    FlushLog();
+
+    std::unique_lock<std::mutex> lock(renderMutex);
+    renderCv.wait(lock, [this]() {return queuedLogs.empty() && busyRenderers == 0;});
+
+    // The sprite overflow flags are set while drawing.
+    regSTAT77 &= 0x3F;
+    for (std::unique_ptr<Ppu> &renderer : renderers)
+        regSTAT77 |= renderer->regSTAT77 & 0xC0;
+}
+
+
+void Ppu::FinishBand(Ppu *renderer)
+{
+    std::unique_lock<std::mutex> lock(renderMutex);
+
+    // Wait for the other bands, so none of them start drawing the next frame before this one is put together.
+    if (++bandsFinished < bandsRunning)
+    {
+        const uint64_t frame = framesFinished;
+        renderCv.wait(lock, [this, frame]() {return stopRendering || framesFinished != frame;});
+        return;
+    }
+
+    // Every band draws into the same back buffer, so publish it before any of them start on the next frame. This
+    // thread's renderer has replayed the whole frame, so it knows how the frame is laid out. This Ppu has moved on.
+    renderer->PublishFrame();
+
+    bandsFinished = 0;
+    framesFinished++;
+    renderCv.notify_all();
+    lock.unlock();
+
+    if (displayInterface)
+        displayInterface->FrameReady(frames);
+}
+
+
+void Ppu::RenderThreadFunc(unsigned int band)
+{
+    Ppu *renderer = renderers[band].get();
+    std::unique_lock<std::mutex> lock(renderMutex);
+
+    while (true)
+    {
+        renderCv.wait(lock, [this, band]()
+        {
+            return stopRendering || band >= bandsRunning || nextLog[band] < firstQueuedLog + queuedLogs.size();
+        });
+        if (stopRendering || band >= bandsRunning)
+            return;
+
+        std::shared_ptr<const std::vector<LogEntry>> log = queuedLogs[nextLog[band] - firstQueuedLog];
+        nextLog[band]++;
+        busyRenderers++;
+
+        // StopBands waits for every renderer to be idle, so this can't change while the log is replayed.
+        const bool isBand = bandsRunning > 1;
+
+        // Drop logs every renderer has started on.
+        while (!queuedLogs.empty() &&
+               *std::min_element(nextLog.begin(), nextLog.begin() + bandsRunning) > firstQueuedLog)
+        {
+            queuedLogs.pop_front();
+            firstQueuedLog++;
+        }
+
+        renderCv.notify_all();
+        lock.unlock();
+
+        for (const LogEntry &entry : *log)
+        {
+            renderer->ReplayLogEntry(entry);
+            if (entry.event == ELogEvent::VBlankStart && isBand)
+                FinishBand(renderer);
+        }
+
+        lock.lock();
+        busyRenderers--;
+        renderCv.notify_all();
+    }
+}
+
+
+void Ppu::ReplayLogEntry(const LogEntry &entry)
+{
+    switch (entry.event)
+    {
+        case ELogEvent::WriteRegister:
+            WriteRegister(static_cast<EIORegisters>(entry.ioReg), entry.value);
+            break;
+        case ELogEvent::ReadRegister:
+            ReadRegister(static_cast<EIORegisters>(entry.ioReg));
+            break;
+        case ELogEvent::HBlankStart:
+            ProcessHBlankStart(entry.scanline);
+            break;
+        case ELogEvent::HBlankEnd:
+            ProcessHBlankEnd(entry.scanline);
+            break;
+        case ELogEvent::VBlankStart:
+            ProcessVBlankStart();
+            break;
+        case ELogEvent::VBlankEnd:
+            ProcessVBlankEnd();
+            break;
+        case ELogEvent::SetPixelFormat:
+            pixelFormat = static_cast<EPixelFormat>(entry.value);
+            nextPixelFormat = pixelFormat;
+            break;
+    }
 }
 
 
@@ -109,6 +423,10 @@ uint8_t Ppu::ReadRegister(EIORegisters ioReg)
 {
     LogPpu("Ppu::ReadRegister %04X", ioReg);
 
+    // Reading OAM and VRAM moves their addresses, so the renderer needs to see those reads.
+    if (IsLogging() && (ioReg == eRegRDOAM || ioReg == eRegRDVRAML || ioReg == eRegRDVRAMH))
+        LogEvent(ELogEvent::ReadRegister, ioReg);
+
     switch (ioReg)
     {
         case eRegOAMDATA: // 0x2104
@@ -249,6 +567,13 @@ uint8_t Ppu::ReadRegister(EIORegisters ioReg)
             return (ppu2OpenBus = regOPVCT);
 
         case eRegSTAT77: // 0x213E
+            // The sprite overflow flags depend on drawing, so stop running ahead of the renderer from now on.
+            if (!renderers.empty() && !renderSync)
+            {
+                WaitForRenderer();
+                StopBands();
+                renderSync = true;
+            }
             return (ppu1OpenBus = ((regSTAT77 & 0xE0) | (ppu1OpenBus & 0x10) | 0x01));
 
         case eRegSTAT78: // 0x213F
@@ -270,18 +595,27 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
 {
     LogPpu("Ppu::WriteRegister %04X, %02X", ioReg, byte);
 
+    if (IsLogging())
+        LogEvent(ELogEvent::WriteRegister, ioReg, byte);
+
     switch (ioReg)
     {
         case eRegINIDISP: // 0x2100
             regINIDISP = byte;
             isForcedBlank = byte & 0x80;
-            brightness = byte & 0x0F;
+            SetBrightness(byte & 0x0F);
             // TODO: reset oamRwAddr if this is written on the first scanline of vblank (225/240).
             LogPpu("ForcedBlank=%d Brightness=%d", isForcedBlank, brightness);
             return true;
 
         case eRegOBJSEL: // 0x2101
             regOBJSEL = byte;
+            if ((byte >> 5) != objSize)
+            {
+                // Every sprite's size changes.
+                dirtySprites[0] = ~0UL;
+                dirtySprites[1] = ~0UL;
+            }
             objSize = byte >> 5;
             //objGap = (byte >> 3) & 0x03;
             objBaseAddr[0] = (byte & 0x03) << 14;
@@ -318,13 +652,20 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             if (oamRwAddr >= 0x200)
             {
                 // Only the last 5 bits count. Anything higher than 0x21F is mirrored.
+                if (oam[0x200 | (oamRwAddr & 0x1F)] != byte)
+                    oamWrite = ++writeCount;
                 oam[0x200 | (oamRwAddr & 0x1F)] = byte;
+                // Each byte has the high bits of 4 sprites.
+                dirtySprites[(oamRwAddr & 0x1F) >> 4] |= 0x0FUL << ((oamRwAddr & 0x0F) << 2);
                 LogPpu("Writing byte to high oam %04X(%04X)=%02X", oamRwAddr, (0x200 | (oamRwAddr & 0x1F)), byte);
             }
             else if (oamRwAddr & 0x01)
             {
+                if (oam[oamRwAddr - 1] != oamLatch || oam[oamRwAddr] != byte)
+                    oamWrite = ++writeCount;
                 oam[oamRwAddr - 1] = oamLatch;
                 oam[oamRwAddr] = byte;
+                dirtySprites[oamRwAddr >> 8] |= 1UL << ((oamRwAddr >> 2) & 0x3F);
                 LogPpu("Writing word to oam %04X=%02X%02X", oamRwAddr, byte, oamLatch);
             }
             // 0-0x21F are valid, anything above is mirrored.
@@ -334,14 +675,12 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
         case eRegBGMODE: // 0x2105
             regBGMODE = byte;
             bgMode = byte & 0x07;
-            bgMode1Bg3Priority = Bytes::GetBit<3>(byte);
+            priorityTable = (bgMode == 1 && Bytes::TestBit<3>(byte)) ? MODE1_BG3_PRIORITY : bgMode;
             bgChrSize[0] = 8 << Bytes::GetBit<4>(byte);
             bgChrSize[1] = 8 << Bytes::GetBit<5>(byte);
             bgChrSize[2] = 8 << Bytes::GetBit<6>(byte);
             bgChrSize[3] = 8 << Bytes::GetBit<7>(byte);
-            LogPpu("bgMode=%d bg3Prio=%d bgChrSize=%d,%d,%d,%d", bgMode, bgMode1Bg3Priority, bgChrSize[0], bgChrSize[1], bgChrSize[2], bgChrSize[3]);
-            if (bgMode == 2 || bgMode == 4 || bgMode == 6)
-                LogWarning("Mode %d OPT NYI", bgMode);
+            LogPpu("bgMode=%d bg3Prio=%d bgChrSize=%d,%d,%d,%d", bgMode, Bytes::GetBit<3>(byte), bgChrSize[0], bgChrSize[1], bgChrSize[2], bgChrSize[3]);
             return true;
 
         case eRegMOSAIC: // 0x2106
@@ -496,7 +835,10 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
         {
             regVMDATAL = byte;
             uint16_t addr = TranslateVramAddress(vramRwAddr, vramAddrTranslation);
+            if (vram[addr] != byte)
+                vramRegionWrites[addr >> 10] = ++writeCount;
             vram[addr] = byte;
+            tileCache.Invalidate(addr);
             LogPpu("Write to vram %04X=%02X", addr, byte);
             if (!isVramIncrementOnHigh)
             {
@@ -510,7 +852,10 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
         {
             regVMDATAH = byte;
             uint16_t addr = TranslateVramAddress(vramRwAddr, vramAddrTranslation) + 1;
+            if (vram[addr] != byte)
+                vramRegionWrites[addr >> 10] = ++writeCount;
             vram[addr] = byte;
+            tileCache.Invalidate(addr);
             LogPpu("Write to vram %04X=%02X", addr, byte);
             if (isVramIncrementOnHigh)
             {
@@ -594,14 +939,13 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             else
             {
                 byte &= 0x7F;
+                if (cgram[cgramRwAddr - 1] != cgramLatch || cgram[cgramRwAddr] != byte)
+                    cgramWrite = ++writeCount;
                 cgram[cgramRwAddr - 1] = cgramLatch;
                 cgram[cgramRwAddr] = byte;
+                UpdateOutputPalette(cgramRwAddr >> 1);
                 LogPpu("Writing word to cgram %04X %02X%02X", cgramRwAddr - 1, byte, cgramLatch);
 
-                uint16_t color = Bytes::Make16Bit(byte, cgramLatch);
-
-                if ((cgramRwAddr >> 1) == 0)
-                    PixelInfo::color0 = color;
             }
             cgramRwAddr = (cgramRwAddr + 1) & 0x1FF;
             return true;
@@ -710,6 +1054,8 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             return true;
 
         case eRegTM: // 0x212C
+            if (byte != regTM)
+                windowChanged = true;
             regTM = byte;
             mainScreenLayerEnabled[eBG1] = Bytes::GetBit<0>(byte);
             mainScreenLayerEnabled[eBG2] = Bytes::GetBit<1>(byte);
@@ -721,6 +1067,8 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             return true;
 
         case eRegTS: // 0x212D
+            if (byte != regTS)
+                windowChanged = true;
             regTS = byte;
             subScreenLayerEnabled[eBG1] = Bytes::GetBit<0>(byte);
             subScreenLayerEnabled[eBG2] = Bytes::GetBit<1>(byte);
@@ -732,6 +1080,8 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             return true;
 
         case eRegTMW: // 0x212E
+            if (byte != regTMW)
+                windowChanged = true;
             regTMW = byte;
             mainScreenWindowEnabled[eBG1] = Bytes::GetBit<0>(byte);
             mainScreenWindowEnabled[eBG2] = Bytes::GetBit<1>(byte);
@@ -743,6 +1093,8 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             return true;
 
         case eRegTSW: // 0x212F
+            if (byte != regTSW)
+                windowChanged = true;
             regTSW = byte;
             subScreenWindowEnabled[eBG1] = Bytes::GetBit<0>(byte);
             subScreenWindowEnabled[eBG2] = Bytes::GetBit<1>(byte);
@@ -754,6 +1106,8 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
             return true;
 
         case eRegCGWSEL: // 0x2130
+            if (byte != regCGWSEL)
+                windowChanged = true;
             regCGWSEL = byte;
             colDirectMode = Bytes::TestBit<0>(byte);
             colAddend = Bytes::TestBit<1>(byte);
@@ -794,7 +1148,10 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
 
         case eRegSETINI: // 0x2133
             regSETINI = byte;
-            LogPpu("ExtSync=%d ExtBg=%d HiRes=%d Overscan=%d, ObjInterlace=%d ScreenInterlace=%d NYI", Bytes::GetBit<7>(byte), Bytes::GetBit<6>(byte), Bytes::GetBit<3>(byte), Bytes::GetBit<2>(byte), Bytes::GetBit<1>(byte), Bytes::GetBit<0>(byte));
+            isPseudoHiRes = Bytes::TestBit<3>(byte);
+            isOverscan = Bytes::TestBit<2>(byte);
+            isInterlace = Bytes::TestBit<0>(byte);
+            LogPpu("ExtSync=%d ExtBg=%d HiRes=%d Overscan=%d, ObjInterlace=%d ScreenInterlace=%d", Bytes::GetBit<7>(byte), Bytes::GetBit<6>(byte), Bytes::GetBit<3>(byte), Bytes::GetBit<2>(byte), Bytes::GetBit<1>(byte), Bytes::GetBit<0>(byte));
             return true;
 
         default:
@@ -806,9 +1163,20 @@ bool Ppu::WriteRegister(EIORegisters ioReg, uint8_t byte)
 
  void Ppu::ProcessHBlankStart(uint32_t scanline)
  {
+    if (IsLogging())
+        LogEvent(ELogEvent::HBlankStart);
+
+    if (!renderers.empty())
+    {
+        if (renderSync)
+            WaitForRenderer();
+        else if (renderers.size() == 1)
+            FlushLog();
+        return;
+    }
+
     // We reached the end of the scanline, so draw it.
-    // TODO: Check for number of scanlines per screen in regSETINI.
-    if (scanline < 224)
+    if (scanline < static_cast<uint32_t>(GetLineCount()) && scanline >= bandStart && scanline < bandEnd)
         DrawScanline(scanline);
  }
 
@@ -817,6 +1185,9 @@ void Ppu::ProcessHBlankEnd(uint32_t scanline)
 {
     // We started a new scanline.
     this->scanline = scanline;
+
+    if (IsLogging())
+        LogEvent(ELogEvent::HBlankEnd);
 }
 
 
@@ -826,12 +1197,41 @@ void Ppu::ProcessVBlankStart()
     if (!isForcedBlank)
         oamRwAddr = Bytes::Make16Bit(regOAMADDH & 0x01, regOAMADDL) << 1; // Word address.
 
-    DrawScreen();
+    if (IsLogging())
+        LogEvent(ELogEvent::VBlankStart);
+    if (capture)
+        capture->EndFrame();
+
+    // The renderer shows the frame after it has drawn it.
+    if (!renderers.empty())
+    {
+        FlushLog();
+        return;
+    }
+
+    // When drawing in bands, the Ppu that owns the bands puts them together and shows the frame.
+    if (bandStart == 0 && bandEnd == ALL_LINES)
+        DrawScreen();
 }
 
 
 void Ppu::ProcessVBlankEnd()
 {
+    // A captured frame starts with the state from before this, so replaying its first event changes field the same way.
+    if (capture)
+        capture->BeginFrame(*this);
+
+    // The format only changes between frames.
+    if (nextPixelFormat != pixelFormat)
+    {
+        pixelFormat = nextPixelFormat;
+        if (IsLogging())
+            LogEvent(ELogEvent::SetPixelFormat, 0, static_cast<uint8_t>(pixelFormat));
+    }
+
+    if (IsLogging())
+        LogEvent(ELogEvent::VBlankEnd);
+
     // Clear sprite overflow flags.
     if (!isForcedBlank)
     {
@@ -841,162 +1241,110 @@ void Ppu::ProcessVBlankEnd()
 
     // Reset which scanline is the starting vertical block for mosaic.
     bgMosaicStartScanline = 1;
+
+    // The field is in bit 7 of STAT78, even when the screen isn't interlaced.
+    field ^= 1;
+
+    // Frames change height when interlacing starts or stops, so the lines are in different rows.
+    if (isFrameInterlaced != isInterlace)
+        lastLineSignatures.fill({});
+    isFrameInterlaced = isInterlace;
+    if (field)
+        Bytes::SetBit<7>(regSTAT78);
+    else
+        Bytes::ClearBit<7>(regSTAT78);
 }
 
 
-void Ppu::GenerateWindowBitmaps()
+void Ppu::GenerateWindowMasks()
 {
-    memset(windowBitmap, 0, sizeof(windowBitmap));
-
     for (int bg = 0; bg < 6; bg++)
     {
+        WindowMask &mask = windowMask[bg];
+        mask.fill(0);
+
         if (bgEnableWindow[bg][0] && !bgEnableWindow[bg][1])
         {
             // Only window 0.
-            GenerateWindowLayerBitmap(static_cast<EBgLayer>(bg), 0, windowBitmap[bg]);
+            GenerateWindowLayerMask(static_cast<EBgLayer>(bg), 0, mask);
         }
         else if (!bgEnableWindow[bg][0] && bgEnableWindow[bg][1])
         {
             // Only window 1.
-            GenerateWindowLayerBitmap(static_cast<EBgLayer>(bg), 1, windowBitmap[bg]);
+            GenerateWindowLayerMask(static_cast<EBgLayer>(bg), 1, mask);
         }
         else if (bgEnableWindow[bg][0] && bgEnableWindow[bg][1])
         {
             // Both windows. Use combination logic.
-            uint64_t other[4] = {0};
-            GenerateWindowLayerBitmap(static_cast<EBgLayer>(bg), 0, windowBitmap[bg]);
-            GenerateWindowLayerBitmap(static_cast<EBgLayer>(bg), 1, other);
+            WindowMask other = {0};
+            GenerateWindowLayerMask(static_cast<EBgLayer>(bg), 0, mask);
+            GenerateWindowLayerMask(static_cast<EBgLayer>(bg), 1, other);
 
             switch (bgWindowMask[bg])
             {
-                case 0:
-                    windowBitmap[bg][0] |= other[0];
-                    windowBitmap[bg][1] |= other[1];
-                    windowBitmap[bg][2] |= other[2];
-                    windowBitmap[bg][3] |= other[3];
+                case 0: // OR
+                    for (int x = 0; x < WINDOW_X; x++)
+                        mask[x] |= other[x];
                     break;
-                case 1:
-                    windowBitmap[bg][0] &= other[0];
-                    windowBitmap[bg][1] &= other[1];
-                    windowBitmap[bg][2] &= other[2];
-                    windowBitmap[bg][3] &= other[3];
+                case 1: // AND
+                    for (int x = 0; x < WINDOW_X; x++)
+                        mask[x] &= other[x];
                     break;
-                case 2:
-                    windowBitmap[bg][0] ^= other[0];
-                    windowBitmap[bg][1] ^= other[1];
-                    windowBitmap[bg][2] ^= other[2];
-                    windowBitmap[bg][3] ^= other[3];
+                case 2: // XOR
+                    for (int x = 0; x < WINDOW_X; x++)
+                        mask[x] ^= other[x];
                     break;
-                case 3:
-                    windowBitmap[bg][0] = !(windowBitmap[bg][0] ^ other[0]);
-                    windowBitmap[bg][1] = !(windowBitmap[bg][1] ^ other[1]);
-                    windowBitmap[bg][2] = !(windowBitmap[bg][2] ^ other[2]);
-                    windowBitmap[bg][3] = !(windowBitmap[bg][3] ^ other[3]);
+                case 3: // XNOR
+                    for (int x = 0; x < WINDOW_X; x++)
+                        mask[x] = ~(mask[x] ^ other[x]);
                     break;
             }
         }
     }
 
-    windowChanged = false;
-}
-
-
-void Ppu::GenerateWindowLayerBitmap(EBgLayer bg, uint8_t window, uint64_t *bitmap)
-{
-    if (windowLeft[window] > windowRight[window])
+    // Combine each layer's window with the screens it's enabled on, and the screens its window is enabled on.
+    for (int bg = eBG1; bg <= eOBJ; bg++)
     {
-        if (bgInvertWindow[bg][window])
-            memset(bitmap, 0xFF, 32);
-        return;
-    }
-
-    int startWord = windowLeft[window] / 64;
-    int startBit = windowLeft[window] % 64;
-    int endWord = windowRight[window] / 64;
-    int endBit = windowRight[window] % 64;
-
-    // Set bits in the first word
-    bitmap[startWord] = ~0UL << startBit;
+        const EBgLayer layer = static_cast<EBgLayer>(bg);
+        const uint8_t layerScreens = GetLayerScreens(layer);
+        const uint8_t windowScreens = (mainScreenWindowEnabled[bg] ? MAIN_SCREEN : 0) |
+                                      (subScreenWindowEnabled[bg] ? SUB_SCREEN : 0);
 
-    if (startWord == endWord)
-    {
-        // Start and end word are the same.
-        bitmap[startWord] &= ~0UL >> (63 - endBit);
+        for (int x = 0; x < WINDOW_X; x++)
+            layerScreenMask[bg][x] = layerScreens & ~(windowMask[bg][x] & windowScreens);
     }
-    else
-    {
-        // Set partial bits in end word.
-        bitmap[endWord] = ~0UL >> (63 - endBit);
 
-        // Set all bits in full words between start and end
-        for (int i = startWord + 1; i < endWord; i++)
-            bitmap[i] = ~0UL;
-    }
+    const uint8_t clipAlways = clipToBlack == EColorRegion::Always ? 0xFF : 0;
+    const uint8_t clipInside = clipToBlack == EColorRegion::Inside ? 0xFF : 0;
+    const uint8_t clipOutside = clipToBlack == EColorRegion::Outside ? 0xFF : 0;
+    const uint8_t preventAlways = preventColorMath == EColorRegion::Always ? 0xFF : 0;
+    const uint8_t preventInside = preventColorMath == EColorRegion::Inside ? 0xFF : 0;
+    const uint8_t preventOutside = preventColorMath == EColorRegion::Outside ? 0xFF : 0;
+    const WindowMask &colorWindow = windowMask[eCOL];
 
-    if (bgInvertWindow[bg][window])
+    for (int x = 0; x < WINDOW_X; x++)
     {
-        bitmap[0] ^= ~0UL;
-        bitmap[1] ^= ~0UL;
-        bitmap[2] ^= ~0UL;
-        bitmap[3] ^= ~0UL;
+        colorClipMask[x] = clipAlways | (clipInside & colorWindow[x]) | (clipOutside & ~colorWindow[x]);
+        colorPreventMask[x] = preventAlways | (preventInside & colorWindow[x]) | (preventOutside & ~colorWindow[x]);
     }
-}
-
 
-bool Ppu::IsPointInsideWindow(EBgLayer bg, uint16_t screenX) const
-{
-    int word = screenX / 64;
-    int bit = screenX % 64;
-
-    return windowBitmap[bg][word] & (1UL << bit);
-}
-
-
-Ppu::WindowInfo Ppu::GetBgWindowValue(EBgLayer bg, uint16_t screenX) const
-{
-    WindowInfo info;
-
-    info.isOnMainScreen = mainScreenWindowEnabled[bg];
-    info.isOnSubScreen = subScreenWindowEnabled[bg];
-
-    if (info.isOnMainScreen || info.isOnSubScreen)
-        info.isInside = IsPointInsideWindow(bg, screenX);
-
-    return info;
+    windowChanged = false;
 }
 
 
-uint8_t Ppu::GetTilePixelData(uint16_t addr, uint8_t xOff, uint8_t yOff, uint8_t bpp) const
+void Ppu::GenerateWindowLayerMask(EBgLayer bg, uint8_t window, WindowMask &mask)
 {
-    const uint8_t *tileData = &vram[addr];
-
-    xOff = 7 - xOff;
-    // Two bytes per pixel.
-    yOff = yOff << 1;
+    const uint8_t invert = bgInvertWindow[bg][window] ? 0xFF : 0;
 
-    uint8_t lowBit = (tileData[yOff] >> xOff) & 0x01;
-    uint8_t highBit = (tileData[yOff + 1] >> xOff) & 0x01;
-    uint8_t pixelVal = (highBit << 1) | lowBit;
-    if (bpp >= 4)
-    {
-        uint8_t lowBit2 = (tileData[yOff + 0x10] >> xOff) & 0x01;
-        uint8_t highBit2 = (tileData[yOff + 0x11] >> xOff) & 0x01;
-        pixelVal |= (highBit2 << 3) | (lowBit2 << 2);
-    }
-    if (bpp == 8)
-    {
-        uint8_t lowBit3 = (tileData[yOff + 0x20] >> xOff) & 0x01;
-        uint8_t highBit3 = (tileData[yOff + 0x21] >> xOff) & 0x01;
-        uint8_t lowBit4 = (tileData[yOff + 0x30] >> xOff) & 0x01;
-        uint8_t highBit4 = (tileData[yOff + 0x31] >> xOff) & 0x01;
-        pixelVal |= (highBit4 << 7) | (lowBit4 << 6) | (highBit3 << 5) | (lowBit3 << 4);
-    }
+    if (windowLeft[window] <= windowRight[window])
+        memset(&mask[windowLeft[window]], 0xFF, windowRight[window] - windowLeft[window] + 1);
 
-    return pixelVal;
+    for (int x = 0; x < WINDOW_X; x++)
+        mask[x] ^= invert;
 }
 
 
-uint16_t Ppu::GetBgTilemapEntry(EBgLayer bg, uint16_t tileX, uint16_t tileY) const
+uint16_t Ppu::GetBgTilemapEntry(EBgLayer bg, uint16_t tileX, uint16_t tileY)
 {
     // Compute the offset for 32x32 tilemap.
     uint16_t offset = (tileX & 0x1F) + ((tileY & 0x1F) * 32);
@@ -1018,97 +1366,278 @@ uint16_t Ppu::GetBgTilemapEntry(EBgLayer bg, uint16_t tileX, uint16_t tileY) con
 
     // Each tile is a word, so double the offset.
     offset = bgTilemapAddr[bg] + (offset << 1);
+    MarkVramRead(offset);
 
     uint16_t tileData = Bytes::Make16Bit(vram[offset + 1], vram[offset]);
     return tileData;
 }
 
 
-Ppu::PixelInfo Ppu::GetBgPixelInfo(EBgLayer bg, uint16_t screenX, uint16_t screenY)
+void Ppu::ReadOffsetPerTile()
 {
-    PixelInfo info;
-    uint8_t bpp = BG_BPP_LOOKUP[bgMode][bg];
+    // The entries are scrolled by BG3's offsets, to the nearest tile. Each column's horizontal entry is in the top row,
+    // and its vertical entry is in the row below. Mode 4 only has the top row, and bit 15 says which offset it is.
+    const uint16_t tileXStart = bgHOffset[eBG3] >> 3;
+    const uint16_t hTileY = (bgVOffset[eBG3] >> 3) & (bgTilemapHeight[eBG3] - 1);
+    const uint16_t vTileY = (hTileY + 1) & (bgTilemapHeight[eBG3] - 1);
 
-    // Check if layer is disabled in emulator GUI.
-    if (!enableLayer[bg])
-        return info;
+    // Mosaic lines are kept for more than one line, so they need to know which regions the entries came from.
+    const uint64_t lineRegionsRead = vramRegionsRead;
+    vramRegionsRead = 0;
 
-    info.isOnMainScreen = mainScreenLayerEnabled[bg];
-    info.isOnSubScreen = subScreenLayerEnabled[bg];
+    for (int column = 1; column < OPT_COLUMNS; column++)
+    {
+        const uint16_t tileX = (tileXStart + column - 1) & (bgTilemapWidth[eBG3] - 1);
+        OffsetPerTile &entries = offsetPerTile[column];
 
-    // Check if the layer is enabled for at least one screen and not disabled by the bgmode.
-    if ((!info.isOnMainScreen && !info.isOnSubScreen) || bpp == 0)
-        return info;
+        entries.hEntry = GetBgTilemapEntry(eBG3, tileX, hTileY);
+        if (bgMode != 4)
+        {
+            entries.vEntry = GetBgTilemapEntry(eBG3, tileX, vTileY);
+        }
+        else if (Bytes::TestBit<15>(entries.hEntry))
+        {
+            entries.vEntry = entries.hEntry;
+            entries.hEntry = 0;
+        }
+        else
+        {
+            entries.vEntry = 0;
+        }
+    }
+
+    optRegionsRead = vramRegionsRead;
+    vramRegionsRead |= lineRegionsRead;
+}
 
-    WindowInfo window = GetBgWindowValue(bg, screenX);
 
-    // Disable the pixel for the screen if it's inside the window and windows are enabled for the bg.
-    info.isOnMainScreen &= !(window.isInside && window.isOnMainScreen);
-    info.isOnSubScreen &= !(window.isInside && window.isOnSubScreen);
+void Ppu::UpdateSpriteTable()
+{
+    for (int i = 0; i < 128; i++)
+    {
+        if ((dirtySprites[i >> 6] & (1UL << (i & 0x3F))) == 0)
+            continue;
 
-    // If all screens are inside the window, the pixel is never drawn.
-    if (!info.isOnMainScreen && !info.isOnSubScreen)
-        return info;
+        Sprite &sprite = spriteTable[i];
+        const uint64_t spriteBit = 1UL << (i & 0x3F);
+
+        // Remove the sprite from the scanlines it was on.
+        for (int line = sprite.yPos; line < sprite.yPos + sprite.height && line < 256; line++)
+            spriteLines[line][i >> 6] &= ~spriteBit;
+
+        uint16_t spriteOffset = i * 4;
+        uint16_t spriteOffsetExt = 512 + (i / 4);
+        uint8_t spriteDataExt = (oam[spriteOffsetExt] >> ((i & 0x03) * 2)) & 0x03;
+
+        uint8_t signExtend[2] = {0, 0xFF};
+        // if the high bit of x is set, extend the negative sign across the entire top byte.
+        sprite.xPos = static_cast<int16_t>(Bytes::Make16Bit(signExtend[spriteDataExt & 0x01], oam[spriteOffset]));
+        sprite.yPos = oam[spriteOffset + 1];
+        sprite.tileId = oam[spriteOffset + 2];
+        sprite.isUpperTable = oam[spriteOffset + 3] & 0x01;
+        sprite.paletteId = (oam[spriteOffset + 3] >> 1) & 0x07;
+        sprite.priority = (oam[spriteOffset + 3] >> 4) & 0x03;
+        sprite.flipX = Bytes::GetBit<6>(oam[spriteOffset + 3]);
+        sprite.flipY = Bytes::GetBit<7>(oam[spriteOffset + 3]);
+        sprite.width = OBJ_H_SIZE_LOOKUP[objSize][spriteDataExt >> 1];
+        sprite.height = OBJ_V_SIZE_LOOKUP[objSize][spriteDataExt >> 1];
+
+        for (int line = sprite.yPos; line < sprite.yPos + sprite.height && line < 256; line++)
+            spriteLines[line][i >> 6] |= spriteBit;
+    }
+
+    dirtySprites[0] = 0;
+    dirtySprites[1] = 0;
+}
+
+
+uint8_t Ppu::GetSpritesOnScanline(uint8_t scanline, std::array<Sprite, 32> &sprites)
+{
+    uint8_t count = 0;
+    int tileCount = 0;
+    bool tooManySprites = false;
+
+    if (dirtySprites[0] || dirtySprites[1])
+        UpdateSpriteTable();
+
+    // TODO: Handle sprite priority rotation.
+    // Visit the sprites on this scanline in OAM order.
+    for (int word = 0; word < 2 && !tooManySprites; word++)
+    {
+        for (uint64_t bits = spriteLines[scanline][word]; bits != 0; bits &= bits - 1)
+        {
+            const Sprite &sprite = spriteTable[(word << 6) + __builtin_ctzll(bits)];
+
+            // Sprites with x == -256 still count due to a bug in the PPU.
+            if (sprite.xPos != -256 && (sprite.xPos + sprite.width - 1) < 0)
+                continue;
+
+            if (count == 32)
+            {
+                // If we got here it means there are more than 32 sprites on the scanline.
+                Bytes::SetBit<6>(regSTAT77);
+                tooManySprites = true;
+                break;
+            }
+
+            sprites[count] = sprite;
+            count++;
+
+            // Only tiles that are at least partly on screen count toward the 34 tile limit. DrawObjLine drops the
+            // tiles past the limit.
+            for (int tileX = sprite.xPos; tileX < sprite.xPos + sprite.width; tileX += 8)
+            {
+                if (tileX > -8 && tileX < SCREEN_X / 2)
+                    tileCount++;
+            }
+        }
+    }
 
-    int mosaicXOff = 0;
-    int mosaicYOff = 0;
-    if (bgEnableMosaic[bg] && bgMosaicSize > 1)
+    if (tileCount > 34)
     {
-        mosaicXOff = screenX % bgMosaicSize;
-        mosaicYOff = (screenY - bgMosaicStartScanline) % bgMosaicSize;
+        Bytes::SetBit<7>(regSTAT77);
+        LogDebug("%d tiles on scanline %d", tileCount, scanline);
     }
 
+    return count;
+}
+
+
+uint8_t Ppu::GetLayerScreens(EBgLayer bg) const
+{
+    // Check if layer is disabled in emulator GUI.
+    if (!enableLayer[bg])
+        return 0;
+
+    return (mainScreenLayerEnabled[bg] ? MAIN_SCREEN : 0) | (subScreenLayerEnabled[bg] ? SUB_SCREEN : 0);
+}
+
+
+void Ppu::ClearLayerLine(EBgLayer bg)
+{
+    for (LinePixel &pixel : layerLine[bg])
+        pixel.screens = 0;
+}
+
+
+void Ppu::ApplyLayerWindow(EBgLayer bg, int width, int windowShift)
+{
+    const WindowMask &screenMask = layerScreenMask[bg];
+    LineBuffer &line = layerLine[bg];
+
+    // Transparent pixels aren't on any screen.
+    for (int x = 0; x < width; x++)
+        line[x].screens = screenMask[x >> windowShift] & (line[x].colorId != 0 ? 0xFF : 0);
+}
+
+
+void Ppu::DrawBgLine(EBgLayer bg, uint16_t screenY)
+{
+    LineBuffer &line = layerLine[bg];
+    const uint8_t bpp = BG_BPP_LOOKUP[bgMode][bg];
+    const int width = IsHiRes() ? SCREEN_X : SCREEN_X / 2;
+
     const int tileXSize = IsHiRes() ? 16 : bgChrSize[bg];
     const int tileYSize = bgChrSize[bg];
-    const int hOffset = IsHiRes() ? bgHOffset[bg] * 2 : bgHOffset[bg];
-    const int vOffset = bgVOffset[bg];
-    const int tileX = ((screenX + hOffset - mosaicXOff) / tileXSize) & (bgTilemapWidth[bg] - 1);
-    const int tileY = ((screenY + vOffset - mosaicYOff) / tileYSize) & (bgTilemapHeight[bg] - 1);
-    int xOff = (screenX + hOffset - mosaicXOff) & (tileXSize - 1);
-    int yOff = (screenY + vOffset - mosaicYOff) & (tileYSize - 1);
-
-    // Cache the tile since the next 8 pixels will use the same tile.
-    BgTilemapCache &tile = bgTilemapCache[bg];
-    if (tile.tileX != tileX || tile.tileY != tileY)
-        tile = BgTilemapCache(GetBgTilemapEntry(bg, tileX, tileY), tileX, tileY);
-
-    info.paletteId = tile.data.paletteId;
-    info.priority = tile.data.priority;
-
-    if (tile.data.flipX)
-        xOff = (tileXSize - 1) - xOff;
-    if (tile.data.flipY)
-        yOff = (tileYSize - 1) - yOff;
-
-    // Offset tileId if using 16x16 tiles.
-    uint16_t tileId = tile.data.tileId;
-    if (xOff >= 8)
+    const int xShift = IsHiRes() ? 1 : 0;
+
+    int hOffset = 0;
+    int tileY = 0;
+    int tileYOff = 0;
+    auto SetOffsets = [&](uint16_t newHOffset, uint16_t newVOffset)
     {
-        tileId += 1;
-        xOff &= 0x07;
-    }
-    if (yOff >= 8)
+        hOffset = newHOffset << xShift;
+        tileY = ((screenY + newVOffset) / tileYSize) & (bgTilemapHeight[bg] - 1);
+        tileYOff = (screenY + newVOffset) & (tileYSize - 1);
+    };
+    SetOffsets(bgHOffset[bg], bgVOffset[bg]);
+
+    // With offset-per-tile, each column after the first can replace the offsets. The fine horizontal scroll is always
+    // the layer's own, so the columns stay in the same place.
+    const bool isOffsetPerTile = IsOffsetPerTile() && bg <= eBG2;
+    const uint16_t entryBit = bg == eBG1 ? 0x2000 : 0x4000;
+    int nextColumnX = isOffsetPerTile ? (8 - (bgHOffset[bg] & 0x07)) << xShift : width;
+    int column = 1;
+
+    // The current tile's row of pixels, before flipping.
+    uint8_t row[16];
+    uint8_t paletteId = 0;
+    uint8_t priority = 0;
+    int rowTileX = -1;
+
+    for (int x = 0; x < width; x++)
     {
-        tileId += 0x10;
-        yOff &= 0x07;
-    }
+        if (x == nextColumnX)
+        {
+            const OffsetPerTile &entries = offsetPerTile[column];
+            const uint16_t newHOffset = (entries.hEntry & entryBit) ?
+                (entries.hEntry & 0x03F8) | (bgHOffset[bg] & 0x07) : bgHOffset[bg];
+            const uint16_t newVOffset = (entries.vEntry & entryBit) ? entries.vEntry & 0x03FF : bgVOffset[bg];
+            SetOffsets(newHOffset, newVOffset);
+
+            // The tile has to be looked up again even if it's the same tile number.
+            rowTileX = -1;
+            column++;
+            nextColumnX += 8 << xShift;
+        }
+
+        const int bgX = x + hOffset;
+
+        // Only look up the tile and decode its row when moving to a new tile.
+        const int tileX = (bgX / tileXSize) & (bgTilemapWidth[bg] - 1);
+        if (tileX != rowTileX)
+        {
+            uint16_t tileData = GetBgTilemapEntry(bg, tileX, tileY);
+            uint16_t tileId = tileData & 0x3FF;
+            paletteId = (tileData >> 10) & 0x07;
+            priority = (tileData >> 13) & 0x01;
+            bool flipX = Bytes::GetBit<14>(tileData);
+            bool flipY = Bytes::GetBit<15>(tileData);
+
+            int yOff = flipY ? (tileYSize - 1) - tileYOff : tileYOff;
+
+            // Offset tileId if using 16x16 tiles.
+            if (yOff >= 8)
+            {
+                tileId += 0x10;
+                yOff &= 0x07;
+            }
 
-    // From here on, tiles are always 8x8.
+            // 16 pixel wide tiles are two 8x8 tiles next to each other, which swap places when flipped.
+            const int tileCount = tileXSize / 8;
+            for (int i = 0; i < tileCount; i++)
+            {
+                uint16_t addr = bgChrAddr[bg] + ((tileId + (flipX ? (tileCount - 1) - i : i)) * 8 * bpp);
+                MarkVramRead(addr);
+                const uint8_t *tileRow = tileCache.GetTile(addr, bpp) + (yOff << 3);
+                uint8_t *out = &row[i * 8];
+
+                if (flipX)
+                {
+                    for (int x = 0; x < 8; x++)
+                        out[x] = tileRow[7 - x];
+                }
+                else
+                {
+                    memcpy(out, tileRow, 8);
+                }
+            }
 
-    uint16_t addr = bgChrAddr[bg] + (tileId * 8 * bpp);
-    uint8_t pixelVal = GetTilePixelData(addr, xOff, yOff, bpp);
+            rowTileX = tileX;
+        }
 
-    info.colorId = pixelVal;
-    info.color = GetColorValueFromPalette(bg, tile.data.paletteId, pixelVal);
-    info.isTransparent = (pixelVal == 0);
-    info.bg = bg;
-    return info;
+        LinePixel &pixel = line[x];
+        pixel.colorId = row[bgX & (tileXSize - 1)];
+        pixel.paletteId = paletteId;
+        pixel.priority = priority;
+        pixel.cgramIndex = GetCgramIndex(bg, paletteId, pixel.colorId);
+    }
 }
 
 
-Ppu::PixelInfo Ppu::GetBgPixelInfoMode7(uint16_t screenX, uint16_t screenY)
+void Ppu::DrawBgLineMode7(uint16_t screenY)
 {
-    PixelInfo info;
+    LineBuffer &line = layerLine[eBG1];
 
     auto Clip = [](int value)
     {
@@ -1130,153 +1659,97 @@ Ppu::PixelInfo Ppu::GetBgPixelInfoMode7(uint16_t screenX, uint16_t screenY)
             ((m7d * screenY) & ~0x3F) +
             (m7y << 8);
 
-    // TODO: Move the above code to only execute once per scanline.
+    // Only the start of the line needs the full transform. Each pixel after that is one step of m7a and m7c.
+    const uint8_t *tiles = tileCache.GetMode7Tiles();
+    // The map and tiles fill the first 32KB of VRAM, and any of it could be on the line.
+    vramRegionsRead |= 0xFFFFFFFF;
+    const bool fillTile0 = m7ExtendedFill && m7FillColorTile0;
+    const uint8_t fillMask = m7ExtendedFill && !m7FillColorTile0 ? 0x00 : 0xFF;
 
-    info.bg = eBG1;
-    info.isOnMainScreen = mainScreenLayerEnabled[eBG1];
-    info.isOnSubScreen = subScreenLayerEnabled[eBG1];
-
-    int realX = (x + (m7a * screenX)) >> 8;
-    int realY = (y + (m7c * screenX)) >> 8;
-    int xOff = realX & 0x07;
-    int yOff = realY & 0x07;
-
-    if (m7ExtendedFill && ((realX & ~0x3FF) || (realY & ~0x3FF)))
+    for (int screenX = 0; screenX < SCREEN_X / 2; screenX++, x += m7a, y += m7c)
     {
-        if (m7FillColorTile0)
-        {
-            info.colorId = vram[(((yOff << 3) + xOff) << 1) + 1];
-            info.color = GetColorValueFromPalette(eBG1, 0, info.colorId);
-            info.isTransparent = (info.colorId == 0);
-        }
-        else
-        {
-            info.colorId = 0;
-            info.color = GetColorValueFromPalette(eBG1, 0, 0);
-            info.isTransparent = true;
-        }
-
-        return info;
+        const int realX = x >> 8;
+        const int realY = y >> 8;
+
+        // Outside the 1024x1024 map, extended fill uses tile 0 or transparent pixels instead of repeating the map.
+        const bool isOutside = (realX | realY) & ~0x3FF;
+        const uint16_t tileIdAddr = (((realY & 0x3F8) << 4) | ((realX & 0x3FF) >> 3)) << 1;
+        const uint8_t tileId = isOutside && fillTile0 ? 0 : vram[tileIdAddr];
+        const uint8_t colorId = tiles[(tileId << 6) | ((realY & 0x07) << 3) | (realX & 0x07)] &
+                                (isOutside ? fillMask : 0xFF);
+
+        LinePixel &pixel = line[screenX];
+        pixel.colorId = colorId;
+        pixel.cgramIndex = colorId;
+        pixel.paletteId = 0;
+        pixel.priority = 0;
     }
-
-    realX &= 0x3FF;
-    realY &= 0x3FF;
-
-    uint16_t tileIdAddr = (((realY & ~0x07) << 4) + (realX >> 3)) << 1;
-    uint8_t tileId = vram[tileIdAddr];
-
-    uint16_t colorAddr = (((tileId << 6) + (yOff << 3) + xOff) << 1) + 1;
-    info.colorId = vram[colorAddr];
-    info.color = GetColorValueFromPalette(eBG1, 0, info.colorId);
-    info.isTransparent = (info.colorId == 0);
-
-    return info;
 }
 
 
-uint8_t Ppu::GetSpritesOnScanline(uint8_t scanline, std::array<Sprite, 32> &sprites)
+void Ppu::DrawMosaicBgLine(EBgLayer bg, uint16_t screenY)
 {
-    uint8_t count = 0;
-    uint8_t tileCount = 0;
-
-    // TODO: Handle sprite priority rotation.
-    for (int i = 0; i < 128; i++)
-    {
-        uint16_t spriteOffset = i * 4;
-        uint16_t spriteOffsetExt = 512 + (i / 4);
-        uint8_t spriteDataExt = (oam[spriteOffsetExt] >> ((i & 0x03) * 2)) & 0x03;
-
-        uint8_t spriteHeight = OBJ_V_SIZE_LOOKUP[objSize][spriteDataExt >> 1];
-        uint8_t spriteY = oam[spriteOffset + 1];
-        if (scanline < spriteY || scanline > (spriteY + spriteHeight - 1))
-            continue;
-
-        uint8_t signExtend[2] = {0, 0xFF};
-        uint8_t spriteWidth = OBJ_H_SIZE_LOOKUP[objSize][spriteDataExt >> 1];
-        // if the high bit of x is set, extend the negative sign across the entire top byte.
-        int16_t spriteX = static_cast<int16_t>(Bytes::Make16Bit(signExtend[spriteDataExt & 0x01], oam[spriteOffset]));
-        // Sprites with x == -256 still count due to a bug in the PPU.
-        if (spriteX != -256 && (spriteX + spriteWidth - 1) < 0)
-            continue;
+    LineBuffer &line = layerLine[bg];
+    MosaicLine &mosaicLine = mosaicLines[bg];
+    const int width = IsHiRes() ? SCREEN_X : SCREEN_X / 2;
 
-        if (count < 32)
-        {
-            sprites[count].xPos = spriteX;
-            sprites[count].yPos = spriteY;
-            sprites[count].tileId = oam[spriteOffset + 2];
-            sprites[count].isUpperTable = oam[spriteOffset + 3] & 0x01;
-            sprites[count].paletteId = (oam[spriteOffset + 3] >> 1) & 0x07;
-            sprites[count].priority = (oam[spriteOffset + 3] >> 4) & 0x03;
-            sprites[count].flipX = Bytes::GetBit<6>(oam[spriteOffset + 3]);
-            sprites[count].flipY = Bytes::GetBit<7>(oam[spriteOffset + 3]);
-            sprites[count].width = spriteWidth;
-            sprites[count].height = spriteHeight;
-            count++;
+    // Every line of a vertical block is the same as its first line.
+    const int sourceY = screenY - (screenY - bgMosaicStartScanline) % bgMosaicSize;
+    const uint64_t state = GetLineStateHash();
 
-            // For now, just report that there are too many tiles per scanline. We'll still draw them.
-            // TODO: Don't draw these.
-            tileCount += spriteWidth / 8;
-            if (tileCount > 34)
-                Bytes::SetBit<7>(regSTAT77);
-        }
-        else
-        {
-            // If we got here it means there are more than 32 sprites on the scanline.
-            Bytes::SetBit<6>(regSTAT77);
-            break;
-        }
+    if (mosaicLine.sourceY == sourceY && mosaicLine.state == state &&
+        GetLastWrite(mosaicLine.vramRegions) == mosaicLine.lastWrite)
+    {
+        std::copy(mosaicLine.pixels.begin(), mosaicLine.pixels.begin() + width, line.begin());
+        vramRegionsRead |= mosaicLine.vramRegions;
+        return;
     }
 
-    if (tileCount > 34)
-        LogDebug("%d tiles on scanline %d", tileCount, scanline);
+    const uint64_t lineRegionsRead = vramRegionsRead;
+    vramRegionsRead = 0;
 
-    return count;
+    if (bgMode == 7)
+        DrawBgLineMode7(sourceY);
+    else
+        DrawBgLine(bg, sourceY);
+
+    // Each block is its first pixel.
+    for (int x = 0; x < width; x += bgMosaicSize)
+        std::fill(line.begin() + x, line.begin() + std::min(x + bgMosaicSize, width), line[x]);
+
+    // The line was drawn with this line's offset-per-tile entries.
+    if (IsOffsetPerTile())
+        vramRegionsRead |= optRegionsRead;
+
+    mosaicLine.sourceY = sourceY;
+    mosaicLine.state = state;
+    mosaicLine.vramRegions = vramRegionsRead;
+    mosaicLine.lastWrite = GetLastWrite(vramRegionsRead);
+    std::copy(line.begin(), line.begin() + width, mosaicLine.pixels.begin());
+    vramRegionsRead |= lineRegionsRead;
 }
 
 
-Ppu::PixelInfo Ppu::GetSpritePixelInfo(uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount)
+void Ppu::DrawObjLine(uint16_t screenY, const std::array<Sprite, 32> &sprites, uint8_t spriteCount)
 {
-    PixelInfo info;
-
-    // Check if layer is disabled in emulator GUI.
-    if (!enableLayer[eOBJ])
-        return info;
-
-    info.isOnMainScreen = mainScreenLayerEnabled[eOBJ];
-    info.isOnSubScreen = subScreenLayerEnabled[eOBJ];
+    LineBuffer &line = layerLine[eOBJ];
 
-    // Check if the layer is enabled for at least one screen.
-    if (!info.isOnMainScreen && !info.isOnSubScreen)
-        return info;
+    for (int screenX = 0; screenX < SCREEN_X / 2; screenX++)
+        line[screenX].colorId = 0;
 
-    WindowInfo window = GetBgWindowValue(eOBJ, screenX);
+    // The PPU can only fetch 34 tiles per scanline. GetSpritesOnScanline sets the time over flag.
+    int tilesLeft = 34;
 
-    // Disable the pixel for the screen if it's inside the window and windows are enabled for the bg.
-    info.isOnMainScreen &= !(window.isInside && window.isOnMainScreen);
-    info.isOnSubScreen &= !(window.isInside && window.isOnSubScreen);
-
-    // If all screens are inside the window, the pixel is never drawn.
-    if (!info.isOnMainScreen && !info.isOnSubScreen)
-        return info;
-
-    for (int i = 0; i < spriteCount; i++)
+    // The first sprite in OAM order with a non-transparent pixel is drawn, regardless of priority, so sprites are drawn
+    // last to first. The PPU fetches tiles in the same order, so when there are too many tiles it's the first sprites
+    // that lose theirs.
+    for (int i = spriteCount - 1; i >= 0 && tilesLeft > 0; i--)
     {
         const Sprite &cur = sprites[i];
+        const uint8_t tilesPerX = cur.width / 8;
 
-        if (screenX < cur.xPos || screenX > (cur.xPos + cur.width - 1))
-            continue;
-
-        uint8_t tileX = (screenX - cur.xPos) / 8;
         uint8_t tileY = (screenY - cur.yPos) / 8;
-        uint8_t xOff = (screenX - cur.xPos) & 0x07;
         uint8_t yOff = (screenY - cur.yPos) & 0x07;
-
-        if (cur.flipX)
-        {
-            uint8_t tilesPerX = cur.width / 8;
-            tileX = (tilesPerX - 1) - tileX;
-            xOff = 7 - xOff;
-        }
         if (cur.flipY)
         {
             uint8_t tilesPerY = cur.height / 8;
@@ -1284,203 +1757,128 @@ Ppu::PixelInfo Ppu::GetSpritePixelInfo(uint16_t screenX, uint16_t screenY, const
             yOff = 7 - yOff;
         }
 
-        // The sprite table is a 16x16 table. cur.tileId is the top left tile of the sprite, so add the tileX/tileY offsets to
-        // get the tile that contains the pixel we want. The tileId is stored as rrrrcccc where rrrr is the row and cccc is the column.
-        // Rows and columns above F wrap to 0.
-        uint8_t tileId = (((cur.tileId >> 4) + tileY) << 4) | ((cur.tileId + tileX) & 0x0F);
-        uint16_t tileAddr = objBaseAddr[cur.isUpperTable] + (tileId * 8 * OBJ_BPP);
-
-        uint8_t pixelVal = GetTilePixelData(tileAddr, xOff, yOff, OBJ_BPP);
-        if (pixelVal != 0)
+        for (int spriteTileX = 0; spriteTileX < tilesPerX && tilesLeft > 0; spriteTileX++)
         {
-            info.paletteId = cur.paletteId;
-            info.colorId = pixelVal;
-            info.bg = eOBJ;
-            info.priority = cur.priority;
-            info.color = GetColorValueFromPalette(eOBJ, info.paletteId, info.colorId);
-            info.isTransparent = (pixelVal == 0);
-            break;
+            const int tileScreenX = cur.xPos + (spriteTileX * 8);
+
+            // Only tiles that are at least partly on screen are fetched.
+            if (tileScreenX <= -8 || tileScreenX >= SCREEN_X / 2)
+                continue;
+            tilesLeft--;
+
+            uint8_t tileX = cur.flipX ? (tilesPerX - 1) - spriteTileX : spriteTileX;
+
+            // The sprite table is a 16x16 table. cur.tileId is the top left tile of the sprite, so add the tileX/tileY offsets to
+            // get the tile that contains the pixel we want. The tileId is stored as rrrrcccc where rrrr is the row and cccc is the column.
+            // Rows and columns above F wrap to 0.
+            uint8_t tileId = (((cur.tileId >> 4) + tileY) << 4) | ((cur.tileId + tileX) & 0x0F);
+            uint16_t tileAddr = objBaseAddr[cur.isUpperTable] + (tileId * 8 * OBJ_BPP);
+            MarkVramRead(tileAddr);
+            const uint8_t *tileRow = tileCache.GetTile(tileAddr, OBJ_BPP) + (yOff << 3);
+
+            for (int xOff = 0; xOff < 8; xOff++)
+            {
+                const int screenX = tileScreenX + xOff;
+                const uint8_t pixelVal = tileRow[cur.flipX ? 7 - xOff : xOff];
+                if (pixelVal == 0 || screenX < 0 || screenX >= SCREEN_X / 2)
+                    continue;
+
+                LinePixel &pixel = line[screenX];
+                pixel.paletteId = cur.paletteId;
+                pixel.colorId = pixelVal;
+                pixel.priority = cur.priority;
+                pixel.cgramIndex = GetCgramIndex(eOBJ, pixel.paletteId, pixel.colorId);
+            }
         }
     }
 
-    return info;
+    ApplyLayerWindow(eOBJ, SCREEN_X / 2, 0);
 }
 
 
-template <Ppu::EScreenType Screen>
-Ppu::PixelInfo Ppu::GetPixelInfo(uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount)
+// A layer's pixels with one priority.
+struct LayerPriority
+{
+    EBgLayer layer;
+    uint8_t priority;
+};
+
+// The rank of each layer's pixels by priority, [layer][priority]. The top pixel is the one with the highest rank,
+// and pixels with rank 0 are never shown.
+using PriorityRanks = std::array<std::array<uint8_t, 4>, eOBJ + 1>;
+
+// Ranks the layers from front to back in the given order.
+template <size_t N>
+static constexpr PriorityRanks MakePriorityRanks(const LayerPriority (&order)[N])
 {
-    PixelInfo bgInfo[4];
+    PriorityRanks ranks = {};
+    for (size_t i = 0; i < N; i++)
+        ranks[order[i].layer][order[i].priority] = N - i;
 
-    const uint16_t spriteX = IsHiRes() ? screenX / 2 : screenX;
-    PixelInfo spriteInfo = GetSpritePixelInfo(spriteX, screenY, sprites, spriteCount);
+    return ranks;
+}
+
+static constexpr LayerPriority MODE0_ORDER[] = {
+    {eOBJ, 3}, {eBG1, 1}, {eBG2, 1}, {eOBJ, 2}, {eBG1, 0}, {eBG2, 0},
+    {eOBJ, 1}, {eBG3, 1}, {eBG4, 1}, {eOBJ, 0}, {eBG3, 0}, {eBG4, 0}
+};
+static constexpr LayerPriority MODE1_ORDER[] = {
+    {eOBJ, 3}, {eBG1, 1}, {eBG2, 1}, {eOBJ, 2}, {eBG1, 0}, {eBG2, 0},
+    {eOBJ, 1}, {eBG3, 1}, {eOBJ, 0}, {eBG3, 0}
+};
+// Bit 3 of BGMODE moves BG3 tiles with priority 1 in front of everything.
+static constexpr LayerPriority MODE1_BG3_ORDER[] = {
+    {eBG3, 1}, {eOBJ, 3}, {eBG1, 1}, {eBG2, 1}, {eOBJ, 2}, {eBG1, 0},
+    {eBG2, 0}, {eOBJ, 1}, {eOBJ, 0}, {eBG3, 0}
+};
+// Modes 2 to 5.
+static constexpr LayerPriority MODE2_ORDER[] = {
+    {eOBJ, 3}, {eBG1, 1}, {eOBJ, 2}, {eBG2, 1}, {eOBJ, 1}, {eBG1, 0}, {eOBJ, 0}, {eBG2, 0}
+};
+static constexpr LayerPriority MODE6_ORDER[] = {
+    {eOBJ, 3}, {eBG1, 1}, {eOBJ, 2}, {eOBJ, 1}, {eBG1, 0}, {eOBJ, 0}
+};
+// Mode 7 BG1 pixels don't have a priority.
+static constexpr LayerPriority MODE7_ORDER[] = {
+    {eOBJ, 3}, {eOBJ, 2}, {eOBJ, 1}, {eBG1, 0}, {eOBJ, 0}
+};
+
+// Indexed by the priority table, which is the mode or MODE1_BG3_PRIORITY.
+static constexpr std::array<PriorityRanks, 9> PRIORITY_RANKS = {
+    MakePriorityRanks(MODE0_ORDER),
+    MakePriorityRanks(MODE1_ORDER),
+    MakePriorityRanks(MODE2_ORDER),
+    MakePriorityRanks(MODE2_ORDER),
+    MakePriorityRanks(MODE2_ORDER),
+    MakePriorityRanks(MODE2_ORDER),
+    MakePriorityRanks(MODE6_ORDER),
+    MakePriorityRanks(MODE7_ORDER),
+    MakePriorityRanks(MODE1_BG3_ORDER)
+};
 
-    switch (bgMode)
+
+template <Ppu::EScreenType Screen>
+EBgLayer Ppu::GetTopLayer(uint16_t x, uint16_t objX) const
+{
+    constexpr uint8_t screen = (Screen == EScreenType::MainScreen) ? MAIN_SCREEN : SUB_SCREEN;
+    const PriorityRanks &ranks = PRIORITY_RANKS[priorityTable];
+
+    // Each pixel's key is its rank above the layer, so the top pixel has the highest key. Pixels that are transparent or
+    // off the screen have key 0.
+    auto Key = [&ranks](EBgLayer bg, const LinePixel &pixel)
     {
-        case 0:
-            // Sprites with priority 3
-            if (spriteInfo.priority == 3 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 1
-            bgInfo[eBG1] = GetBgPixelInfo(eBG1, screenX, screenY);
-            if (bgInfo[eBG1].priority && bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // BG2 tiles with priority 1
-            bgInfo[eBG2] = GetBgPixelInfo(eBG2, screenX, screenY);
-            if (bgInfo[eBG2].priority && bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            // Sprites with priority 2
-            if (spriteInfo.priority == 2 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 0
-            if (bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // BG2 tiles with priority 0
-            if (bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            // Sprites with priority 1
-            if (spriteInfo.priority == 1 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG3 tiles with priority 1
-            bgInfo[eBG3] = GetBgPixelInfo(eBG3, screenX, screenY);
-            if (bgInfo[eBG3].priority && bgInfo[eBG3].IsNotTransparent<Screen>())
-                return bgInfo[eBG3];
-            // BG4 tiles with priority 1
-            bgInfo[eBG4] = GetBgPixelInfo(eBG4, screenX, screenY);
-            if (bgInfo[eBG4].priority && bgInfo[eBG4].IsNotTransparent<Screen>())
-                return bgInfo[eBG4];
-            // Sprites with priority 0
-            if (spriteInfo.priority == 0 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG3 tiles with priority 0
-            if (bgInfo[eBG3].IsNotTransparent<Screen>())
-                return bgInfo[eBG3];
-            // BG4 tiles with priority 0
-            if (bgInfo[eBG4].IsNotTransparent<Screen>())
-                return bgInfo[eBG4];
-            break;
-        case 1:
-            // BG3 tiles with priority 1 if bit 3 of regBGMODE is set
-            if (bgMode1Bg3Priority)
-            {
-                bgInfo[eBG3] = GetBgPixelInfo(eBG3, screenX, screenY);
-                if (bgInfo[eBG3].priority && bgInfo[eBG3].IsNotTransparent<Screen>())
-                    return bgInfo[eBG3];
-            }
-            // Sprites with priority 3
-            if (spriteInfo.priority == 3 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 1
-            bgInfo[eBG1] = GetBgPixelInfo(eBG1, screenX, screenY);
-            if (bgInfo[eBG1].priority && bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // BG2 tiles with priority 1
-            bgInfo[eBG2] = GetBgPixelInfo(eBG2, screenX, screenY);
-            if (bgInfo[eBG2].priority && bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            // Sprites with priority 2
-            if (spriteInfo.priority == 2 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 0
-            if (bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // BG2 tiles with priority 0
-            if (bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            // Sprites with priority 1
-            if (spriteInfo.priority == 1 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // Skip loading if we already loaded it above.
-            if (!bgMode1Bg3Priority)
-                bgInfo[eBG3] = GetBgPixelInfo(eBG3, screenX, screenY);
-            // BG3 tiles with priority 1 if bit 3 of regBGMODE is clear
-            if (bgInfo[eBG3].priority && bgInfo[eBG3].IsNotTransparent<Screen>())
-                return bgInfo[eBG3];
-            // Sprites with priority 0
-            if (spriteInfo.priority == 0 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG3 tiles with priority 0
-            if (bgInfo[eBG3].IsNotTransparent<Screen>())
-                return bgInfo[eBG3];
-            break;
-        case 2:
-        case 3:
-        case 4:
-        case 5:
-            // Sprites with priority 3
-            if (spriteInfo.priority == 3 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 1
-            bgInfo[eBG1] = GetBgPixelInfo(eBG1, screenX, screenY);
-            if (bgInfo[eBG1].priority && bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // Sprites with priority 2
-            if (spriteInfo.priority == 2 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG2 tiles with priority 1
-            bgInfo[eBG2] = GetBgPixelInfo(eBG2, screenX, screenY);
-            if (bgInfo[eBG2].priority && bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            // Sprites with priority 1
-            if (spriteInfo.priority == 1 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 0
-            if (bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // Sprites with priority 0
-            if (spriteInfo.priority == 0 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG2 tiles with priority 0
-            if (bgInfo[eBG2].IsNotTransparent<Screen>())
-                return bgInfo[eBG2];
-            break;
-        case 6:
-            // Sprites with priority 3
-            if (spriteInfo.priority == 3 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 1
-            bgInfo[eBG1] = GetBgPixelInfo(eBG1, screenX, screenY);
-            if (bgInfo[eBG1].priority && bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // Sprites with priority 2
-            if (spriteInfo.priority == 2 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // Sprites with priority 1
-            if (spriteInfo.priority == 1 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1 tiles with priority 0
-            if (bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // Sprites with priority 0
-            if (spriteInfo.priority == 0 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            break;
-        case 7:
-            // Sprites with priority 3
-            if (spriteInfo.priority == 3 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // Sprites with priority 2
-            if (spriteInfo.priority == 2 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // Sprites with priority 1
-            if (spriteInfo.priority == 1 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            // BG1
-            bgInfo[eBG1] = GetBgPixelInfoMode7(screenX, screenY);
-            if (bgInfo[eBG1].IsNotTransparent<Screen>())
-                return bgInfo[eBG1];
-            // Sprites with priority 0
-            if (spriteInfo.priority == 0 && spriteInfo.IsNotTransparent<Screen>())
-                return spriteInfo;
-            break;
-    }
+        return (pixel.screens & screen) ? (ranks[bg][pixel.priority] << 3) | bg : 0;
+    };
+    const int topKey = std::max({Key(eBG1, layerLine[eBG1][x]), Key(eBG2, layerLine[eBG2][x]),
+                                 Key(eBG3, layerLine[eBG3][x]), Key(eBG4, layerLine[eBG4][x]),
+                                 Key(eOBJ, layerLine[eOBJ][objX])});
 
-    // Nothing drew to this pixel.
-    return PixelInfo();
+    // Nothing drew to this pixel, so it's the backdrop.
+    return (topKey >> 3) != 0 ? static_cast<EBgLayer>(topKey & 0x07) : eCOL;
 }
 
 
-uint16_t Ppu::GetColorValueFromPalette(EBgLayer bg, uint8_t paletteId, uint8_t colorId)
+uint8_t Ppu::GetCgramIndex(EBgLayer bg, uint8_t paletteId, uint8_t colorId) const
 {
     uint16_t paletteOffset = 0;
     if (colorId != 0)
@@ -1489,136 +1887,400 @@ uint16_t Ppu::GetColorValueFromPalette(EBgLayer bg, uint8_t paletteId, uint8_t c
             paletteOffset = (paletteId << OBJ_BPP) + 128;
         else if (bgMode == 0)
             paletteOffset = (paletteId << BG_BPP_LOOKUP[bgMode][bg]) + (bg * 0x20);
+        else if (BG_BPP_LOOKUP[bgMode][bg] == 8)
+            paletteOffset = 0; // 8bpp layers use all 256 colors, so the palette bits are ignored.
         else
             paletteOffset = (paletteId << BG_BPP_LOOKUP[bgMode][bg]);
     }
 
-    paletteOffset = (paletteOffset + colorId) << 1;
+    return paletteOffset + colorId;
+}
 
-    uint16_t color = Bytes::Make16Bit(cgram[paletteOffset + 1], cgram[paletteOffset]);
-    return color;
+
+uint16_t Ppu::GetCgramColor(uint8_t cgramIndex) const
+{
+    return Bytes::Make16Bit(cgram[(cgramIndex << 1) + 1], cgram[cgramIndex << 1]);
+}
+
+
+uint32_t Ppu::ToOutputColor(uint16_t color) const
+{
+    Bgr555 bgr(color);
+    return 0xFF000000 |
+           Bytes::Make24Bit(brightnessLevels[bgr.red], brightnessLevels[bgr.green], brightnessLevels[bgr.blue]);
+}
+
+
+void Ppu::UpdateOutputPalette(uint8_t cgramIndex)
+{
+    outputPalette[cgramIndex] = ToOutputColor(GetCgramColor(cgramIndex));
 }
 
 
-uint32_t Ppu::PerformColorMath(uint16_t mainColor, bool colorClipped, uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount)
+void Ppu::SetBrightness(uint8_t newBrightness)
+{
+    if (newBrightness == brightness)
+        return;
+
+    brightness = newBrightness;
+
+    for (int i = 0; i < 32; i++)
+        brightnessLevels[i] = Bgr555::ToOutputLevel(i, brightness);
+
+    for (int i = 0; i < 256; i++)
+        UpdateOutputPalette(i);
+}
+
+
+uint8_t Ppu::PrepareColorMath(uint16_t x, uint16_t objX, bool colorClipped)
 {
-    Bgr555 subColor;
     bool halve = halfColorMath && !colorClipped;
 
     if (colAddend)
     {
-        PixelInfo subScreenPixel = GetPixelInfo<EScreenType::SubScreen>(screenX, screenY, sprites, spriteCount);
-        if (subScreenPixel.IsNotTransparent<EScreenType::SubScreen>())
+        EBgLayer subLayer = GetTopLayer<EScreenType::SubScreen>(x, objX);
+        if (subLayer != eCOL)
         {
-            subColor = subScreenPixel.color;
+            subColorLine[x] = GetCgramColor(GetLinePixel(subLayer, x, objX).cgramIndex);
         }
         else
         {
             // Transparent, use default fixed color value for subColor and disable half math.
-            subColor = fixedColor;
+            subColorLine[x] = fixedColor;
             halve = false;
         }
     }
     else
     {
-        subColor = fixedColor;
+        subColorLine[x] = fixedColor;
     }
 
-    Bgr555 newColor(mainColor);
+    return halve ? (ColorMath::COLOR_MATH | ColorMath::HALVE) : ColorMath::COLOR_MATH;
+}
+
+
+uint64_t Ppu::GetLineStateHash() const
+{
+    // Registers written by HDMA are part of this too, so lines are only the same if HDMA wrote the same values.
+    // Where the mosaic starts only matters when there's a mosaic.
+    const int mosaicStart = (bgMosaicSize > 1 && (regMOSAIC & 0x0F) != 0) ? bgMosaicStartScanline : 0;
+    const int state[] = {
+        regINIDISP, regOBJSEL, regBGMODE, regMOSAIC, regBG1SC, regBG2SC, regBG3SC, regBG4SC, regBG12NBA, regBG34NBA,
+        regM7SEL, regW12SEL, regW34SEL, regWOBJSEL, regWH0, regWH1, regWH2, regWH3, regWBGLOG, regWOBJLOG, regTM,
+        regTS, regTMW, regTSW, regCGWSEL, regCGADSUB, regSETINI,
+        bgHOffset[0], bgHOffset[1], bgHOffset[2], bgHOffset[3], bgVOffset[0], bgVOffset[1], bgVOffset[2], bgVOffset[3],
+        m7HOffset, m7VOffset, m7a, m7b, m7c, m7d, m7x, m7y, fixedColor, mosaicStart,
+        enableLayer[eBG1], enableLayer[eBG2], enableLayer[eBG3], enableLayer[eBG4], enableLayer[eOBJ],
+        static_cast<int>(pixelFormat), isFrameInterlaced ? field + 1 : 0
+    };
+
+    // FNV-1a.
+    uint64_t hash = 0xCBF29CE484222325;
+    for (int value : state)
+        hash = (hash ^ static_cast<uint32_t>(value)) * 0x100000001B3;
+
+    return hash;
+}
+
+
+uint64_t Ppu::GetLastWrite(uint64_t vramRegions) const
+{
+    uint64_t lastWrite = std::max(cgramWrite, oamWrite);
+
+    for (; vramRegions != 0; vramRegions &= vramRegions - 1)
+        lastWrite = std::max(lastWrite, vramRegionWrites[__builtin_ctzll(vramRegions)]);
+
+    return lastWrite;
+}
+
+
+void Ppu::DrawScanline(uint8_t scanline)
+{
+    TripleBuffer::Frame &frame = frames->GetBackBuffer();
+    const int row = GetFrameRow(scanline);
+    uint8_t *frameLine = reinterpret_cast<uint8_t *>(frame.pixels.data()) + row * GetPitch();
+    TripleBuffer::LineSignature signature = {signatureEpoch, GetLineStateHash(), 0, 0};
 
-    if (colorSubtract)
+    if (isForcedBlank)
     {
-        newColor.Subtract(subColor, halve);
+        // 0 is black in every format.
+        std::fill(frameLine, frameLine + GetPitch() / 2, 0);
+        frame.isLineHiRes[row] = false;
     }
     else
     {
-        newColor.Add(subColor, halve);
+        // Sprites are needed for the sprite overflow flags even if the line isn't drawn.
+        std::array<Sprite, 32> sprites;
+        int spriteCount = GetSpritesOnScanline(scanline, sprites);
+
+        // The back buffer has the same line already if the line's state is the same, and the memory it read hasn't
+        // changed since.
+        const TripleBuffer::LineSignature &drawn = frame.lineSignatures[row];
+        if (drawn.epoch == signature.epoch && drawn.state == signature.state &&
+            GetLastWrite(drawn.vramRegions) == drawn.lastWrite)
+        {
+            signature = drawn;
+        }
+        else
+        {
+            vramRegionsRead = 0;
+            RenderScanline(scanline, sprites, spriteCount, frameLine);
+            signature.vramRegions = vramRegionsRead;
+            signature.lastWrite = GetLastWrite(vramRegionsRead);
+            frame.isLineHiRes[row] = IsLineHiRes();
+        }
     }
 
-    return newColor.ToARGB888(brightness);
+    frame.lineSignatures[row] = signature;
+    frame.isLineChanged[row] = signature != lastLineSignatures[row];
+    lastLineSignatures[row] = signature;
 }
 
 
-void Ppu::DrawScanline(uint8_t scanline)
+void Ppu::RenderScanline(uint8_t scanline, const std::array<Sprite, 32> &sprites, uint8_t spriteCount,
+                         uint8_t *frameLine)
 {
-    if (isForcedBlank)
+    if (windowChanged)
+        GenerateWindowMasks();
+
+    if (IsOffsetPerTile())
+        ReadOffsetPerTile();
+
+    // Interlaced hi-res BGs have twice as many lines, and each field draws every other one.
+    const uint16_t bgY = (isFrameInterlaced && IsHiRes()) ? scanline * 2 + field : scanline;
+
+    // Draw each layer into its line buffer.
+    for (int bg = eBG1; bg <= eBG4; bg++)
     {
-        for (int i = 0; i < SCREEN_X; i++)
+        EBgLayer layer = static_cast<EBgLayer>(bg);
+
+        // Skip the layer if it's not enabled for at least one screen, or is disabled by the bgmode.
+        if (GetLayerScreens(layer) == 0 || BG_BPP_LOOKUP[bgMode][layer] == 0)
         {
-            uint32_t pixelOffset = ((scanline * 2) * SCREEN_X) + i;
-            frameBuffer[pixelOffset] = 0;
-            frameBuffer[pixelOffset + SCREEN_X] = 0;
+            ClearLayerLine(layer);
+            continue;
         }
-        return;
+
+        if (bgEnableMosaic[layer] && bgMosaicSize > 1)
+            DrawMosaicBgLine(layer, bgY);
+        else if (bgMode == 7)
+            DrawBgLineMode7(scanline);
+        else
+            DrawBgLine(layer, bgY);
+
+        ApplyLayerWindow(layer, IsHiRes() ? SCREEN_X : SCREEN_X / 2, IsHiRes() ? 1 : 0);
     }
 
-    if (windowChanged)
-        GenerateWindowBitmaps();
+    if (GetLayerScreens(eOBJ) == 0)
+        ClearLayerLine(eOBJ);
+    else
+        DrawObjLine(scanline, sprites, spriteCount);
 
-    std::array<Sprite, 32> sprites;
-    int spriteCount = GetSpritesOnScanline(scanline, sprites);
+    // XRGB8888 lines are drawn straight into the frame. Other formats are converted from outputLine at the end.
+    const bool isConverted = pixelFormat != EPixelFormat::XRGB8888;
+    uint32_t *outputLine = isConverted ? this->outputLine.data() : reinterpret_cast<uint32_t *>(frameLine);
 
-    const int screenWidth = IsHiRes() ? SCREEN_X : SCREEN_X / 2;
+    if (IsHiRes())
+    {
+        ComposeMainScreen<true>(outputLine);
+    }
+    else if (isPseudoHiRes)
+    {
+        // The sub screen is the even pixels, and the main screen is the odd ones.
+        uint32_t *mainLine = pseudoHiResLine.data();
+        uint32_t *subLine = pseudoHiResLine.data() + SCREEN_X / 2;
+        ComposeMainScreen<false>(mainLine);
+        ComposeSubScreen(subLine);
+        ColorMath::InterleaveLine(subLine, mainLine, SCREEN_X / 2, outputLine);
+    }
+    else
+    {
+        ComposeMainScreen<false>(outputLine);
+    }
+
+    if (isConverted)
+    {
+        const int screenWidth = IsLineHiRes() ? SCREEN_X : SCREEN_X / 2;
+        ColorMath::ConvertLine(outputLine, screenWidth, pixelFormat, reinterpret_cast<uint16_t *>(frameLine));
+    }
+}
+
+
+template <bool HiRes>
+void Ppu::ComposeMainScreen(uint32_t *outputLine)
+{
+    const uint32_t black = ToOutputColor(0);
+    bool hasColorMath = false;
+
+    // Pixels without color math are converted to output colors here, the rest are blended below.
+    constexpr int screenWidth = HiRes ? SCREEN_X : SCREEN_X / 2;
     for (int x = 0; x < screenWidth; x++)
     {
-        PixelInfo pixel = GetPixelInfo<EScreenType::MainScreen>(x, scanline, sprites, spriteCount);
+        // OBJ and windows are always 256 pixels wide.
+        const uint16_t objX = HiRes ? x / 2 : x;
 
-        uint32_t color;
-        uint16_t mainColor = pixel.color;
-        bool isInside = IsPointInsideWindow(eCOL, x);
-        bool isClipped = false;
+        EBgLayer mainLayer = GetTopLayer<EScreenType::MainScreen>(x, objX);
 
-        // Clip to black depending on the color window.
-        if ((clipToBlack == EColorRegion::Outside && !isInside) ||
-            (clipToBlack == EColorRegion::Inside && isInside) ||
-             clipToBlack == EColorRegion::Always)
-        {
-            mainColor = 0;
-            isClipped = true;
-        }
+        // The backdrop is CGRAM color 0.
+        uint8_t mainIndex = mainLayer != eCOL ? GetLinePixel(mainLayer, x, objX).cgramIndex : 0;
+        // Clip to black and prevent color math depending on the color window.
+        bool isClipped = colorClipMask[objX] != 0;
+        bool isPrevented = colorPreventMask[objX] != 0;
+        uint8_t mathFlags = 0;
 
-        if ((preventColorMath == EColorRegion::Outside && !isInside) ||
-            (preventColorMath == EColorRegion::Inside && isInside) ||
-             preventColorMath == EColorRegion::Always)
+        if (!isPrevented && bgColorMathEnable[mainLayer] &&
+            (mainLayer != eOBJ || layerLine[eOBJ][objX].paletteId > 3))
         {
-            color = Bgr555(mainColor).ToARGB888(brightness);
+            mainColorLine[x] = isClipped ? 0 : GetCgramColor(mainIndex);
+            mathFlags = PrepareColorMath(x, objX, isClipped);
+            hasColorMath = true;
         }
-        else if (bgColorMathEnable[pixel.bg] && (pixel.bg != eOBJ || (pixel.bg == eOBJ && pixel.paletteId > 3)))
+
+        colorMathLine[x] = mathFlags;
+        outputLine[x] = isClipped ? black : outputPalette[mainIndex];
+    }
+
+    if (hasColorMath)
+    {
+        ColorMath::BlendLine(mainColorLine.data(), subColorLine.data(), colorMathLine.data(), screenWidth,
+                             colorSubtract, brightness, outputLine);
+    }
+}
+
+
+void Ppu::ComposeSubScreen(uint32_t *outputLine)
+{
+    // The sub screen's backdrop is the fixed color.
+    const uint32_t backdrop = ToOutputColor(fixedColor);
+
+    for (int x = 0; x < SCREEN_X / 2; x++)
+    {
+        EBgLayer subLayer = GetTopLayer<EScreenType::SubScreen>(x, x);
+        outputLine[x] = subLayer != eCOL ? outputPalette[GetLinePixel(subLayer, x, x).cgramIndex] : backdrop;
+    }
+}
+
+
+template <typename Pixel>
+static void WidenPixels(Pixel *line)
+{
+    // Work backwards so each pixel is read before it's overwritten.
+    for (int x = SCREEN_X / 2 - 1; x >= 0; x--)
+    {
+        line[x * 2 + 1] = line[x];
+        line[x * 2] = line[x];
+    }
+}
+
+
+void Ppu::WidenLine(int row)
+{
+    TripleBuffer::Frame &frame = frames->GetBackBuffer();
+    uint8_t *line = reinterpret_cast<uint8_t *>(frame.pixels.data()) + row * GetPitch();
+
+    if (pixelFormat == EPixelFormat::XRGB8888)
+        WidenPixels(reinterpret_cast<uint32_t *>(line));
+    else
+        WidenPixels(reinterpret_cast<uint16_t *>(line));
+
+    // The line isn't the way it was drawn anymore.
+    frame.isLineHiRes[row] = true;
+    frame.lineSignatures[row] = {};
+}
+
+
+void Ppu::WeaveOtherField()
+{
+    TripleBuffer::Frame &frame = frames->GetBackBuffer();
+    const TripleBuffer::Frame &lastFrame = frames->GetLastPublished();
+    const int lineCount = GetLineCount();
+    const int pitch = GetPitch();
+    uint8_t *pixels = reinterpret_cast<uint8_t *>(frame.pixels.data());
+
+    bool isFieldHiRes = false;
+    for (int y = 0; y < lineCount; y++)
+        isFieldHiRes |= frame.isLineHiRes[y * 2 + field];
+
+    // The last frame has the other field if it was interlaced with the same size and format. Otherwise each line of
+    // this field is doubled.
+    const bool isLastFrameWoven = lastFrame.descriptor.height == lineCount * 2 &&
+        lastFrame.descriptor.width == (isFieldHiRes ? SCREEN_X : SCREEN_X / 2) &&
+        lastFrame.descriptor.format == pixelFormat;
+    const uint8_t *lastPixels = reinterpret_cast<const uint8_t *>(lastFrame.pixels.data());
+
+    for (int y = 0; y < lineCount; y++)
+    {
+        const int row = y * 2 + (field ^ 1);
+
+        if (isLastFrameWoven)
         {
-            color = PerformColorMath(mainColor, isClipped, x, scanline, sprites, spriteCount);
+            memcpy(pixels + row * pitch, lastPixels + row * pitch, pitch);
+            frame.isLineHiRes[row] = lastFrame.isLineHiRes[row];
+            frame.lineSignatures[row] = lastFrame.lineSignatures[row];
+            frame.isLineChanged[row] = false;
         }
         else
         {
-            color = Bgr555(mainColor).ToARGB888(brightness);
+            const int drawnRow = y * 2 + field;
+            memcpy(pixels + row * pitch, pixels + drawnRow * pitch, pitch);
+            frame.isLineHiRes[row] = frame.isLineHiRes[drawnRow];
+            frame.lineSignatures[row] = {};
+            frame.isLineChanged[row] = true;
         }
+    }
+}
 
-        if (!IsHiRes())
-        {
-            const uint32_t pixelOffset = ((scanline * 2) * SCREEN_X) + (x * 2);
-            frameBuffer[pixelOffset] = color;
-            frameBuffer[pixelOffset + 1] = color;
-            frameBuffer[pixelOffset + SCREEN_X] = color;
-            frameBuffer[pixelOffset + SCREEN_X + 1] = color;
-        }
-        else
+
+void Ppu::PublishFrame()
+{
+    TripleBuffer::Frame &frame = frames->GetBackBuffer();
+
+    if (isFrameInterlaced)
+        WeaveOtherField();
+
+    // Frames are 256 pixels wide unless a line is hi-res, then they're 512 and the low-res lines are doubled.
+    const int height = isFrameInterlaced ? GetLineCount() * 2 : GetLineCount();
+    const bool isHiResFrame = std::any_of(frame.isLineHiRes.begin(), frame.isLineHiRes.begin() + height,
+                                          [](bool b) {return b;});
+
+    if (isHiResFrame)
+    {
+        for (int y = 0; y < height; y++)
         {
-            const uint32_t pixelOffset = ((scanline * 2) * SCREEN_X) + x;
-            frameBuffer[pixelOffset] = color;
-            frameBuffer[pixelOffset + SCREEN_X] = color;
+            if (!frame.isLineHiRes[y])
+                WidenLine(y);
         }
     }
+
+    frame.descriptor = {isHiResFrame ? SCREEN_X : SCREEN_X / 2, height, GetPitch(), pixelFormat};
+
+    // Every line changes when the width does. Any band can publish, so the width comes from the frame itself.
+    if (frame.descriptor.width != frames->GetLastPublished().descriptor.width)
+        std::fill(frame.isLineChanged.begin(), frame.isLineChanged.end(), true);
+
+    frames->Publish();
 }
 
 
 void Ppu::DrawScreen()
 {
-    displayInterface->FrameReady(frameBuffer);
+    PublishFrame();
+
+    if (displayInterface)
+        displayInterface->FrameReady(frames);
 }
 
 
 void Ppu::DrawFullScreen()
 {
-    for (int i = 0; i < 224; i++)
+    if (!renderers.empty())
+    {
+        WaitForRenderer();
+        renderers[0]->DrawFullScreen();
+        return;
+    }
+
+    for (int i = 0; i < GetLineCount(); i++)
     {
         DrawScanline(i);
     }
@@ -1,12 +1,23 @@
 #pragma once
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "Zlsnes.h"
 #include "DisplayInterface.h"
 #include "IoRegisterProxy.h"
+#include "TileCache.h"
 #include "TimerObserver.h"
+#include "TripleBuffer.h"
 
 class DebuggerInterface;
 class Memory;
+class PpuCapture;
 class Timer;
 
 const size_t OAM_SIZE = 544;
@@ -29,11 +40,27 @@ class Ppu : public IoRegisterProxy, public HBlankObserver, public VBlankObserver
 {
 public:
     Ppu(Memory *memory, Timer *timer, DisplayInterface *displayInterface, DebuggerInterface *debuggerInterface = nullptr);
-    virtual ~Ppu() {}
+    virtual ~Ppu();
 
     void LatchCounters(bool force = false);
 
+    // Moves drawing to a render thread. Everything that changes what gets drawn is logged, and the render thread
+    // replays the log into its own copy of the PPU a line or more behind. The output is the same as drawing on this
+    // thread. Call before any registers are written.
+    void StartRenderThread();
+    // Like StartRenderThread, but the log is handed over once per frame, and threadCount threads each replay it and
+    // draw one band of the frame's lines. Uses a thread per core when threadCount is 0.
+    void StartBandRendering(unsigned int threadCount = 0);
+
     void ToggleLayer(int layer, bool enabled);
+    // Frames are XRGB8888 unless set otherwise. Takes effect at the end of the next VBlank, so a frame is never drawn
+    // in two formats. Call it from the thread running the Ppu, or while the Ppu isn't running.
+    void SetPixelFormat(EPixelFormat format);
+
+    // Writes every frame from the next one on to a capture file at path, until StopCapture. Returns false if the file
+    // can't be created. See PpuCapture.
+    bool StartCapture(const std::string &path);
+    void StopCapture();
 
     // Inherited from IoRegisterProxy.
     uint8_t ReadRegister(EIORegisters ioReg) override;
@@ -42,6 +69,8 @@ public:
     // Used for debugging.
     uint8_t *GetOamPtr() {return &oam[0];}
     uint8_t *GetVramPtr() {return &vram[0];}
+    // Call after writing to VRAM through GetVramPtr.
+    void InvalidateTileCache();
     uint8_t *GetCgramPtr() {return &cgram[0];}
 
 protected:
@@ -53,6 +82,9 @@ protected:
     void ProcessVBlankEnd() override;
 
 private:
+    // Only used for the render thread's copy of the PPU. Registers are kept in shadowRegisters instead of Memory.
+    explicit Ppu(DisplayInterface *displayInterface);
+
     enum class EScreenType
     {
         MainScreen,
@@ -67,35 +99,42 @@ private:
         Always
     };
 
-    struct PixelInfo
+    // Bits for which screens a pixel is drawn on.
+    static const uint8_t MAIN_SCREEN = 0x01;
+    static const uint8_t SUB_SCREEN = 0x02;
+
+    // A pixel of a layer's line buffer, after the layer's window has been applied.
+    struct LinePixel
     {
-        uint8_t paletteId = 0;
+        uint8_t cgramIndex = 0; // Which of the 256 colors in CGRAM the pixel uses.
         uint8_t colorId = 0;
-        uint16_t color = color0;
-        bool isTransparent = true;
-        EBgLayer bg = eCOL;
+        uint8_t paletteId = 0;
         uint8_t priority = 0;
-        bool isOnMainScreen = false;
-        bool isOnSubScreen = false;
-
-        static uint16_t color0;
-
-        template <EScreenType Screen = EScreenType::MainScreen>
-        bool IsNotTransparent()
-        {
-            if constexpr (Screen == EScreenType::MainScreen)
-                return !isTransparent && isOnMainScreen;
-            else
-                return !isTransparent && isOnSubScreen;
-        }
+        uint8_t screens = 0; // Transparent pixels aren't on any screen.
     };
 
-    struct WindowInfo
+    // Hi-res modes have 512 BG pixels per line. OBJ is always 256 pixels.
+    using LineBuffer = std::array<LinePixel, SCREEN_X>;
+
+    enum class ELogEvent : uint8_t
+    {
+        WriteRegister,
+        ReadRegister,
+        HBlankStart,
+        HBlankEnd,
+        VBlankStart,
+        VBlankEnd,
+        SetPixelFormat // The new format is in value.
+    };
+
+    // A register write or read, or a timer event, and the scanline and dot it happened on.
+    struct LogEntry
     {
-        bool isInside = false;
-        bool isOnMainScreen = false;
-        bool isOnSubScreen = false;
-        bool isColorScreen = false;
+        uint16_t scanline;
+        uint16_t dot;
+        ELogEvent event;
+        uint8_t value;
+        uint16_t ioReg;
     };
 
     struct Sprite
@@ -112,51 +151,110 @@ private:
         uint8_t height = 0;
     };
 
-    struct BgTilemapCache
+    inline bool IsHiRes() const {return bgMode == 5 || bgMode == 6;}
+    // Lines are 512 pixels wide in modes 5 and 6, and with pseudo hi-res, which alternates the sub and main screens.
+    inline bool IsLineHiRes() const {return IsHiRes() || isPseudoHiRes;}
+    // Overscan draws 239 lines instead of 224.
+    inline int GetLineCount() const {return isOverscan ? 239 : 224;}
+    // The row of the frame each line is drawn to.
+    inline int GetFrameRow(uint8_t scanline) const {return isFrameInterlaced ? scanline * 2 + field : scanline;}
+    // BG3's tilemap has offsets for each column of BG1 and BG2 in these modes, instead of being a layer.
+    inline bool IsOffsetPerTile() const {return bgMode == 2 || bgMode == 4 || bgMode == 6;}
+
+    // The offset-per-tile entries of one 8 pixel column. Bit 13 applies an entry to BG1, and bit 14 to BG2.
+    struct OffsetPerTile
     {
-        union
-        {
-            uint16_t tileData = 0;
-            struct
-            {
-                uint16_t tileId : 10;
-                uint16_t paletteId : 3;
-                uint16_t priority : 1;
-                uint16_t flipX : 1;
-                uint16_t flipY : 1;
-            } data;
-        };
-
-        uint8_t tileX = 0xFF;
-        uint8_t tileY = 0xFF;
-
-        BgTilemapCache() {}
-        BgTilemapCache(uint16_t tileData, uint16_t tileX, uint16_t tileY) : tileData{tileData}, tileX(tileX), tileY(tileY) {}
+        uint16_t hEntry;
+        uint16_t vEntry;
     };
 
-    inline bool IsHiRes() const {return bgMode == 5 || bgMode == 6;}
+    // Columns are 8 pixels of BG1 or BG2 after scrolling, so a line can have part of 33 of them. The first column never
+    // has offsets.
+    static const int OPT_COLUMNS = 33;
 
-    void GenerateWindowBitmaps();
-    void GenerateWindowLayerBitmap(EBgLayer bg, uint8_t window, uint64_t *bitmask);
-    bool IsPointInsideWindow(EBgLayer bg, uint16_t screenX) const;
-    WindowInfo GetBgWindowValue(EBgLayer bg, uint16_t screenX) const;
+    // Windows are always 256 pixels wide. Each byte of a window mask is 0xFF inside the window and 0 outside.
+    static const int WINDOW_X = SCREEN_X / 2;
+    using WindowMask = std::array<uint8_t, WINDOW_X>;
 
-    uint8_t GetTilePixelData(uint16_t addr, uint8_t xOff, uint8_t yOff, uint8_t bpp) const;
+    void GenerateWindowMasks();
+    void GenerateWindowLayerMask(EBgLayer bg, uint8_t window, WindowMask &mask);
 
-    uint16_t GetBgTilemapEntry(EBgLayer bg, uint16_t tileX, uint16_t tileY) const;
-    PixelInfo GetBgPixelInfo(EBgLayer bg, uint16_t screenX, uint16_t screenY);
-    PixelInfo GetBgPixelInfoMode7(uint16_t screenX, uint16_t screenY);
+    uint16_t GetBgTilemapEntry(EBgLayer bg, uint16_t tileX, uint16_t tileY);
+    // Reads the line's offset-per-tile entries from BG3's tilemap.
+    void ReadOffsetPerTile();
 
+    void UpdateSpriteTable();
     uint8_t GetSpritesOnScanline(uint8_t scanline, std::array<Sprite, 32> &sprites);
-    PixelInfo GetSpritePixelInfo(uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount);
 
-    template <EScreenType Screen = EScreenType::MainScreen>
-    PixelInfo GetPixelInfo(uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount);
+    // Which screens a layer is enabled on, before windows are applied.
+    uint8_t GetLayerScreens(EBgLayer bg) const;
+    void ClearLayerLine(EBgLayer bg);
+    void ApplyLayerWindow(EBgLayer bg, int width, int windowShift);
+
+    // BG lines are drawn without their window, so the mosaic can be applied first.
+    void DrawBgLine(EBgLayer bg, uint16_t screenY);
+    void DrawBgLineMode7(uint16_t screenY);
+    // Draws the first line of the layer's vertical mosaic block, and fills each block of pixels with its first pixel.
+    void DrawMosaicBgLine(EBgLayer bg, uint16_t screenY);
+    void DrawObjLine(uint16_t screenY, const std::array<Sprite, 32> &sprites, uint8_t spriteCount);
 
-    uint16_t GetColorValueFromPalette(EBgLayer bg, uint8_t paletteId, uint8_t colorId);
-    uint32_t PerformColorMath(uint16_t mainColor, bool colorClipped, uint16_t screenX, uint16_t screenY, const std::array<Ppu::Sprite, 32> &sprites, uint8_t spriteCount);
+    // The priority table of mode 1 with BG3 in front of everything.
+    static const uint8_t MODE1_BG3_PRIORITY = 8;
 
+    template <EScreenType Screen = EScreenType::MainScreen>
+    EBgLayer GetTopLayer(uint16_t x, uint16_t objX) const;
+    const LinePixel &GetLinePixel(EBgLayer bg, uint16_t x, uint16_t objX) const {return layerLine[bg][bg == eOBJ ? objX : x];}
+
+    uint8_t GetCgramIndex(EBgLayer bg, uint8_t paletteId, uint8_t colorId) const;
+    uint16_t GetCgramColor(uint8_t cgramIndex) const;
+    // Sets the sub screen color of pixel x, and returns its ColorMath flags.
+    uint8_t PrepareColorMath(uint16_t x, uint16_t objX, bool colorClipped);
+    // Combines the layers into the output colors of the main screen. Hi-res lines have 512 BG pixels, and OBJ and the
+    // windows are stretched to match. Low-res lines get their own copy so they don't pay for it.
+    template <bool HiRes>
+    void ComposeMainScreen(uint32_t *outputLine);
+    // The output colors of the sub screen, without color math, for pseudo hi-res.
+    void ComposeSubScreen(uint32_t *outputLine);
+
+    // Output colors are ARGB8888 with the INIDISP brightness already applied.
+    uint32_t ToOutputColor(uint16_t color) const;
+    void UpdateOutputPalette(uint8_t cgramIndex);
+    void SetBrightness(uint8_t newBrightness);
+
+    uint8_t &BindRegister(EIORegisters ioReg);
+
+    void StartRenderThreads(unsigned int bandCount);
+    // Goes back to one render thread that draws every line.
+    void StopBands();
+
+    // Events are logged for the render threads, and for the capture.
+    inline bool IsLogging() const {return !renderers.empty() || capture;}
+    void LogEvent(ELogEvent event, uint16_t ioReg = 0, uint8_t value = 0);
+    // Hands the log to the render threads, waiting if they're too far behind.
+    void FlushLog();
+    // Waits until the render threads have replayed everything logged so far.
+    void WaitForRenderer();
+    // Called by each band's thread at VBlank. The last one publishes the frame from its renderer and shows it.
+    void FinishBand(Ppu *renderer);
+    void RenderThreadFunc(unsigned int band);
+    void ReplayLogEntry(const LogEntry &entry);
+
+    // Hashes everything besides VRAM, CGRAM, and OAM that changes how a line is drawn.
+    uint64_t GetLineStateHash() const;
+    // Returns the newest write count of CGRAM, OAM, and the VRAM regions.
+    uint64_t GetLastWrite(uint64_t vramRegions) const;
+    inline void MarkVramRead(uint16_t addr) {vramRegionsRead |= 1ULL << (addr >> 10);}
+    // Draws the line, unless the back buffer already has the same line from an earlier frame.
     void DrawScanline(uint8_t scanline);
+    void RenderScanline(uint8_t scanline, const std::array<Sprite, 32> &sprites, uint8_t spriteCount, uint8_t *frameLine);
+    // Doubles the pixels of a low-res line, for frames that also have hi-res lines.
+    void WidenLine(int row);
+    // Fills the rows of the field that wasn't drawn, from the last frame if it was interlaced the same way.
+    void WeaveOtherField();
+    // Returns the bytes between lines of the frame.
+    int GetPitch() const {return pixelFormat == EPixelFormat::XRGB8888 ? SCREEN_X * 4 : SCREEN_X * 2;}
+    // Finishes the frame in the back buffer and publishes it.
+    void PublishFrame();
     void DrawScreen();
     void DrawFullScreen(); // Used when debugging to update the screen.
 
@@ -170,7 +268,26 @@ private:
     std::array<uint8_t, OAM_SIZE> oam = {0};
     std::array<uint8_t, VRAM_SIZE> vram = {0};
     std::array<uint8_t, CGRAM_SIZE> cgram = {0};
-    std::array<uint32_t, SCREEN_X * SCREEN_Y> frameBuffer = {0};
+    // Lines are drawn straight into the back buffer, one row per line. Low-res lines only fill the first 256 pixels of
+    // their row. Render threads share the buffers of the Ppu that owns them.
+    std::shared_ptr<TripleBuffer> frames = std::make_shared<TripleBuffer>();
+    EPixelFormat pixelFormat = EPixelFormat::XRGB8888;
+    EPixelFormat nextPixelFormat = EPixelFormat::XRGB8888;
+
+    // For line signatures. writeCount goes up with every write that changes VRAM, CGRAM, or OAM, and each 1KB region of
+    // VRAM, CGRAM, and OAM keeps the count of its last change. vramRegionsRead has a bit for each VRAM region read
+    // while drawing the current line. Lines are only compared to lines drawn with the same epoch, which the bands of
+    // one frame share.
+    uint64_t signatureEpoch = 0;
+    uint64_t writeCount = 0;
+    std::array<uint64_t, VRAM_SIZE / 0x400> vramRegionWrites = {0};
+    uint64_t cgramWrite = 0;
+    uint64_t oamWrite = 0;
+    uint64_t vramRegionsRead = 0;
+    // The signature of each line of the last frame, to tell which lines changed.
+    std::array<TripleBuffer::LineSignature, SCREEN_Y> lastLineSignatures = {};
+
+    TileCache tileCache{vram.data()};
 
     Memory *memory = nullptr;
     Timer *timer = nullptr;
@@ -180,11 +297,53 @@ private:
     // PpuInterface.
     bool enableLayer[5] = {true, true, true, true, true};
 
-    // Cache
-    BgTilemapCache bgTilemapCache[5];
-    uint64_t windowBitmap[6][4];
+    // Each layer is drawn into its own line buffer, and then the buffers are combined into the main and sub screens.
+    LineBuffer layerLine[5];
+    // Read once per line, and shared by BG1 and BG2. optRegionsRead is the VRAM regions the entries were read from.
+    std::array<OffsetPerTile, OPT_COLUMNS> offsetPerTile = {};
+    uint64_t optRegionsRead = 0;
+
+    // The mosaic line of each BG, kept while its vertical block lasts. It's drawn again if the line state or the VRAM
+    // it read changes, the same as a line signature.
+    struct MosaicLine
+    {
+        int sourceY = -1;
+        uint64_t state = 0;
+        uint64_t vramRegions = 0;
+        uint64_t lastWrite = 0;
+        LineBuffer pixels;
+    };
+    std::array<MosaicLine, 4> mosaicLines;
+
+    // The main and sub screen colors and ColorMath flags of each pixel.
+    std::array<uint16_t, SCREEN_X> mainColorLine = {0};
+    std::array<uint16_t, SCREEN_X> subColorLine = {0};
+    std::array<uint8_t, SCREEN_X> colorMathLine = {0};
+    // The line's output colors, when they need converting to a 16 bit pixel format.
+    std::array<uint32_t, SCREEN_X> outputLine = {0};
+    // The main screen's output colors, then the sub screen's, before they're interleaved for pseudo hi-res.
+    std::array<uint32_t, SCREEN_X> pseudoHiResLine = {0};
+
+    // Window masks, regenerated when any window, screen, or color window register changes. layerScreenMask has the
+    // screens each pixel of a layer is on after its window is applied. colorClipMask and colorPreventMask are 0xFF
+    // where the color window clips the main screen to black, and where it prevents color math.
+    WindowMask windowMask[6];
+    WindowMask layerScreenMask[5];
+    WindowMask colorClipMask;
+    WindowMask colorPreventMask;
     bool windowChanged = true;
 
+    // CGRAM converted to output colors, and the output level of each 5 bit color channel value, at the current
+    // brightness.
+    std::array<uint32_t, 256> outputPalette;
+    uint8_t brightnessLevels[32] = {0};
+
+    // OAM decoded into sprites, and a bitmask per scanline of the sprites on it. Sprites are decoded again after their
+    // OAM entry or the sprite size changes.
+    std::array<Sprite, 128> spriteTable;
+    uint64_t spriteLines[256][2] = {};
+    uint64_t dirtySprites[2] = {~0UL, ~0UL};
+
     bool isHBlank = true;
     bool isVBlank = false;
     uint32_t scanline = 0;
@@ -204,7 +363,8 @@ private:
 
     // BGMODE - 0x2105
     uint8_t bgMode = 0;
-    bool bgMode1Bg3Priority = false;
+    // Which priority table orders the layers. It's the mode, or MODE1_BG3_PRIORITY when BG3 is in front in mode 1.
+    uint8_t priorityTable = 0;
     uint8_t bgChrSize[4] = {8, 8, 8, 8};
 
     // MOSAIC - 0x2106
@@ -292,6 +452,16 @@ private:
     uint8_t greenChannel = 0;
     uint16_t fixedColor = 0;
 
+    // SETINI - 0x2133
+    bool isPseudoHiRes = false;
+    bool isOverscan = false;
+    bool isInterlace = false;
+
+    // Interlaced frames draw each field into every other row of the frame. Interlace is latched at the start of each
+    // frame, and the field changes every frame.
+    bool isFrameInterlaced = false;
+    uint8_t field = 0;
+
     // OPHCT - 0x213C
     uint16_t hCount = 0xFFFF;
     bool hCountFlipflop = false;
@@ -303,6 +473,35 @@ private:
     uint8_t ppu1OpenBus = 0;
     uint8_t ppu2OpenBus = 0;
 
+    // Render threads. Each renderer is another Ppu that only sees the log, and draws either every line or one band of
+    // lines. Logs are shared by every renderer, and dropped from queuedLogs once they have all started on it. Once the
+    // CPU reads something that depends on drawing, there's only one renderer and this thread waits for it every line.
+    static const size_t MAX_QUEUED_LINES = 16;
+    static const uint16_t ALL_LINES = 0xFFFF;
+    std::vector<std::unique_ptr<Ppu>> renderers;
+    std::vector<std::thread> renderThreads;
+    std::mutex renderMutex;
+    std::condition_variable renderCv;
+    std::vector<LogEntry> logEntries;
+    std::deque<std::shared_ptr<const std::vector<LogEntry>>> queuedLogs;
+    uint64_t firstQueuedLog = 0;
+    std::vector<uint64_t> nextLog;
+    unsigned int bandsRunning = 0; // Only read or written while holding renderMutex.
+    unsigned int busyRenderers = 0;
+    unsigned int bandsFinished = 0;
+    uint64_t framesFinished = 0;
+    bool stopRendering = false;
+    bool renderSync = false;
+
+    // The lines this Ppu draws, when it's one of the renderers drawing a band.
+    uint16_t bandStart = 0;
+    uint16_t bandEnd = ALL_LINES;
+
+    // Gets a copy of the log while capturing.
+    std::unique_ptr<PpuCapture> capture;
+
+    std::array<uint8_t, 0x40> shadowRegisters = {0};
+
     //Write-only
     uint8_t &regINIDISP; // 0x2100 Display Control 1
     uint8_t &regOBJSEL;  // 0x2101 Object Size and Object Base
@@ -372,6 +571,7 @@ private:
     uint8_t &regSTAT78;  // 0x213F PPU2 Status and PPU2 Version Number
 
     friend class PpuTest;
+    friend class PpuCapture;
     friend class InfoWindow;
     friend class DebuggerWindow;
 };
\ No newline at end of file
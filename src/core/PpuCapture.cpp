@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <type_traits>
+
+#include "Bytes.h"
+#include "IoRegisters.h"
+#include "PpuCapture.h"
+
+
+static const char MAGIC[4] = {'Z', 'P', 'P', 'U'};
+static const uint32_t VERSION = 2;
+
+
+template <typename T>
+static void WriteValue(std::ofstream &file, const T &value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+
+template <typename T>
+static bool ReadValue(std::ifstream &file, T &value)
+{
+    return static_cast<bool>(file.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+
+PpuCapture::PpuCapture()
+{
+
+}
+
+
+PpuCapture::~PpuCapture()
+{
+
+}
+
+
+bool PpuCapture::Create(const std::string &path)
+{
+    outFile.open(path, std::ios::binary | std::ios::trunc);
+    if (!outFile.is_open())
+    {
+        LogError("Error creating PPU capture %s", path.c_str());
+        return false;
+    }
+
+    outFile.write(MAGIC, sizeof(MAGIC));
+    WriteValue(outFile, VERSION);
+
+    return true;
+}
+
+
+const EIORegisters PpuCapture::LAST_WRITE_REGISTERS[] = {
+    eRegINIDISP, eRegOBJSEL, eRegOAMADDL, eRegOAMADDH, eRegBGMODE, eRegMOSAIC, eRegBG1SC, eRegBG2SC, eRegBG3SC,
+    eRegBG4SC, eRegBG12NBA, eRegBG34NBA, eRegVMAIN, eRegM7SEL, eRegW12SEL, eRegW34SEL, eRegWOBJSEL, eRegWH0, eRegWH1,
+    eRegWH2, eRegWH3, eRegWBGLOG, eRegWOBJLOG, eRegTM, eRegTS, eRegTMW, eRegTSW, eRegCGWSEL, eRegCGADSUB, eRegSETINI
+};
+
+
+void PpuCapture::BeginFrame(const Ppu &ppu)
+{
+    static_assert(sizeof(LAST_WRITE_REGISTERS) / sizeof(LAST_WRITE_REGISTERS[0]) == LAST_WRITE_REGISTER_COUNT,
+                  "State has a byte for each register.");
+
+    Frame &frame = recordedFrame;
+    State &state = frame.state;
+    const uint8_t registers[LAST_WRITE_REGISTER_COUNT] = {
+        ppu.regINIDISP, ppu.regOBJSEL, ppu.regOAMADDL, ppu.regOAMADDH, ppu.regBGMODE, ppu.regMOSAIC, ppu.regBG1SC,
+        ppu.regBG2SC, ppu.regBG3SC, ppu.regBG4SC, ppu.regBG12NBA, ppu.regBG34NBA, ppu.regVMAIN, ppu.regM7SEL,
+        ppu.regW12SEL, ppu.regW34SEL, ppu.regWOBJSEL, ppu.regWH0, ppu.regWH1, ppu.regWH2, ppu.regWH3, ppu.regWBGLOG,
+        ppu.regWOBJLOG, ppu.regTM, ppu.regTS, ppu.regTMW, ppu.regTSW, ppu.regCGWSEL, ppu.regCGADSUB, ppu.regSETINI
+    };
+    std::copy(registers, registers + LAST_WRITE_REGISTER_COUNT, state.registers);
+
+    std::copy(ppu.bgHOffset, ppu.bgHOffset + 4, state.bgHOffset);
+    std::copy(ppu.bgVOffset, ppu.bgVOffset + 4, state.bgVOffset);
+    state.m7HOffset = ppu.m7HOffset;
+    state.m7VOffset = ppu.m7VOffset;
+    state.m7a = ppu.m7a;
+    state.m7b = ppu.m7b;
+    state.m7c = ppu.m7c;
+    state.m7d = ppu.m7d;
+    state.m7x = ppu.m7x;
+    state.m7y = ppu.m7y;
+    state.bgOffsetLatch = ppu.bgOffsetLatch;
+    state.bgHOffsetLatch = ppu.bgHOffsetLatch;
+    state.m7Latch = ppu.m7Latch;
+    state.oamLatch = ppu.oamLatch;
+    state.cgramLatch = ppu.cgramLatch;
+    std::copy(ppu.vramPrefetch, ppu.vramPrefetch + 2, state.vramPrefetch);
+    state.oamRwAddr = ppu.oamRwAddr;
+    state.vramRwAddr = ppu.vramRwAddr;
+    state.cgramRwAddr = ppu.cgramRwAddr;
+    state.fixedColor = ppu.fixedColor;
+    state.redChannel = ppu.redChannel;
+    state.greenChannel = ppu.greenChannel;
+    state.blueChannel = ppu.blueChannel;
+    state.field = ppu.field;
+    state.pixelFormat = static_cast<uint8_t>(ppu.pixelFormat);
+
+    frame.vram.assign(ppu.vram.begin(), ppu.vram.end());
+    frame.oam.assign(ppu.oam.begin(), ppu.oam.end());
+    frame.cgram.assign(ppu.cgram.begin(), ppu.cgram.end());
+    frame.log.clear();
+    isRecording = true;
+}
+
+
+void PpuCapture::RecordEntry(const Ppu::LogEntry &entry)
+{
+    if (isRecording)
+        recordedFrame.log.push_back(entry);
+}
+
+
+void PpuCapture::EndFrame()
+{
+    if (!isRecording)
+        return;
+
+    WriteFrame();
+    std::swap(lastRecordedFrame, recordedFrame);
+    isRecording = false;
+}
+
+
+void PpuCapture::WriteFrame()
+{
+    static_assert(sizeof(Ppu::LogEntry) == 8, "Log entries are written as they are in memory.");
+    static_assert(std::is_trivially_copyable<State>::value, "State is written as it is in memory.");
+
+    const Frame &frame = recordedFrame;
+    const Frame &last = lastRecordedFrame;
+
+    uint8_t flags = 0;
+    if (frame.vram != last.vram)
+        flags |= HAS_VRAM;
+    if (frame.oam != last.oam)
+        flags |= HAS_OAM;
+    if (frame.cgram != last.cgram)
+        flags |= HAS_CGRAM;
+
+    WriteValue(outFile, flags);
+    WriteValue(outFile, frame.state);
+    WriteValue(outFile, static_cast<uint32_t>(frame.log.size()));
+    if (flags & HAS_VRAM)
+        outFile.write(reinterpret_cast<const char *>(frame.vram.data()), frame.vram.size());
+    if (flags & HAS_OAM)
+        outFile.write(reinterpret_cast<const char *>(frame.oam.data()), frame.oam.size());
+    if (flags & HAS_CGRAM)
+        outFile.write(reinterpret_cast<const char *>(frame.cgram.data()), frame.cgram.size());
+    outFile.write(reinterpret_cast<const char *>(frame.log.data()), frame.log.size() * sizeof(Ppu::LogEntry));
+    outFile.flush();
+
+    if (!outFile)
+        LogError("Error writing PPU capture");
+}
+
+
+bool PpuCapture::Load(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        LogError("Error opening PPU capture %s", path.c_str());
+        return false;
+    }
+
+    char magic[sizeof(MAGIC)];
+    uint32_t version = 0;
+    if (!file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MAGIC) ||
+        !ReadValue(file, version) || version != VERSION)
+    {
+        LogError("%s isn't a PPU capture this version can read", path.c_str());
+        return false;
+    }
+
+    frames.clear();
+
+    uint8_t flags;
+    while (ReadValue(file, flags))
+    {
+        // Memory that isn't in the frame is the same as in the last one.
+        frames.emplace_back();
+        Frame &frame = frames.back();
+        if (frames.size() > 1)
+        {
+            const Frame &last = frames[frames.size() - 2];
+            frame.vram = last.vram;
+            frame.oam = last.oam;
+            frame.cgram = last.cgram;
+        }
+        frame.vram.resize(VRAM_SIZE);
+        frame.oam.resize(OAM_SIZE);
+        frame.cgram.resize(CGRAM_SIZE);
+
+        uint32_t entryCount = 0;
+        bool isComplete = ReadValue(file, frame.state) && ReadValue(file, entryCount) &&
+            (!(flags & HAS_VRAM) || file.read(reinterpret_cast<char *>(frame.vram.data()), frame.vram.size())) &&
+            (!(flags & HAS_OAM) || file.read(reinterpret_cast<char *>(frame.oam.data()), frame.oam.size())) &&
+            (!(flags & HAS_CGRAM) || file.read(reinterpret_cast<char *>(frame.cgram.data()), frame.cgram.size()));
+        if (isComplete)
+        {
+            frame.log.resize(entryCount);
+            isComplete = static_cast<bool>(file.read(reinterpret_cast<char *>(frame.log.data()),
+                                                     entryCount * sizeof(Ppu::LogEntry)));
+        }
+
+        if (!isComplete)
+        {
+            LogError("PPU capture %s is cut off in frame %zu", path.c_str(), frames.size() - 1);
+            frames.clear();
+            return false;
+        }
+    }
+
+    renderer.reset(new Ppu(nullptr));
+    return true;
+}
+
+
+void PpuCapture::StartFrame(size_t index)
+{
+    const Frame &frame = frames[index];
+    std::copy(frame.vram.begin(), frame.vram.end(), renderer->vram.begin());
+    std::copy(frame.oam.begin(), frame.oam.end(), renderer->oam.begin());
+    std::copy(frame.cgram.begin(), frame.cgram.end(), renderer->cgram.begin());
+
+    // Registers that are only their last write are decoded by writing them again. The rest are put back as they
+    // were, since writing them would go through latches the frame might still be in the middle of using.
+    const State &state = frame.state;
+    for (size_t i = 0; i < LAST_WRITE_REGISTER_COUNT; i++)
+        renderer->WriteRegister(LAST_WRITE_REGISTERS[i], state.registers[i]);
+
+    std::copy(state.bgHOffset, state.bgHOffset + 4, renderer->bgHOffset);
+    std::copy(state.bgVOffset, state.bgVOffset + 4, renderer->bgVOffset);
+    renderer->m7HOffset = state.m7HOffset;
+    renderer->m7VOffset = state.m7VOffset;
+    renderer->m7a = state.m7a;
+    renderer->m7b = state.m7b;
+    renderer->m7c = state.m7c;
+    renderer->m7d = state.m7d;
+    renderer->m7x = state.m7x;
+    renderer->m7y = state.m7y;
+    renderer->bgOffsetLatch = state.bgOffsetLatch;
+    renderer->bgHOffsetLatch = state.bgHOffsetLatch;
+    renderer->m7Latch = state.m7Latch;
+    renderer->oamLatch = state.oamLatch;
+    renderer->cgramLatch = state.cgramLatch;
+    std::copy(state.vramPrefetch, state.vramPrefetch + 2, renderer->vramPrefetch);
+    renderer->oamRwAddr = state.oamRwAddr;
+    renderer->vramRwAddr = state.vramRwAddr;
+    renderer->cgramRwAddr = state.cgramRwAddr;
+    renderer->fixedColor = state.fixedColor;
+    renderer->redChannel = state.redChannel;
+    renderer->greenChannel = state.greenChannel;
+    renderer->blueChannel = state.blueChannel;
+    renderer->pixelFormat = static_cast<EPixelFormat>(state.pixelFormat);
+    renderer->nextPixelFormat = renderer->pixelFormat;
+
+    // The frame's first event is the end of VBlank, which changes to the other field.
+    renderer->field = state.field;
+
+    // Nothing drawn before can be reused.
+    renderer->InvalidateTileCache();
+    renderer->dirtySprites[0] = ~0UL;
+    renderer->dirtySprites[1] = ~0UL;
+    renderer->windowChanged = true;
+    for (int i = 0; i < 256; i++)
+        renderer->UpdateOutputPalette(i);
+
+    currentFrame = index;
+    nextEntry = 0;
+}
+
+
+bool PpuCapture::DrawNextLine(Line &line)
+{
+    const std::vector<Ppu::LogEntry> &log = frames[currentFrame].log;
+
+    while (nextEntry < log.size())
+    {
+        const Ppu::LogEntry &entry = log[nextEntry++];
+        renderer->ReplayLogEntry(entry);
+
+        if (entry.event == Ppu::ELogEvent::HBlankStart && entry.scanline < renderer->GetLineCount())
+        {
+            line.scanline = entry.scanline;
+            line.bgMode = renderer->bgMode;
+            line.isForcedBlank = renderer->isForcedBlank;
+            line.width = renderer->IsLineHiRes() ? SCREEN_X : SCREEN_X / 2;
+            return true;
+        }
+    }
+
+    return false;
+}
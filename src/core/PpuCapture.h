@@ -0,0 +1,104 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Zlsnes.h"
+#include "Ppu.h"
+
+// Frames of what the PPU drew, so its drawing code can be run again without the CPU or a ROM. Each frame has the PPU's
+// registers and latches, and VRAM, OAM, and CGRAM, as they were at the end of VBlank, then every register write, read,
+// and timer event of the frame in the same form the render threads get them.
+//
+// The file is a header, then the frames one after another. VRAM, OAM, and CGRAM are left out of a frame when they're
+// the same as in the frame before. Values are in the host's byte order.
+class PpuCapture
+{
+public:
+    // What DrawNextLine drew.
+    struct Line
+    {
+        uint8_t scanline;
+        uint8_t bgMode;
+        bool isForcedBlank;
+        int width; // 512 for hi-res and pseudo hi-res lines, otherwise 256.
+    };
+
+    PpuCapture();
+    ~PpuCapture();
+
+    // Recording. The Ppu calls these while it's capturing.
+    bool Create(const std::string &path);
+    void BeginFrame(const Ppu &ppu);
+    void RecordEntry(const Ppu::LogEntry &entry);
+    void EndFrame();
+
+    // Replaying. Frames are drawn by a Ppu of the capture's own, which isn't shown anywhere.
+    bool Load(const std::string &path);
+    size_t GetFrameCount() const {return frames.size();}
+    // Puts the Ppu back the way it was at the start of frame index. Every line is drawn again, even if the Ppu drew
+    // the same line last time.
+    void StartFrame(size_t index);
+    // Replays the frame up to the end of its next visible line, and draws the line. Returns false once the frame is
+    // finished.
+    bool DrawNextLine(Line &line);
+    // The last frame drawn all the way to VBlank.
+    const TripleBuffer::Frame &GetLastFrame() const {return renderer->frames->GetLastPublished();}
+
+private:
+    // Registers that are only their last write, in the order they're in State.
+    static const EIORegisters LAST_WRITE_REGISTERS[];
+    static const size_t LAST_WRITE_REGISTER_COUNT = 30;
+
+    // Everything besides memory that the frame starts with. Registers with latches, or that share an address, can't
+    // be put back by writing them again, so their values and latches are kept as they are in the Ppu.
+    struct State
+    {
+        uint8_t registers[LAST_WRITE_REGISTER_COUNT];
+        uint16_t bgHOffset[4];
+        uint16_t bgVOffset[4];
+        int16_t m7HOffset;
+        int16_t m7VOffset;
+        int16_t m7a, m7b, m7c, m7d, m7x, m7y;
+        uint8_t bgOffsetLatch;
+        uint8_t bgHOffsetLatch;
+        uint8_t m7Latch;
+        uint8_t oamLatch;
+        uint8_t cgramLatch;
+        uint8_t vramPrefetch[2];
+        uint16_t oamRwAddr;
+        uint16_t vramRwAddr;
+        uint16_t cgramRwAddr;
+        uint16_t fixedColor;
+        uint8_t redChannel, greenChannel, blueChannel;
+        uint8_t field;
+        uint8_t pixelFormat;
+    };
+
+    struct Frame
+    {
+        State state = {};
+        std::vector<uint8_t> vram;
+        std::vector<uint8_t> oam;
+        std::vector<uint8_t> cgram;
+        std::vector<Ppu::LogEntry> log;
+    };
+
+    // Bits of a frame's flags for the memory it has.
+    static const uint8_t HAS_VRAM = 0x01;
+    static const uint8_t HAS_OAM = 0x02;
+    static const uint8_t HAS_CGRAM = 0x04;
+
+    void WriteFrame();
+
+    std::ofstream outFile;
+    bool isRecording = false;
+    Frame recordedFrame;
+    Frame lastRecordedFrame;
+
+    std::vector<Frame> frames;
+    std::unique_ptr<Ppu> renderer;
+    size_t currentFrame = 0;
+    size_t nextEntry = 0;
+};
@@ -0,0 +1,306 @@
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "RomImage.h"
+
+static const size_t LOROM_HEADER_OFFSET = 0x7FC0;
+static const size_t HIROM_HEADER_OFFSET = 0xFFC0;
+static const size_t EXHIROM_HEADER_OFFSET = 0x40FFC0;
+
+static const ssize_t EXTENDED_HEADER_OFSET = -0x10;
+
+// Inspecting a library of ROMs shouldn't fill the log with every file that doesn't look like a ROM.
+#define LogImageError(...) do {if (!quiet) LogError(__VA_ARGS__);} while (0)
+#define LogImageInfo(...)  do {if (!quiet) LogInfo(__VA_ARGS__);} while (0)
+
+
+static const std::unordered_set<uint8_t> romModeLookup = {
+    RomImage::ERomType::eLoROM,
+    RomImage::ERomType::eLoROMSDD1,
+    RomImage::ERomType::eLoROMSA1,
+    RomImage::ERomType::eHiROM,
+    RomImage::ERomType::eExHiROM
+};
+
+
+struct CachedImage
+{
+    off_t size;
+    timespec mtime;
+    std::weak_ptr<const RomImage> image;
+};
+
+// Images that are currently loaded, keyed by the canonical path of the file.
+static std::map<std::string, CachedImage> imageCache;
+static std::mutex imageCacheMutex;
+
+
+std::shared_ptr<const RomImage> RomImage::Load(const std::string &filename)
+{
+    char *resolved = realpath(filename.c_str(), nullptr);
+    if (resolved == nullptr)
+    {
+        LogError("Unable to open file %s", filename.c_str());
+        return nullptr;
+    }
+    std::string path(resolved);
+    free(resolved);
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        LogError("Unable to open file %s", filename.c_str());
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(imageCacheMutex);
+
+    // Reuse the image if it is still loaded and the file hasn't changed since.
+    auto it = imageCache.find(path);
+    if (it != imageCache.end() && it->second.size == st.st_size &&
+        it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        std::shared_ptr<const RomImage> cached = it->second.image.lock();
+        if (cached)
+        {
+            LogInfo("Using already loaded image of %s", filename.c_str());
+            return cached;
+        }
+    }
+
+    // The constructor is private, so make_shared can't be used.
+    std::shared_ptr<RomImage> image(new RomImage());
+    if (!image->Map(path) || !image->Validate())
+        return nullptr;
+
+    image->GenerateSlotOffsets();
+
+    imageCache[path] = CachedImage{st.st_size, st.st_mtim, image};
+
+    return image;
+}
+
+
+std::unique_ptr<const RomImage> RomImage::Inspect(const std::string &filename)
+{
+    std::unique_ptr<RomImage> image(new RomImage());
+    image->quiet = true;
+    if (!image->Map(filename) || !image->Validate())
+        return nullptr;
+
+    return image;
+}
+
+
+RomImage::~RomImage()
+{
+    if (romMapping != nullptr)
+        munmap(romMapping, romMappingSize);
+}
+
+
+bool RomImage::Map(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        LogImageError("Unable to open file %s", filename.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        LogImageError("Unable to get size of file %s", filename.c_str());
+        close(fd);
+        return false;
+    }
+
+    // Map the file instead of reading it, so only the pages that are actually accessed get loaded.
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        LogImageError("Unable to map file %s", filename.c_str());
+        return false;
+    }
+
+    romMapping = static_cast<uint8_t *>(mapping);
+    romMappingSize = st.st_size;
+    rom = romMapping;
+    romSize = romMappingSize;
+
+    return true;
+}
+
+
+void RomImage::GenerateSlotOffsets()
+{
+    // Mirroring a ROM that isn't made up of whole slots starts slots in the middle of the ROM, and the last slot that
+    // fits would run off the end of the mapping.
+    if ((romSize % SLOT_SIZE) != 0)
+    {
+        paddedRom.resize(romSize + SLOT_SIZE);
+        for (size_t i = 0; i < paddedRom.size(); i++)
+            paddedRom[i] = rom[i % romSize];
+        rom = paddedRom.data();
+    }
+
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++)
+    {
+        uint32_t addr = slot << SLOT_SHIFT;
+        uint32_t mappedAddr;
+
+        if (isLoRom)
+        {
+            // This is a read from LoROM area. 00-7D:8000-FFFF, 80-FF:8000-FFFF
+            // or
+            // This is a read from HiROM area. 40-7D:0000-7FFF, C0-FF:0000-7FFF
+            // Remove the high bit of the offset and shift the bank right one so that LSBit of bank is MSBit of offset.
+            // Ignore the high bit of bank, which selects WS1/WS2.
+            mappedAddr = ((addr & 0x7F0000) >> 1) | (addr & 0x7FFF);
+        }
+        else if (romType == ERomType::eExHiROM)
+        {
+            // The first 4MB of the ROM is in banks C0-FF, and the rest is in 40-7D. 00-3F and 80-BF mirror the upper
+            // half of those banks, like HiROM. Invert the high bit of the bank and move it to bit 22.
+            mappedAddr = ((~addr & 0x800000) >> 1) | (addr & 0x3FFFFF);
+        }
+        else
+        {
+            // This is a read from HiROM area. 40-7D:0000-FFFF, C0-FF:0000-FFFF
+            // or
+            // This is a read from LoROM area. 00-3F:8000-FFFF, 80-BF:8000-FFFF
+            // Clear bits 22 and 23.
+            mappedAddr = addr & 0x3FFFFF;
+        }
+
+        // Mirror ROMs that are smaller than the area they are mapped to.
+        slotOffsets[slot] = mappedAddr % romSize;
+    }
+}
+
+
+bool RomImage::Validate()
+{
+    // Check for and skip useless header added by cartridge copying devices.
+    // The mapping can't be modified, so just move the start of the ROM past it.
+    size_t copierHeaderLen = romSize % 1024;
+    if (copierHeaderLen != 0)
+    {
+        LogImageInfo("Detected copier header of length %d", copierHeaderLen);
+        rom += copierHeaderLen;
+        romSize -= copierHeaderLen;
+    }
+
+    if (romSize == 0)
+    {
+        LogImageError("ROM is empty");
+        return false;
+    }
+
+    size_t offset = 0;
+
+    // ExHiROMs also have something that looks like a header at the HiROM offset, so check for it first.
+    if ((romSize >= EXHIROM_HEADER_OFFSET + 32) && FindHeader(EXHIROM_HEADER_OFFSET) &&
+        (standardHeader.mode & 0x0F) == ERomType::eExHiROM)
+    {
+        offset = EXHIROM_HEADER_OFFSET;
+        hasHeader = true;
+    }
+    else if ((romSize >= LOROM_HEADER_OFFSET + 32) && FindHeader(LOROM_HEADER_OFFSET))
+    {
+        offset = LOROM_HEADER_OFFSET;
+        hasHeader = true;
+    }
+    else if ((romSize >= HIROM_HEADER_OFFSET + 32) && FindHeader(HIROM_HEADER_OFFSET))
+    {
+        offset = HIROM_HEADER_OFFSET;
+        hasHeader = true;
+    }
+    else
+    {
+        LogImageError("Unable to determine cartridge type");
+        //return false;
+        // Default to LoROM for now.
+        offset = LOROM_HEADER_OFFSET;
+        if (romSize < offset + sizeof(StandardHeader))
+            return false;
+        memcpy(&standardHeader, &rom[offset], sizeof(StandardHeader));
+    }
+
+    LogImageInfo("Title = %.21s", standardHeader.title);
+
+    romType = static_cast<ERomType>(standardHeader.mode & 0x0F);
+    isLoRom = (romType == ERomType::eLoROM || romType == ERomType::eLoROMSA1 || romType == ERomType::eLoROMSDD1);
+    isFastSpeed = (standardHeader.mode >> 4) & 1;
+    
+    // Interleaved ROMs can be hiROM, but have the header at the LoROM file offset.
+    isInterleaved = (offset == LOROM_HEADER_OFFSET) && !isLoRom;
+    if (isInterleaved)
+    {
+        LogImageError("Interleaved ROM NYI");
+        return false;
+    }
+    
+    if (standardHeader.devId == 0x33 || standardHeader.title[20] == 0)
+    {
+        // If the last byte of the title is null, this is an early extended header where only the chip subtype byte is valid.
+        // If devId is 0x33, this is a later extended header where all fields are valid.
+        size_t extOffset = offset + EXTENDED_HEADER_OFSET;
+        memcpy(&extendedHeader, &rom[extOffset], sizeof(ExtendedHeader));
+    }
+
+    return true;
+}
+
+
+bool RomImage::FindHeader(size_t headerOffset)
+{
+    StandardHeader header;
+    memcpy(&header, &rom[headerOffset], sizeof(StandardHeader));
+
+    LogImageInfo("Checking for standard header at %04X", headerOffset);
+
+    // Check that title field is all ASCII. The last byte can be null.
+    for (int i = 0; i < 20; i++)
+    {
+        if (header.title[i] < 0x20 || header.title[i] > 0x7E)
+        {
+            LogImageError("Non-ASCII value (%02X) in Title at %04X", header.title[i], headerOffset + i);
+            return false;
+        }
+    }
+    if ((header.title[20] > 0 && header.title[20] < 0x20) || header.title[20] > 0x7E)
+    {
+        LogImageError("Non-ASCII value (%02X) in Title at %04X", header.title[20], headerOffset + 20);
+        return false;
+    }
+
+    // Look for a mode-like byte. This succeeds at the wrong offset with FF5 which is why the rest of the checks are necesasry.
+    if (romModeLookup.find(header.mode & 0x0F) == romModeLookup.end())
+    {
+        LogImageError("Bad mode (%02X) at %04X", header.mode, headerOffset + offsetof(StandardHeader, mode));
+        return false;
+    }
+
+    // Check checksums. This doesn't actually verify all ROM data in case this is a hacked ROM.
+    if ((header.checksum ^ header.checksumComplement) != 0xFFFF &&
+        !(header.checksum == 0x5343 && header.checksumComplement == 0x4343) && // Some test roms use these hardcoded values.
+        !(header.checksum == 0x0000 && header.checksumComplement == 0x0000)) // Some test roms have all zeros.
+    {
+        LogImageError("Bad checksum at %04X", headerOffset);
+        return false;
+    }
+
+    LogImageInfo("Found valid standard header at %04X", headerOffset);
+    standardHeader = header;
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Zlsnes.h"
+
+
+// The ROM data and everything derived from it. This is never modified after it is loaded, so a single image is shared
+// by every Cartridge that loads the same file.
+class RomImage
+{
+public:
+    enum ERomType
+    {
+        eLoROM = 0x00,
+        eHiROM = 0x01,
+        eLoROMSDD1 = 0x02,
+        eLoROMSA1 = 0x03,
+        eExHiROM = 0x05,
+        //eHiRomSPC7110 = 0x0A
+    };
+
+#pragma pack(1)
+    struct StandardHeader
+    {
+        char title[21] = {0};
+        uint8_t mode = 0;
+        uint8_t chipset = 0;
+        uint8_t romSize = 0;
+        uint8_t ramSize = 0;
+        uint8_t country = 0;
+        uint8_t devId = 0;
+        uint8_t romVersion = 0;
+        uint16_t checksumComplement = 0;
+        uint16_t checksum = 0;
+    };
+
+    struct ExtendedHeader
+    {
+        char makerCode[2] = {0};
+        char gameCode[4] = {0};
+        char reserved[6] = {0};
+        uint8_t expansionFlashSize = 0;
+        uint8_t expansionRamSize = 0;
+        uint8_t specialVersion = 0;
+        uint8_t chipsetSubtype = 0;
+    };
+#pragma pack()
+
+    // The address space is split into 8KB slots, which is the smallest unit any of the mapping modes use.
+    static const uint32_t SLOT_SHIFT = 13;
+    static const uint32_t SLOT_SIZE = 1 << SLOT_SHIFT;
+    static const uint32_t SLOT_COUNT = 0x1000000 >> SLOT_SHIFT;
+
+    // Returns the already loaded image if another Cartridge is using the same file.
+    static std::shared_ptr<const RomImage> Load(const std::string &filename);
+
+    // Loads an image without logging or sharing it, for looking at the header of a file that might not be a ROM.
+    static std::unique_ptr<const RomImage> Inspect(const std::string &filename);
+
+    ~RomImage();
+
+    RomImage(const RomImage&) = delete;
+    RomImage &operator=(const RomImage&) = delete;
+
+    const uint8_t *GetData() const {return rom;}
+    size_t GetSize() const {return romSize;}
+
+    // Offset into the ROM for an address that has already been checked to not be SRAM, WRAM, or IO.
+    uint32_t GetRomOffset(uint32_t addr) const {return (slotOffsets[addr >> SLOT_SHIFT] + (addr & (SLOT_SIZE - 1))) % romSize;}
+    // The data for a whole slot, starting at the slot's offset. This can run past the end of the ROM, where the ROM
+    // repeats.
+    const uint8_t *GetSlotData(uint32_t addr) const {return &rom[slotOffsets[addr >> SLOT_SHIFT]];}
+
+    const StandardHeader &GetStandardHeader() const {return standardHeader;}
+    const ExtendedHeader &GetExtendedHeader() const {return extendedHeader;}
+    ERomType GetRomType() const {return romType;}
+    bool IsLoRom() const {return isLoRom;}
+    bool IsFastSpeed() const {return isFastSpeed;}
+    bool IsInterleaved() const {return isInterleaved;}
+    // False if no valid header was found, and the ROM is being treated as LoROM.
+    bool HasHeader() const {return hasHeader;}
+
+private:
+    RomImage() {}
+
+    bool Map(const std::string &filename);
+    bool Validate();
+    bool FindHeader(size_t headerOffset);
+    void GenerateSlotOffsets();
+
+    // The ROM file is mapped read-only. rom points past any copier header, so it is the start of the actual ROM data.
+    uint8_t *romMapping = nullptr;
+    size_t romMappingSize = 0;
+    const uint8_t *rom = nullptr;
+    size_t romSize = 0;
+    // ROMs that aren't made up of whole slots are copied here with a slot of the ROM repeated after the end, so a slot
+    // that starts near the end can still be read as a whole.
+    std::vector<uint8_t> paddedRom;
+
+    std::array<uint32_t, SLOT_COUNT> slotOffsets = {0};
+
+    StandardHeader standardHeader;
+    ExtendedHeader extendedHeader;
+
+    ERomType romType = ERomType::eLoROM;
+    bool isLoRom = true;
+    bool isFastSpeed = false;
+    bool isInterleaved = false;
+    bool hasHeader = false;
+
+    bool quiet = false;
+};
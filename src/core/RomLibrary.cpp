@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_set>
+
+#include "RomLibrary.h"
+#include "RomImage.h"
+
+namespace fs = std::filesystem;
+
+static const char *INDEX_MAGIC = "zlsnes-rom-index";
+static const int INDEX_VERSION = 1;
+
+static const std::unordered_set<std::string> romExtensions = {".sfc", ".smc", ".swc", ".fig"};
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4F;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5;
+
+
+static inline uint64_t RotateLeft(uint64_t value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+
+static inline uint64_t Read64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+
+static inline uint32_t Read32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+
+static inline uint64_t XxHashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = RotateLeft(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+static inline uint64_t XxHashMergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= XxHashRound(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+RomLibrary::RomLibrary(const std::string &indexFilename) :
+    indexFilename(indexFilename)
+{
+
+}
+
+
+RomLibrary::~RomLibrary()
+{
+
+}
+
+
+bool RomLibrary::LoadIndex()
+{
+    entries.clear();
+
+    std::ifstream file(indexFilename);
+    if (!file)
+    {
+        LogWarning("Couldn't open ROM index %s", indexFilename.c_str());
+        return false;
+    }
+
+    std::string line;
+    std::string magic;
+    int version = 0;
+    if (!std::getline(file, line) || !(std::istringstream(line) >> magic >> version) ||
+        magic != INDEX_MAGIC || version != INDEX_VERSION)
+    {
+        LogWarning("ROM index %s is not a supported version. Starting with an empty index.", indexFilename.c_str());
+        return false;
+    }
+
+    // Each line is the numeric fields separated by spaces, then the title and path separated by tabs. The path is last
+    // since it is the only field that can contain a tab.
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+        Entry entry;
+        int isValid, mode, chipset;
+        std::string title, path;
+
+        stream >> entry.fileSize >> entry.mtime >> isValid >> std::hex >> entry.hash >> std::dec >> mode >> chipset >>
+                  entry.romSize >> entry.ramSize;
+        if (!stream || stream.get() != '\t' || !std::getline(stream, title, '\t') || !std::getline(stream, path) ||
+            path.empty())
+        {
+            LogWarning("Skipping bad line in ROM index: %s", line.c_str());
+            continue;
+        }
+
+        entry.isValid = isValid != 0;
+        entry.mode = static_cast<uint8_t>(mode);
+        entry.chipset = static_cast<uint8_t>(chipset);
+        entry.title = title;
+        entries[path] = entry;
+    }
+
+    return true;
+}
+
+
+bool RomLibrary::SaveIndex() const
+{
+    // Write to a temporary file and rename it over the old one, so a crash while saving can't corrupt the index.
+    std::string tempFilename = indexFilename + ".tmp";
+    std::ofstream file(tempFilename);
+    if (!file.is_open())
+    {
+        LogError("Error opening ROM index %s", tempFilename.c_str());
+        return false;
+    }
+
+    file << INDEX_MAGIC << " " << INDEX_VERSION << "\n";
+    for (const auto &it : entries)
+    {
+        const Entry &entry = it.second;
+        file << entry.fileSize << " " << entry.mtime << " " << (entry.isValid ? 1 : 0) << " " << std::hex <<
+                entry.hash << std::dec << " " << static_cast<int>(entry.mode) << " " <<
+                static_cast<int>(entry.chipset) << " " << entry.romSize << " " << entry.ramSize << "\t" <<
+                entry.title << "\t" << it.first << "\n";
+    }
+
+    file.close();
+    if (!file)
+    {
+        LogError("Error writing ROM index %s", tempFilename.c_str());
+        return false;
+    }
+
+    if (rename(tempFilename.c_str(), indexFilename.c_str()) != 0)
+    {
+        LogError("Error renaming %s to %s", tempFilename.c_str(), indexFilename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+size_t RomLibrary::Scan(const std::vector<std::string> &directories, unsigned int threadCount)
+{
+    struct WorkItem
+    {
+        std::string path;
+        uint64_t fileSize;
+        int64_t mtime;
+    };
+
+    std::vector<WorkItem> work;
+    std::unordered_set<std::string> found;
+    std::vector<std::string> scannedDirs;
+
+    for (const std::string &directory : directories)
+    {
+        std::error_code ec;
+        fs::path dir = fs::canonical(directory, ec);
+        if (ec)
+        {
+            LogError("Unable to scan %s: %s", directory.c_str(), ec.message().c_str());
+            continue;
+        }
+        scannedDirs.push_back(dir.string() + "/");
+
+        for (fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+             it != end; it.increment(ec))
+        {
+            if (ec)
+                break;
+
+            std::string ext = it->path().extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (romExtensions.find(ext) == romExtensions.end())
+                continue;
+
+            std::error_code pathEc;
+            std::string path = fs::canonical(it->path(), pathEc).string();
+            struct stat st;
+            if (pathEc || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || !found.insert(path).second)
+                continue;
+
+            uint64_t fileSize = st.st_size;
+            int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+            auto existing = entries.find(path);
+            if (existing != entries.end() && existing->second.fileSize == fileSize && existing->second.mtime == mtime)
+                continue;
+
+            work.push_back(WorkItem{path, fileSize, mtime});
+        }
+    }
+
+    // Forget about files that were in a scanned directory, but aren't anymore.
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        bool inScannedDir = std::any_of(scannedDirs.begin(), scannedDirs.end(), [&it](const std::string &dir) {
+            return it->first.compare(0, dir.size(), dir) == 0;
+        });
+
+        if (inScannedDir && found.find(it->first) == found.end())
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min<size_t>(threadCount, work.size());
+
+    // Each thread takes the next file that hasn't been started, and stores the result at the same index.
+    std::vector<Entry> results(work.size());
+    std::atomic<size_t> nextItem(0);
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back([&work, &results, &nextItem]() {
+            size_t item;
+            while ((item = nextItem.fetch_add(1)) < work.size())
+                results[item] = InspectFile(work[item].path, work[item].fileSize, work[item].mtime);
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < work.size(); i++)
+        entries[work[i].path] = results[i];
+
+    LogInfo("Scanned %zu ROMs, %zu new or changed", found.size(), work.size());
+
+    return work.size();
+}
+
+
+RomLibrary::Entry RomLibrary::InspectFile(const std::string &path, uint64_t fileSize, int64_t mtime)
+{
+    Entry entry;
+    entry.fileSize = fileSize;
+    entry.mtime = mtime;
+
+    std::unique_ptr<const RomImage> image = RomImage::Inspect(path);
+    if (!image || !image->HasHeader())
+        return entry;
+
+    const RomImage::StandardHeader &header = image->GetStandardHeader();
+
+    entry.isValid = true;
+    entry.hash = XxHash64(image->GetData(), image->GetSize());
+    entry.title = std::string(header.title, strnlen(header.title, sizeof(header.title)));
+    // The title is whatever bytes the ROM has, and a tab or newline would break its line in the index. RomImage only
+    // finds headers with printable titles now, but the index shouldn't depend on that.
+    std::replace_if(entry.title.begin(), entry.title.end(), [](char c) {return c < 0x20 || c > 0x7E;}, '?');
+    entry.title.erase(entry.title.find_last_not_of(' ') + 1);
+    entry.mode = header.mode;
+    entry.chipset = header.chipset;
+    entry.romSize = image->GetSize();
+    entry.ramSize = header.ramSize != 0 ? (1 << header.ramSize) * 1024 : 0;
+
+    return entry;
+}
+
+
+uint64_t RomLibrary::XxHash64(const uint8_t *data, size_t size, uint64_t seed)
+{
+    const uint8_t *end = data + size;
+    uint64_t hash;
+
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        // The four lanes are independent, so the compiler can keep them all in flight at once.
+        const uint8_t *limit = end - 32;
+        do
+        {
+            v1 = XxHashRound(v1, Read64(data));
+            v2 = XxHashRound(v2, Read64(data + 8));
+            v3 = XxHashRound(v3, Read64(data + 16));
+            v4 = XxHashRound(v4, Read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        hash = XxHashMergeRound(hash, v1);
+        hash = XxHashMergeRound(hash, v2);
+        hash = XxHashMergeRound(hash, v3);
+        hash = XxHashMergeRound(hash, v4);
+    }
+    else
+    {
+        hash = seed + PRIME64_5;
+    }
+
+    hash += size;
+
+    for (; data + 8 <= end; data += 8)
+    {
+        hash ^= XxHashRound(0, Read64(data));
+        hash = RotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (data + 4 <= end)
+    {
+        hash ^= Read32(data) * PRIME64_1;
+        hash = RotateLeft(hash, 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+        hash ^= *data * PRIME64_5;
+        hash = RotateLeft(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Zlsnes.h"
+
+
+// Finds ROMs in directories and keeps what was learned about them in an index file, so later scans only have to look
+// at files that were added or changed.
+class RomLibrary
+{
+public:
+    struct Entry
+    {
+        uint64_t fileSize = 0;
+        int64_t mtime = 0; // Nanoseconds.
+
+        // False if the file couldn't be read or doesn't have a recognizable header. The rest of the fields are only
+        // valid if this is true.
+        bool isValid = false;
+
+        // Hash of the ROM data without any copier header, so headered and unheadered copies of a ROM match.
+        uint64_t hash = 0;
+        std::string title;
+        uint8_t mode = 0;
+        uint8_t chipset = 0;
+        uint32_t romSize = 0;
+        uint32_t ramSize = 0;
+    };
+
+    explicit RomLibrary(const std::string &indexFilename);
+    ~RomLibrary();
+
+    bool LoadIndex();
+    bool SaveIndex() const;
+
+    // Recursively scans directories for ROM files. Files that are already in the index with the same size and mtime
+    // aren't opened. Returns the number of files that had to be inspected.
+    size_t Scan(const std::vector<std::string> &directories, unsigned int threadCount = 0);
+
+    // Keyed by the canonical path of the file.
+    const std::map<std::string, Entry> &GetEntries() const {return entries;}
+
+    static uint64_t XxHash64(const uint8_t *data, size_t size, uint64_t seed = 0);
+
+private:
+    static Entry InspectFile(const std::string &path, uint64_t fileSize, int64_t mtime);
+
+    std::string indexFilename;
+    std::map<std::string, Entry> entries;
+};
@@ -0,0 +1,55 @@
+#include "TileCache.h"
+#include "Ppu.h"
+#include "TileDecoder.h"
+
+
+TileCache::TileCache(const uint8_t *vram) :
+    vram(vram)
+{
+    for (int level = 0; level < 4; level++)
+    {
+        const size_t tileCount = VRAM_SIZE >> (level + 4);
+        decoded[level].resize(tileCount * 64);
+        dirty[level].resize(tileCount, true);
+    }
+}
+
+
+TileCache::~TileCache()
+{
+
+}
+
+
+void TileCache::InvalidateAll()
+{
+    for (int level = 0; level < 4; level++)
+        dirty[level].assign(dirty[level].size(), true);
+    mode7Dirty = true;
+}
+
+
+void TileCache::DecodeTile(int level, uint16_t tile)
+{
+    const uint8_t *tileData = &vram[tile << (level + 4)];
+    uint8_t *out = &decoded[level][tile << 6];
+
+    if (level == MODE7_LEVEL)
+        TileDecoder::DecodeMode7Tile(tileData, out);
+    else
+        TileDecoder::DecodeTile(tileData, 2 << level, out);
+
+    dirty[level][tile] = false;
+}
+
+
+void TileCache::DecodeMode7Tiles()
+{
+    for (int tileId = 0; tileId < 256; tileId++)
+    {
+        if (dirty[MODE7_LEVEL][tileId])
+            DecodeTile(MODE7_LEVEL, tileId);
+    }
+
+    mode7Dirty = false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include "Zlsnes.h"
+
+
+// Keeps VRAM tiles decoded into one color id per byte. Tiles are only decoded again after VRAM they
+// use is written to.
+class TileCache
+{
+public:
+    explicit TileCache(const uint8_t *vram);
+    ~TileCache();
+
+    // Marks every tile that contains the VRAM byte at addr as needing to be decoded again.
+    inline void Invalidate(uint16_t addr)
+    {
+        dirty[0][addr >> 4] = true;
+        dirty[1][addr >> 5] = true;
+        dirty[2][addr >> 6] = true;
+        dirty[MODE7_LEVEL][addr >> 7] = true;
+        mode7Dirty = true;
+    }
+
+    void InvalidateAll();
+
+    // Returns the 8x8 color ids of the tile at addr as 8 rows of 8 bytes. addr is rounded down to the start of a tile.
+    inline const uint8_t *GetTile(uint16_t addr, uint8_t bpp)
+    {
+        // 2bpp, 4bpp, and 8bpp tiles are 16, 32, and 64 bytes.
+        const int level = bpp >> 2;
+        const uint16_t tile = addr >> (level + 4);
+
+        if (dirty[level][tile])
+            DecodeTile(level, tile);
+
+        return &decoded[level][tile << 6];
+    }
+
+    // Returns the color ids of all 256 Mode 7 tiles, 64 bytes per tile, so a whole line can be drawn without checking
+    // each tile.
+    inline const uint8_t *GetMode7Tiles()
+    {
+        if (mode7Dirty)
+            DecodeMode7Tiles();
+
+        return decoded[MODE7_LEVEL].data();
+    }
+
+private:
+    void DecodeTile(int level, uint16_t tile);
+    void DecodeMode7Tiles();
+
+    const uint8_t *vram;
+
+    // Indexed by bpp / 4, which is 0 for 2bpp, 1 for 4bpp, and 2 for 8bpp. Mode 7 tiles are 128 bytes, which makes
+    // them level 3.
+    static const int MODE7_LEVEL = 3;
+    std::vector<uint8_t> decoded[4];
+    std::vector<bool> dirty[4];
+    bool mode7Dirty = true;
+};
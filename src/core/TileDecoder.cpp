@@ -0,0 +1,241 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TILE_DECODER_X86
+#include <immintrin.h>
+#endif
+
+#include "TileDecoder.h"
+
+// The kernels build each row as a 64-bit value with the leftmost pixel in the low byte, and store it as is, which
+// assumes a little endian host.
+
+namespace TileDecoder
+{
+    static const uint64_t BYTE_LOW_BITS = 0x0101010101010101;
+
+    // Byte n selects bit 7 - n, since the high bit of a bitplane byte is the leftmost pixel.
+    static const uint64_t PIXEL_BITS = 0x0102040810204080;
+
+
+    // Spreads the bits of a bitplane byte into the low bit of 8 bytes.
+    static inline uint64_t SpreadPlane(uint8_t plane)
+    {
+        uint64_t bits = (plane * BYTE_LOW_BITS) & PIXEL_BITS;
+
+        // Adding 0x7F to a byte sets its high bit if any other bit was set, without carrying into the next byte.
+        return ((bits + 0x7F7F7F7F7F7F7F7F) >> 7) & BYTE_LOW_BITS;
+    }
+
+
+    static void DecodeTileScalar(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+    {
+        const int planePairs = bpp >> 1;
+
+        for (int y = 0; y < 8; y++)
+        {
+            uint64_t row = 0;
+
+            for (int pair = 0; pair < planePairs; pair++)
+            {
+                const uint8_t *planes = &tileData[(pair << 4) + (y << 1)];
+                row |= SpreadPlane(planes[0]) << (pair * 2);
+                row |= SpreadPlane(planes[1]) << (pair * 2 + 1);
+            }
+
+            memcpy(&out[y << 3], &row, sizeof(row));
+        }
+    }
+
+
+    static void DecodeMode7TileScalar(const uint8_t *tileData, uint8_t *out)
+    {
+        for (int i = 0; i < 64; i++)
+            out[i] = tileData[(i << 1) + 1];
+    }
+
+
+#ifdef TILE_DECODER_X86
+    // pdep puts bit n of the plane into byte n, so the row is built backwards and byte swapped at the end.
+    __attribute__((target("bmi2")))
+    static void DecodeTileBmi2(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+    {
+        const int planePairs = bpp >> 1;
+
+        for (int y = 0; y < 8; y++)
+        {
+            uint64_t row = 0;
+
+            for (int pair = 0; pair < planePairs; pair++)
+            {
+                const uint8_t *planes = &tileData[(pair << 4) + (y << 1)];
+                row |= _pdep_u64(planes[0], BYTE_LOW_BITS << (pair * 2));
+                row |= _pdep_u64(planes[1], BYTE_LOW_BITS << (pair * 2 + 1));
+            }
+
+            row = __builtin_bswap64(row);
+            memcpy(&out[y << 3], &row, sizeof(row));
+        }
+    }
+
+
+    // Turns bytes holding a bitplane byte repeated 8 times into planeBit where the pixel is set, and 0 elsewhere.
+    __attribute__((target("sse2")))
+    static inline __m128i ExpandPlane(__m128i planes, __m128i pixelBits, __m128i planeBit)
+    {
+        __m128i isSet = _mm_cmpeq_epi8(_mm_and_si128(planes, pixelBits), pixelBits);
+        return _mm_and_si128(isSet, planeBit);
+    }
+
+
+    // Decodes two rows per register.
+    __attribute__((target("sse2")))
+    static void DecodeTileSse2(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+    {
+        const __m128i pixelBits = _mm_set1_epi64x(PIXEL_BITS);
+        const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+        __m128i rows[4] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+
+        for (int plane = 0; plane < bpp; plane += 2)
+        {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tileData[plane << 3]));
+
+            // Move the low bitplane bytes to the low half, and the high bitplane bytes to the high half.
+            __m128i planes = _mm_packus_epi16(_mm_and_si128(data, lowBytes), _mm_srli_epi16(data, 8));
+            const __m128i pairs[2] = {_mm_unpacklo_epi8(planes, planes), _mm_unpackhi_epi8(planes, planes)};
+
+            for (int i = 0; i < 2; i++)
+            {
+                const __m128i planeBit = _mm_set1_epi8(static_cast<char>(1 << (plane + i)));
+                const __m128i quads[2] = {_mm_unpacklo_epi16(pairs[i], pairs[i]),
+                                          _mm_unpackhi_epi16(pairs[i], pairs[i])};
+
+                for (int q = 0; q < 2; q++)
+                {
+                    __m128i low = _mm_unpacklo_epi32(quads[q], quads[q]);
+                    __m128i high = _mm_unpackhi_epi32(quads[q], quads[q]);
+                    rows[q * 2] = _mm_or_si128(rows[q * 2], ExpandPlane(low, pixelBits, planeBit));
+                    rows[q * 2 + 1] = _mm_or_si128(rows[q * 2 + 1], ExpandPlane(high, pixelBits, planeBit));
+                }
+            }
+        }
+
+        for (int i = 0; i < 4; i++)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i << 4]), rows[i]);
+    }
+
+
+    __attribute__((target("sse2")))
+    static void DecodeMode7TileSse2(const uint8_t *tileData, uint8_t *out)
+    {
+        for (int i = 0; i < 64; i += 16)
+        {
+            __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tileData[i << 1]));
+            __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tileData[(i << 1) + 16]));
+            __m128i pixels = _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i]), pixels);
+        }
+    }
+
+
+    __attribute__((target("avx2")))
+    static inline __m256i ExpandPlaneAvx2(__m256i planes, __m256i pixelBits, __m256i planeBit)
+    {
+        __m256i isSet = _mm256_cmpeq_epi8(_mm256_and_si256(planes, pixelBits), pixelBits);
+        return _mm256_and_si256(isSet, planeBit);
+    }
+
+
+    // Decodes four rows per register. The shuffle repeats each byte 8 times in one instruction.
+    __attribute__((target("avx2")))
+    static void DecodeTileAvx2(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+    {
+        const __m256i pixelBits = _mm256_set1_epi64x(PIXEL_BITS);
+
+        // Shuffles work within each 128 bit lane, so the bitplane data is copied to both lanes. These select the low
+        // bitplane byte of rows 0-3 and rows 4-7. Adding 1 selects the high bitplane byte.
+        const __m256i topRows = _mm256_setr_epi64x(0x0000000000000000, 0x0202020202020202,
+                                                   0x0404040404040404, 0x0606060606060606);
+        const __m256i bottomRows = _mm256_setr_epi64x(0x0808080808080808, 0x0A0A0A0A0A0A0A0A,
+                                                      0x0C0C0C0C0C0C0C0C, 0x0E0E0E0E0E0E0E0E);
+        __m256i rows[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+
+        for (int plane = 0; plane < bpp; plane += 2)
+        {
+            __m256i data = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tileData[plane << 3])));
+
+            for (int i = 0; i < 2; i++)
+            {
+                const __m256i planeBit = _mm256_set1_epi8(static_cast<char>(1 << (plane + i)));
+                const __m256i offset = _mm256_set1_epi8(i);
+                __m256i top = _mm256_shuffle_epi8(data, _mm256_add_epi8(topRows, offset));
+                __m256i bottom = _mm256_shuffle_epi8(data, _mm256_add_epi8(bottomRows, offset));
+                rows[0] = _mm256_or_si256(rows[0], ExpandPlaneAvx2(top, pixelBits, planeBit));
+                rows[1] = _mm256_or_si256(rows[1], ExpandPlaneAvx2(bottom, pixelBits, planeBit));
+            }
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[0]), rows[0]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[32]), rows[1]);
+    }
+
+
+    __attribute__((target("avx2")))
+    static void DecodeMode7TileAvx2(const uint8_t *tileData, uint8_t *out)
+    {
+        for (int i = 0; i < 64; i += 32)
+        {
+            __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&tileData[i << 1]));
+            __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&tileData[(i << 1) + 32]));
+            __m256i pixels = _mm256_packus_epi16(_mm256_srli_epi16(first, 8), _mm256_srli_epi16(second, 8));
+
+            // Packing works within each 128 bit lane, so put the 64 bit groups back in order.
+            pixels = _mm256_permute4x64_epi64(pixels, 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[i]), pixels);
+        }
+    }
+#endif
+
+
+    const std::vector<Kernel> &GetKernels()
+    {
+        static const std::vector<Kernel> kernels = []()
+        {
+            std::vector<Kernel> supported = {{"scalar", DecodeTileScalar, DecodeMode7TileScalar}};
+
+#ifdef TILE_DECODER_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("bmi2"))
+                supported.push_back({"bmi2", DecodeTileBmi2, DecodeMode7TileScalar});
+            if (__builtin_cpu_supports("sse2"))
+                supported.push_back({"sse2", DecodeTileSse2, DecodeMode7TileSse2});
+            if (__builtin_cpu_supports("avx2"))
+                supported.push_back({"avx2", DecodeTileAvx2, DecodeMode7TileAvx2});
+#endif
+
+            return supported;
+        }();
+
+        return kernels;
+    }
+
+
+    const Kernel &GetKernel()
+    {
+        static const Kernel &kernel = GetKernels().back();
+        return kernel;
+    }
+
+
+    void DecodeTile(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+    {
+        GetKernel().decodeTile(tileData, bpp, out);
+    }
+
+
+    void DecodeMode7Tile(const uint8_t *tileData, uint8_t *out)
+    {
+        GetKernel().decodeMode7Tile(tileData, out);
+    }
+}
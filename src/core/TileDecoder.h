@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+#include "Zlsnes.h"
+
+// Converts tiles from VRAM format into one color id per byte, as 8 rows of 8 bytes.
+namespace TileDecoder
+{
+    struct Kernel
+    {
+        const char *name;
+
+        // Decodes a 2bpp, 4bpp, or 8bpp planar tile. Each pair of bitplanes is 8 rows of 2 bytes, and pairs follow each
+        // other.
+        void (*decodeTile)(const uint8_t *tileData, uint8_t bpp, uint8_t *out);
+
+        // Decodes a Mode 7 tile, where each pixel is the high byte of a VRAM word.
+        void (*decodeMode7Tile)(const uint8_t *tileData, uint8_t *out);
+    };
+
+    // Returns the kernels the CPU supports, from slowest to fastest. The first one is the portable scalar kernel.
+    const std::vector<Kernel> &GetKernels();
+
+    // Returns the fastest kernel the CPU supports.
+    const Kernel &GetKernel();
+
+    void DecodeTile(const uint8_t *tileData, uint8_t bpp, uint8_t *out);
+    void DecodeMode7Tile(const uint8_t *tileData, uint8_t *out);
+}
@@ -17,6 +17,7 @@ Timer::Timer(Memory *memory, Interrupt *interrupts) :
     vCount(0),
     isHBlank(true),
     isVBlank(false),
+    isOverscan(false),
     irqTrigger(0),
     hTrigger(0x1FF),
     vTrigger(0x1FF),
@@ -30,7 +31,8 @@ Timer::Timer(Memory *memory, Interrupt *interrupts) :
     regVTIMEH(memory->RequestOwnership(eRegVTIMEH, this)),
     regRDNMI(memory->RequestOwnership(eRegRDNMI, this)),
     regTIMEUP(memory->RequestOwnership(eRegTIMEUP, this)),
-    regHVBJOY(memory->RequestOwnership(eRegHVBJOY, this))
+    regHVBJOY(memory->RequestOwnership(eRegHVBJOY, this)),
+    regSETINI(*memory->GetBytePtr(eRegSETINI))
 {
     regHTIMEH = 0x01;
     regHTIMEL = 0xFF;
@@ -74,14 +76,17 @@ void Timer::AddCycle(uint8_t cycles)
         clockCounter -= 1364;
         hCount = clockCounter / CLOCKS_PER_H;
 
-        // TODO: Check for number of scanlines per screen in regSETINI.
-
         vCount++;
+
+        // With overscan, the screen is 239 lines instead of 224, and VBlank starts 15 lines later.
         if (vCount == 225)
+            isOverscan = Bytes::TestBit<2>(regSETINI);
+
+        if (vCount == (isOverscan ? 240 : 225))
         {
             ProcessVBlankStart();
         }
-        else if (vCount == 228)
+        else if (vCount == (isOverscan ? 243 : 228))
         {
             // If joypad auto read is enabled, toggle the busy flag.
             if (Bytes::GetBit<0>(regNMITIMEN))
@@ -53,6 +53,9 @@ private:
     bool isHBlank;
     bool isVBlank;
 
+    // Overscan from SETINI, latched where VBlank would start without it.
+    bool isOverscan;
+
     // NMITIMEN - 0x4200
     uint8_t irqTrigger;
 
@@ -72,6 +75,7 @@ private:
     uint8_t &regRDNMI; // 0x4210
     uint8_t &regTIMEUP; // 0x4211
     uint8_t &regHVBJOY; // 0x4212
+    const uint8_t &regSETINI; // 0x2133, owned by the Ppu.
 
     friend class TimerTest;
 };
@@ -0,0 +1,32 @@
+#include "TripleBuffer.h"
+
+
+TripleBuffer::TripleBuffer()
+{
+
+}
+
+
+TripleBuffer::~TripleBuffer()
+{
+
+}
+
+
+void TripleBuffer::Publish()
+{
+    frames[back].number = ++framesPublished;
+    lastPublished = back;
+
+    // Release the frame that was drawn, and acquire whatever the showing thread left in the middle.
+    back = middle.exchange(back | NEW_FRAME, std::memory_order_acq_rel) & INDEX_MASK;
+}
+
+
+const TripleBuffer::Frame &TripleBuffer::AcquireLatest()
+{
+    if (middle.load(std::memory_order_relaxed) & NEW_FRAME)
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+
+    return frames[front];
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include "DisplayInterface.h"
+
+
+// Hands frames from the thread drawing them to the thread showing them, without copying or locking. One buffer is
+// being drawn, one is being shown, and the third holds the newest finished frame until the display picks it up.
+// There can only be one drawing thread and one showing thread at a time.
+class TripleBuffer
+{
+public:
+    // What a line was drawn from, so it doesn't have to be drawn again if none of it has changed. Only the Ppu that
+    // drew the line knows what it means. An epoch of 0 means the line needs drawing.
+    struct LineSignature
+    {
+        uint64_t epoch;
+        uint64_t state;
+        uint64_t vramRegions;
+        uint64_t lastWrite;
+
+        bool operator==(const LineSignature &other) const
+        {
+            return epoch == other.epoch && state == other.state && vramRegions == other.vramRegions &&
+                   lastWrite == other.lastWrite;
+        }
+        bool operator!=(const LineSignature &other) const {return !(*this == other);}
+    };
+
+    struct Frame
+    {
+        // Laid out as the descriptor says. 16 bit formats use half of it.
+        std::array<uint32_t, SCREEN_X * SCREEN_Y> pixels = {0};
+        FrameDescriptor descriptor = {SCREEN_X / 2, 224, SCREEN_X * 4, EPixelFormat::XRGB8888};
+        // Counts up from 1 with each frame published.
+        uint64_t number = 0;
+        // The lines that are different from frame number - 1. Displays that skipped that frame have to treat every
+        // line as changed.
+        std::array<bool, SCREEN_Y> isLineChanged = {false};
+
+        // Only used while drawing. Whether each line was drawn 512 pixels wide, and what it was drawn from.
+        std::array<bool, SCREEN_Y> isLineHiRes = {false};
+        std::array<LineSignature, SCREEN_Y> lineSignatures = {};
+    };
+
+    TripleBuffer();
+    ~TripleBuffer();
+
+    // The frame being drawn. Only the drawing thread can use it.
+    inline Frame &GetBackBuffer() {return frames[back];}
+
+    // Makes the back buffer the newest finished frame, and starts a new back buffer. The new back buffer still has
+    // whatever frame was in it before.
+    void Publish();
+
+    // The frame published last, which is never the back buffer. Only the drawing thread can use it.
+    inline const Frame &GetLastPublished() const {return frames[lastPublished];}
+
+    // Switches to the newest finished frame if one has been published since the last call, and returns the frame
+    // being shown. It stays unchanged until the next call. Only the showing thread can use it.
+    const Frame &AcquireLatest();
+
+private:
+    // Set in middle when it holds a frame the showing thread hasn't picked up yet.
+    static const uint8_t NEW_FRAME = 0x04;
+    static const uint8_t INDEX_MASK = 0x03;
+
+    std::array<Frame, 3> frames;
+    uint64_t framesPublished = 0;
+    uint8_t back = 0;
+    uint8_t lastPublished = 2;
+    std::atomic<uint8_t> middle{1};
+    uint8_t front = 2;
+};
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "PpuCapture.h"
+
+// Draws every frame of a PPU capture a number of times, and reports how long each line took per pixel for each BG
+// mode. Captures are made with Ppu::StartCapture. Lines in forced blank aren't counted, since they're only filled.
+
+static const int DEFAULT_PASSES = 20;
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s capture [passes]\n", argv[0]);
+        return 1;
+    }
+
+    PpuCapture capture;
+    if (!capture.Load(argv[1]))
+    {
+        printf("Couldn't load %s\n", argv[1]);
+        return 1;
+    }
+
+    const int passes = argc > 2 ? std::max(1, atoi(argv[2])) : DEFAULT_PASSES;
+
+    // Per BG mode.
+    double ns[8] = {0};
+    uint64_t lines[8] = {0};
+    uint64_t pixels[8] = {0};
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (size_t frame = 0; frame < capture.GetFrameCount(); frame++)
+        {
+            capture.StartFrame(frame);
+
+            // Each line's time includes replaying the register writes made before it.
+            PpuCapture::Line line;
+            auto start = std::chrono::steady_clock::now();
+            while (capture.DrawNextLine(line))
+            {
+                auto end = std::chrono::steady_clock::now();
+                if (!line.isForcedBlank)
+                {
+                    ns[line.bgMode] += std::chrono::duration<double, std::nano>(end - start).count();
+                    lines[line.bgMode]++;
+                    pixels[line.bgMode] += line.width;
+                }
+                start = end;
+            }
+        }
+    }
+
+    printf("%zu frames, %d passes\n", capture.GetFrameCount(), passes);
+    printf("%-6s %12s %14s %12s\n", "mode", "lines", "pixels", "ns/pixel");
+    double totalNs = 0;
+    uint64_t totalLines = 0, totalPixels = 0;
+    for (int mode = 0; mode < 8; mode++)
+    {
+        if (lines[mode] == 0)
+            continue;
+
+        printf("%-6d %12llu %14llu %12.3f\n", mode, static_cast<unsigned long long>(lines[mode]),
+               static_cast<unsigned long long>(pixels[mode]), ns[mode] / pixels[mode]);
+        totalNs += ns[mode];
+        totalLines += lines[mode];
+        totalPixels += pixels[mode];
+    }
+    if (totalPixels > 0)
+    {
+        printf("%-6s %12llu %14llu %12.3f\n", "all", static_cast<unsigned long long>(totalLines),
+               static_cast<unsigned long long>(totalPixels), totalNs / totalPixels);
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "TileDecoder.h"
+
+// Times every tile decoder kernel the CPU supports against decoding one pixel at a time, which is how the PPU and
+// the tile viewers used to do it.
+
+static const int VRAM_SIZE = 0x10000;
+static const int PASSES = 200;
+
+
+static uint8_t GetTilePixelData(const uint8_t *tileData, uint8_t xOff, uint8_t yOff, uint8_t bpp)
+{
+    xOff = 7 - xOff;
+    // Two bytes per pixel.
+    yOff = yOff << 1;
+
+    uint8_t lowBit = (tileData[yOff] >> xOff) & 0x01;
+    uint8_t highBit = (tileData[yOff + 1] >> xOff) & 0x01;
+    uint8_t pixelVal = (highBit << 1) | lowBit;
+    if (bpp >= 4)
+    {
+        uint8_t lowBit2 = (tileData[yOff + 0x10] >> xOff) & 0x01;
+        uint8_t highBit2 = (tileData[yOff + 0x11] >> xOff) & 0x01;
+        pixelVal |= (highBit2 << 3) | (lowBit2 << 2);
+    }
+    if (bpp == 8)
+    {
+        uint8_t lowBit3 = (tileData[yOff + 0x20] >> xOff) & 0x01;
+        uint8_t highBit3 = (tileData[yOff + 0x21] >> xOff) & 0x01;
+        uint8_t lowBit4 = (tileData[yOff + 0x30] >> xOff) & 0x01;
+        uint8_t highBit4 = (tileData[yOff + 0x31] >> xOff) & 0x01;
+        pixelVal |= (highBit4 << 7) | (lowBit4 << 6) | (highBit3 << 5) | (lowBit3 << 4);
+    }
+
+    return pixelVal;
+}
+
+
+static void DecodeTilePerPixel(const uint8_t *tileData, uint8_t bpp, uint8_t *out)
+{
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+            out[(y << 3) + x] = GetTilePixelData(tileData, x, y, bpp);
+    }
+}
+
+
+static void DecodeMode7TilePerPixel(const uint8_t *tileData, uint8_t *out)
+{
+    for (int i = 0; i < 64; i++)
+        out[i] = tileData[(i << 1) + 1];
+}
+
+
+// Decodes every tile in VRAM PASSES times, and returns the nanoseconds per tile.
+template <typename Func>
+static double TimeTiles(int tileSize, Func decode)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (int pass = 0; pass < PASSES; pass++)
+    {
+        for (int addr = 0; addr + tileSize <= VRAM_SIZE; addr += tileSize)
+            decode(addr);
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (PASSES * (VRAM_SIZE / tileSize));
+}
+
+
+int main()
+{
+    std::vector<uint8_t> vram(VRAM_SIZE);
+    std::mt19937 rng(1);
+    for (uint8_t &value : vram)
+        value = rng();
+
+    std::vector<TileDecoder::Kernel> kernels = {{"per-pixel", DecodeTilePerPixel, DecodeMode7TilePerPixel}};
+    kernels.insert(kernels.end(), TileDecoder::GetKernels().begin(), TileDecoder::GetKernels().end());
+
+    // Use some of the output so the decoding can't be optimized out.
+    std::vector<uint8_t> pixels(64);
+    uint64_t checksum = 0;
+    auto sum = [&pixels, &checksum](int addr) {checksum = checksum * 31 + pixels[addr & 63];};
+
+    printf("%-10s %10s %10s %10s %10s   (ns per tile)\n", "kernel", "2bpp", "4bpp", "8bpp", "mode7");
+    for (const TileDecoder::Kernel &kernel : kernels)
+    {
+        printf("%-10s", kernel.name);
+        for (uint8_t bpp : {2, 4, 8})
+        {
+            double ns = TimeTiles(bpp * 8, [&](int addr)
+            {
+                kernel.decodeTile(&vram[addr], bpp, pixels.data());
+                sum(addr);
+            });
+            printf(" %10.2f", ns);
+        }
+        double ns = TimeTiles(128, [&](int addr) {kernel.decodeMode7Tile(&vram[addr], pixels.data()); sum(addr);});
+        printf(" %10.2f\n", ns);
+    }
+
+    printf("checksum %016llx\n", static_cast<unsigned long long>(checksum));
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+
+#include "Cartridge.h"
+
+
+class CartridgeTest : public ::testing::Test
+{
+protected:
+    CartridgeTest();
+    ~CartridgeTest() override;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Writes a ROM with a header at headerOffset and loads it.
+    void LoadTestRom(size_t size, size_t headerOffset, uint8_t mode, uint8_t ramSize);
+
+    // Every byte of the test ROM identifies its own offset, except for the header.
+    static uint8_t RomByte(uint32_t offset) {return static_cast<uint8_t>((offset >> 13) * 7 + offset);}
+
+    Cartridge *cartridge;
+    std::string filename;
+};
+
+
+CartridgeTest::CartridgeTest()
+{
+    cartridge = new Cartridge();
+}
+
+CartridgeTest::~CartridgeTest()
+{
+    delete cartridge;
+}
+
+void CartridgeTest::SetUp()
+{
+
+}
+
+void CartridgeTest::TearDown()
+{
+    // The ROM stays mapped after the file is gone.
+    if (!filename.empty())
+    {
+        unlink(filename.c_str());
+        unlink((filename + ".srm").c_str());
+    }
+}
+
+void CartridgeTest::LoadTestRom(size_t size, size_t headerOffset, uint8_t mode, uint8_t ramSize)
+{
+    std::vector<uint8_t> rom(size);
+    for (size_t i = 0; i < size; i++)
+        rom[i] = RomByte(i);
+
+    RomImage::StandardHeader header;
+    memcpy(header.title, "CARTRIDGE TEST       ", sizeof(header.title));
+    header.mode = mode;
+    header.ramSize = ramSize;
+    memcpy(&rom[headerOffset], &header, sizeof(header));
+
+    char path[] = "/tmp/CartridgeTestXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    filename = path;
+
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<char *>(rom.data()), rom.size());
+    file.close();
+
+    ASSERT_TRUE(cartridge->LoadRom(filename));
+}
+
+
+TEST_F(CartridgeTest, TEST_LoRomMapping)
+{
+    LoadTestRom(0x40000, 0x7FC0, RomImage::ERomType::eLoROM, 0);
+    ASSERT_TRUE(cartridge->IsLoRom());
+
+    EXPECT_EQ(cartridge->ReadByte(0x008000), RomByte(0x0000));
+    EXPECT_EQ(cartridge->ReadByte(0x00A123), RomByte(0x2123));
+    EXPECT_EQ(cartridge->ReadByte(0x018000), RomByte(0x8000));
+    EXPECT_EQ(cartridge->ReadByte(0x07FFFF), RomByte(0x3FFFF));
+    EXPECT_EQ(cartridge->ReadByte(0x808000), RomByte(0x0000));
+    EXPECT_EQ(cartridge->ReadByte(0x400000), RomByte(0x100000 % 0x40000));
+
+    // Banks past the end of the ROM mirror it.
+    EXPECT_EQ(cartridge->ReadByte(0x098123), RomByte(0x48123 % 0x40000));
+    EXPECT_EQ(cartridge->ReadByte(0x088000), RomByte(0x0000));
+}
+
+TEST_F(CartridgeTest, TEST_PartialSlotMirroring)
+{
+    // 233KB, so the last slot is only 1KB.
+    const uint32_t size = 0x3A400;
+    LoadTestRom(size, 0x7FC0, RomImage::ERomType::eLoROM, 0);
+
+    EXPECT_EQ(cartridge->ReadByte(0x078000), RomByte(0x38000));
+    EXPECT_EQ(cartridge->ReadByte(0x07A3FF), RomByte(0x3A3FF));
+
+    // The ROM repeats right after its last byte, even in the middle of a slot.
+    EXPECT_EQ(cartridge->ReadByte(0x07A400), RomByte(0x00000));
+    EXPECT_EQ(cartridge->ReadByte(0x07FFFF), RomByte(0x3FFFF % size));
+    EXPECT_EQ(cartridge->ReadByte(0x088000), RomByte(0x40000 % size));
+    EXPECT_EQ(cartridge->ReadByte(0x09C123), RomByte(0x4C123 % size));
+    EXPECT_EQ(cartridge->ReadByte(0xFFFFFF), RomByte(0x3FFFFF % size));
+}
+
+TEST_F(CartridgeTest, TEST_LoRomSram)
+{
+    // 2KB of SRAM, which is mirrored within each 8KB slot.
+    LoadTestRom(0x40000, 0x7FC0, RomImage::ERomType::eLoROM, 1);
+
+    cartridge->WriteByte(0x700000, 0x12);
+    cartridge->WriteByte(0x7007FF, 0x34);
+    EXPECT_EQ(cartridge->ReadByte(0x700800), 0x12);
+    EXPECT_EQ(cartridge->ReadByte(0x706FFF), 0x34);
+    EXPECT_EQ(cartridge->ReadByte(0x710000), 0x12);
+    EXPECT_EQ(cartridge->ReadByte(0xF00000), 0x12);
+    EXPECT_EQ(*cartridge->GetBytePtr(0x7D1800), 0x12);
+    ASSERT_NE(cartridge->GetSramPtr(0x7D1801), nullptr);
+    *cartridge->GetSramPtr(0x7D1801) = 0x9A;
+    EXPECT_EQ(cartridge->ReadByte(0x700001), 0x9A);
+
+    // The upper half of the SRAM banks is ROM.
+    EXPECT_EQ(cartridge->ReadByte(0x708000), RomByte((0x380000) % 0x40000));
+
+    // Writes to ROM are ignored, and ROM can only be read through a pointer.
+    cartridge->WriteByte(0x008000, 0xFF);
+    EXPECT_EQ(cartridge->ReadByte(0x008000), RomByte(0x0000));
+    EXPECT_EQ(cartridge->GetSramPtr(0x008000), nullptr);
+    EXPECT_EQ(*cartridge->GetBytePtr(0x008001), RomByte(0x0001));
+
+    const Cartridge::SlotTable &slots = cartridge->GetSlotTable();
+    EXPECT_FALSE(slots[0x700000 >> RomImage::SLOT_SHIFT].isRom);
+    EXPECT_EQ(slots[0x700000 >> RomImage::SLOT_SHIFT].mask, 0x7FFu);
+    EXPECT_TRUE(slots[0x708000 >> RomImage::SLOT_SHIFT].isRom);
+    EXPECT_EQ(slots[0x708000 >> RomImage::SLOT_SHIFT].sram, nullptr);
+}
+
+TEST_F(CartridgeTest, TEST_HiRomMapping)
+{
+    LoadTestRom(0x80000, 0xFFC0, RomImage::ERomType::eHiROM, 3);
+    ASSERT_FALSE(cartridge->IsLoRom());
+
+    EXPECT_EQ(cartridge->ReadByte(0xC00000), RomByte(0x00000));
+    EXPECT_EQ(cartridge->ReadByte(0xC12345), RomByte(0x12345));
+    EXPECT_EQ(cartridge->ReadByte(0x408000), RomByte(0x08000));
+    EXPECT_EQ(cartridge->ReadByte(0x018000), RomByte(0x18000));
+    EXPECT_EQ(cartridge->ReadByte(0xC80000), RomByte(0x00000));
+
+    // 8KB of SRAM.
+    cartridge->WriteByte(0x306000, 0x56);
+    cartridge->WriteByte(0x307FFF, 0x78);
+    EXPECT_EQ(cartridge->ReadByte(0xB06000), 0x56);
+    EXPECT_EQ(cartridge->ReadByte(0x3F7FFF), 0x78);
+}
+
+TEST_F(CartridgeTest, TEST_ExHiRomMapping)
+{
+    LoadTestRom(0x410000, 0x40FFC0, 0x30 | RomImage::ERomType::eExHiROM, 0);
+    ASSERT_EQ(cartridge->GetRomType(), RomImage::ERomType::eExHiROM);
+
+    EXPECT_EQ(cartridge->ReadByte(0xC00000), RomByte(0x000000));
+    EXPECT_EQ(cartridge->ReadByte(0xFF2345), RomByte(0x3F2345));
+    EXPECT_EQ(cartridge->ReadByte(0x400000), RomByte(0x400000));
+    EXPECT_EQ(cartridge->ReadByte(0x008000), RomByte(0x408000));
+    EXPECT_EQ(cartridge->ReadByte(0x808000), RomByte(0x008000));
+}
+
+TEST_F(CartridgeTest, TEST_SramWriter)
+{
+    LoadTestRom(0x40000, 0x7FC0, RomImage::ERomType::eLoROM, 1);
+
+    cartridge->StartSramWriter(std::chrono::milliseconds(1));
+    cartridge->WriteByte(0x700001, 0xAB);
+    cartridge->WriteByte(0x7007FF, 0xCD);
+    cartridge->StopSramWriter();
+
+    std::ifstream file(filename + ".srm", std::ios::binary);
+    ASSERT_TRUE(file.is_open());
+    std::vector<uint8_t> saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(saved.size(), 0x800u);
+    EXPECT_EQ(saved[0x001], 0xAB);
+    EXPECT_EQ(saved[0x7FF], 0xCD);
+
+    // SRAM is loaded back with the ROM.
+    delete cartridge;
+    cartridge = new Cartridge();
+    ASSERT_TRUE(cartridge->LoadRom(filename));
+    EXPECT_EQ(cartridge->ReadByte(0x700001), 0xAB);
+}
+
+TEST_F(CartridgeTest, TEST_SramWriterWhileWriting)
+{
+    LoadTestRom(0x40000, 0x7FC0, RomImage::ERomType::eLoROM, 1);
+
+    // Every frame fills SRAM with one value, so a save with more than one value in it was copied mid-frame.
+    auto ExpectSavedFrame = [this](int frame)
+    {
+        std::ifstream file(filename + ".srm", std::ios::binary);
+        if (!file.is_open())
+            return;
+        std::vector<uint8_t> saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(saved.size(), 0x800u);
+        for (uint32_t i = 0; i < saved.size(); i++)
+            ASSERT_EQ(saved[i], saved[0]) << "frame " << frame << " offset " << i;
+    };
+
+    cartridge->StartSramWriter(std::chrono::milliseconds(1));
+    for (int frame = 0; frame < 200; frame++)
+    {
+        for (uint32_t addr = 0x700000; addr < 0x700800; addr++)
+            cartridge->WriteByte(addr, static_cast<uint8_t>(frame));
+        cartridge->ProcessVBlankStart();
+        ExpectSavedFrame(frame);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    // Writes after the last VBlank are saved when stopping.
+    cartridge->WriteByte(0x700000, 0xEE);
+    cartridge->StopSramWriter();
+
+    std::ifstream file(filename + ".srm", std::ios::binary);
+    ASSERT_TRUE(file.is_open());
+    std::vector<uint8_t> saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(saved.size(), 0x800u);
+    EXPECT_EQ(saved[0x000], 0xEE);
+    EXPECT_EQ(saved[0x001], 199);
+    EXPECT_EQ(saved[0x7FF], 199);
+}
@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+#include <random>
+
+#include "Bgr555.h"
+#include "ColorMath.h"
+
+
+class ColorMathTest : public ::testing::Test
+{
+protected:
+    ColorMathTest();
+    ~ColorMathTest() override;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Odd, so the vector kernels also have to finish the line one pixel at a time.
+    static const int COUNT = 509;
+
+    std::vector<uint16_t> mainColors;
+    std::vector<uint16_t> subColors;
+    std::vector<uint8_t> flags;
+};
+
+
+ColorMathTest::ColorMathTest() :
+    mainColors(COUNT),
+    subColors(COUNT),
+    flags(COUNT)
+{
+    std::mt19937 rng(5678);
+    for (int i = 0; i < COUNT; i++)
+    {
+        mainColors[i] = rng() & 0x7FFF;
+        subColors[i] = rng() & 0x7FFF;
+        flags[i] = rng() & (ColorMath::COLOR_MATH | ColorMath::HALVE);
+    }
+
+    // Include the extremes.
+    mainColors[0] = 0x7FFF;
+    subColors[0] = 0x7FFF;
+    mainColors[1] = 0;
+    subColors[1] = 0x7FFF;
+}
+
+ColorMathTest::~ColorMathTest()
+{
+
+}
+
+void ColorMathTest::SetUp()
+{
+
+}
+
+void ColorMathTest::TearDown()
+{
+
+}
+
+
+TEST_F(ColorMathTest, TEST_BlendLine)
+{
+    ASSERT_STREQ(ColorMath::GetKernels().front().name, "scalar");
+
+    for (const ColorMath::Kernel &kernel : ColorMath::GetKernels())
+    {
+        for (bool subtract : {false, true})
+        {
+            for (uint8_t brightness = 0; brightness < 16; brightness++)
+            {
+                std::vector<uint32_t> out(COUNT, 0x12345678);
+                kernel.blendLine(mainColors.data(), subColors.data(), flags.data(), COUNT, subtract, brightness,
+                                 out.data());
+
+                for (int i = 0; i < COUNT; i++)
+                {
+                    uint32_t expected = 0x12345678;
+                    if (flags[i] & ColorMath::COLOR_MATH)
+                    {
+                        Bgr555 color(mainColors[i]);
+                        if (subtract)
+                            color.Subtract(subColors[i], flags[i] & ColorMath::HALVE);
+                        else
+                            color.Add(subColors[i], flags[i] & ColorMath::HALVE);
+                        expected = color.ToARGB888(brightness);
+                    }
+
+                    ASSERT_EQ(out[i], expected) << kernel.name << " subtract=" << subtract << " brightness=" <<
+                        static_cast<int>(brightness) << " pixel=" << i;
+                }
+            }
+        }
+    }
+}
+
+
+TEST_F(ColorMathTest, TEST_ConvertLine)
+{
+    std::mt19937 rng(1234);
+    std::vector<uint32_t> colors(COUNT);
+    for (uint32_t &color : colors)
+        color = 0xFF000000 | (rng() & 0xFFFFFF);
+    colors[0] = 0xFFFFFFFF;
+    colors[1] = 0xFF000000;
+
+    for (const ColorMath::Kernel &kernel : ColorMath::GetKernels())
+    {
+        for (EPixelFormat format : {EPixelFormat::RGB565, EPixelFormat::BGR555})
+        {
+            std::vector<uint16_t> out(COUNT);
+            kernel.convertLine(colors.data(), COUNT, format, out.data());
+
+            for (int i = 0; i < COUNT; i++)
+            {
+                const uint8_t r = colors[i] >> 16, g = colors[i] >> 8, b = colors[i];
+                const uint16_t expected = format == EPixelFormat::RGB565 ? ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3) :
+                                                                           ((b >> 3) << 10) | ((g >> 3) << 5) | (r >> 3);
+                ASSERT_EQ(out[i], expected) << kernel.name << " format=" << static_cast<int>(format) << " pixel=" << i;
+            }
+        }
+    }
+}
+
+
+TEST_F(ColorMathTest, TEST_InterleaveLine)
+{
+    std::mt19937 rng(5678);
+    std::vector<uint32_t> even(COUNT), odd(COUNT);
+    for (int i = 0; i < COUNT; i++)
+    {
+        even[i] = rng();
+        odd[i] = rng();
+    }
+
+    for (const ColorMath::Kernel &kernel : ColorMath::GetKernels())
+    {
+        std::vector<uint32_t> out(COUNT * 2);
+        kernel.interleaveLine(even.data(), odd.data(), COUNT, out.data());
+
+        for (int i = 0; i < COUNT; i++)
+        {
+            ASSERT_EQ(out[i * 2], even[i]) << kernel.name << " pixel=" << i;
+            ASSERT_EQ(out[i * 2 + 1], odd[i]) << kernel.name << " pixel=" << i;
+        }
+    }
+}
@@ -34,6 +34,11 @@ uint8_t *Memory::GetBytePtr(uint32_t addr)
     return &memory[addr];
 }
 
+const uint8_t *Memory::GetReadOnlyBytePtr(uint32_t addr)
+{
+    return &memory[addr];
+}
+
 void Memory::ClearMemory()
 {
     memory.fill(0);
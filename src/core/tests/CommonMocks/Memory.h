@@ -124,6 +124,7 @@ public:
     // Bypasses checking of reads/writes from/to special addresses. Don't use unless you know what you are doing.
     //const uint8_t *GetBytePtr(uint32_t addr) const {return &memory[addr];}
     uint8_t *GetBytePtr(uint32_t addr);// {return &memory[addr];}
+    const uint8_t *GetReadOnlyBytePtr(uint32_t addr);
 
     void ClearMemory();
 
@@ -1,10 +1,28 @@
 #include <gtest/gtest.h>
+#include <random>
 
 // Include the mocks first so they override subsequent includes.
 #include "../CommonMocks/Memory.h"
 #include "../CommonMocks/Timer.h"
 
 #include "Ppu.h"
+#include "PpuCapture.h"
+
+// Counts the frames it's shown, and keeps the last one.
+class TestDisplay : public DisplayInterface
+{
+public:
+    void FrameReady(const std::shared_ptr<TripleBuffer> &frames) override
+    {
+        frameCount++;
+        lastFrame = &frames->AcquireLatest();
+    }
+    void RequestMessageBox(const std::string &) override {}
+
+    int frameCount = 0;
+    const TripleBuffer::Frame *lastFrame = nullptr;
+};
+
 
 class PpuTest : public ::testing::Test
 {
@@ -17,12 +35,50 @@ protected:
 
     void ResetState();
 
+    using Sprite = Ppu::Sprite;
+    static const uint8_t MAIN_SCREEN = Ppu::MAIN_SCREEN;
+    static const uint8_t SUB_SCREEN = Ppu::SUB_SCREEN;
+
     // Used for testing private methods.
     uint16_t GetBgHOffset(int i) {return ppu->bgHOffset[i];}
     uint16_t GetBgVOffset(int i) {return ppu->bgVOffset[i];}
     uint8_t GetCgramData(uint16_t addr) {return ppu->cgram[addr];}
     uint8_t GetOamData(uint16_t addr) {return ppu->oam[addr];}
     uint16_t TranslateVramAddress(uint16_t addr, uint8_t translate) {return ppu->TranslateVramAddress(addr, translate);}
+    const uint8_t *GetTile(uint16_t addr, uint8_t bpp) {return ppu->tileCache.GetTile(addr, bpp);}
+    uint32_t GetOutputColor(uint8_t cgramIndex) {return ppu->outputPalette[cgramIndex];}
+    uint8_t GetSpritesOnScanline(uint8_t scanline, std::array<Sprite, 32> &sprites) {return ppu->GetSpritesOnScanline(scanline, sprites);}
+    uint8_t GetStat77() {return ppu->regSTAT77;}
+    void ProcessVBlankEnd() {ppu->ProcessVBlankEnd();}
+    void ProcessVBlankEnd(Ppu *p) {p->ProcessVBlankEnd();}
+    uint8_t GetObjColorId(uint16_t x) {return ppu->layerLine[eOBJ][x].colorId;}
+    void DrawObjLine(uint8_t scanline);
+    void DrawBgLineMode7(uint8_t scanline) {ppu->DrawBgLineMode7(scanline);}
+    // Reads the offset-per-tile entries first, the same way drawing a scanline does.
+    void DrawBgLine(EBgLayer bg, uint8_t scanline) {ppu->ReadOffsetPerTile(); ppu->DrawBgLine(bg, scanline);}
+    void DrawMosaicBgLine(EBgLayer bg, uint8_t scanline) {ppu->ReadOffsetPerTile(); ppu->DrawMosaicBgLine(bg, scanline);}
+    uint8_t GetBgColorId(EBgLayer bg, uint16_t x) {return ppu->layerLine[bg][x].colorId;}
+    void SetLinePixel(EBgLayer bg, uint16_t x, uint8_t priority, uint8_t screens);
+    EBgLayer GetTopLayer(uint16_t x) {return ppu->GetTopLayer(x, x);}
+    EBgLayer GetTopSubLayer(uint16_t x) {return ppu->GetTopLayer<Ppu::EScreenType::SubScreen>(x, x);}
+    void SetVram(uint16_t addr, uint8_t byte) {ppu->vram[addr] = byte; ppu->tileCache.Invalidate(addr);}
+    void WriteRegisterTwice(EIORegisters ioReg, uint16_t value);
+    void DrawLine(Ppu *p, uint8_t scanline) {p->ProcessHBlankEnd(scanline); p->ProcessHBlankStart(scanline);}
+    void ProcessVBlankStart(Ppu *p) {p->ProcessVBlankStart();}
+    uint8_t GetField(Ppu *p) {return p->field;}
+    // Returns the back buffer that lines are drawn to, after the render threads catch up.
+    const std::array<uint32_t, SCREEN_X * SCREEN_Y> &GetFrameBuffer(Ppu *p);
+    TripleBuffer::Frame &GetBackBuffer(Ppu *p) {return p->frames->GetBackBuffer();}
+    const TripleBuffer::Frame &GetLastPublished(Ppu *p) {return p->frames->GetLastPublished();}
+    void ExpectSameFrame(const std::array<uint32_t, SCREEN_X * SCREEN_Y> &actual,
+                         const std::array<uint32_t, SCREEN_X * SCREEN_Y> &expected);
+    // Makes the same random register writes to ppu and other, and draws all 224 lines on both.
+    void DrawTestFrame(Ppu *other, unsigned int seed);
+    void GenerateWindowMasks() {ppu->GenerateWindowMasks();}
+    uint8_t GetLayerScreenMask(EBgLayer bg, uint8_t x) {return ppu->layerScreenMask[bg][x];}
+    uint8_t GetColorClipMask(uint8_t x) {return ppu->colorClipMask[x];}
+    uint8_t GetColorPreventMask(uint8_t x) {return ppu->colorPreventMask[x];}
+    void WriteSprite(uint8_t index, uint8_t x, uint8_t y);
 
     Ppu *ppu;
     Memory *memory;
@@ -53,6 +109,105 @@ void PpuTest::TearDown()
 
 }
 
+void PpuTest::DrawObjLine(uint8_t scanline)
+{
+    std::array<Sprite, 32> sprites;
+    uint8_t count = ppu->GetSpritesOnScanline(scanline, sprites);
+    ppu->DrawObjLine(scanline, sprites, count);
+}
+
+void PpuTest::SetLinePixel(EBgLayer bg, uint16_t x, uint8_t priority, uint8_t screens)
+{
+    ppu->layerLine[bg][x].priority = priority;
+    ppu->layerLine[bg][x].screens = screens;
+}
+
+void PpuTest::WriteRegisterTwice(EIORegisters ioReg, uint16_t value)
+{
+    ppu->WriteRegister(ioReg, Bytes::GetByte<0>(value));
+    ppu->WriteRegister(ioReg, Bytes::GetByte<1>(value));
+}
+
+const std::array<uint32_t, SCREEN_X * SCREEN_Y> &PpuTest::GetFrameBuffer(Ppu *p)
+{
+    if (!p->renderers.empty())
+        p->WaitForRenderer();
+
+    return p->frames->GetBackBuffer().pixels;
+}
+
+void PpuTest::ExpectSameFrame(const std::array<uint32_t, SCREEN_X * SCREEN_Y> &actual,
+                              const std::array<uint32_t, SCREEN_X * SCREEN_Y> &expected)
+{
+    // Only compare the lines that were drawn.
+    for (int i = 0; i < SCREEN_X * 224; i++)
+        ASSERT_EQ(actual[i], expected[i]) << "pixel=" << i;
+}
+
+void PpuTest::DrawTestFrame(Ppu *other, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    auto Write = [this, other](EIORegisters ioReg, uint8_t byte)
+    {
+        ppu->WriteRegister(ioReg, byte);
+        other->WriteRegister(ioReg, byte);
+    };
+
+    // Random VRAM, CGRAM, and OAM. BG1 and OBJ are enabled in mode 1.
+    Write(eRegVMAIN, 0x80);
+    Write(eRegVMADDL, 0x00);
+    Write(eRegVMADDH, 0x00);
+    for (int i = 0; i < 0x8000; i++)
+    {
+        Write(eRegVMDATAL, rng());
+        Write(eRegVMDATAH, rng());
+    }
+    Write(eRegCGADD, 0x00);
+    for (int i = 0; i < 512; i++)
+        Write(eRegCGDATA, rng());
+    Write(eRegOAMADDL, 0x00);
+    Write(eRegOAMADDH, 0x00);
+    for (int i = 0; i < 544; i++)
+        Write(eRegOAMDATA, rng());
+
+    Write(eRegINIDISP, 0x0F);
+    Write(eRegOBJSEL, 0x00);
+    Write(eRegBGMODE, 0x01);
+    Write(eRegMOSAIC, 0x00);
+    Write(eRegBG1SC, 0x00);
+    Write(eRegBG12NBA, 0x01);
+    Write(eRegTM, 0x11);
+    Write(eRegTS, 0x00);
+    Write(eRegW12SEL, 0x00);
+    Write(eRegWOBJSEL, 0x00);
+    Write(eRegCGWSEL, 0x00);
+    Write(eRegCGADSUB, 0x00);
+
+    // Scroll BG1 every 16 lines, so the renderer has to replay writes between lines in order.
+    for (int scanline = 0; scanline < 224; scanline++)
+    {
+        if ((scanline & 0x0F) == 0)
+        {
+            Write(eRegBG1HOFS, rng());
+            Write(eRegBG1HOFS, rng() & 0x03);
+        }
+
+        DrawLine(ppu, scanline);
+        DrawLine(other, scanline);
+    }
+}
+
+void PpuTest::WriteSprite(uint8_t index, uint8_t x, uint8_t y)
+{
+    // OAMADD is a word address, and each sprite is 2 words.
+    ppu->WriteRegister(eRegOAMADDL, index * 2);
+    ppu->WriteRegister(eRegOAMADDH, 0);
+    ppu->WriteRegister(eRegOAMDATA, x);
+    ppu->WriteRegister(eRegOAMDATA, y);
+    ppu->WriteRegister(eRegOAMDATA, index);
+    ppu->WriteRegister(eRegOAMDATA, 0x30);
+}
+
 
 TEST_F(PpuTest, TEST_BGHOFS_Write_Twice)
 {
@@ -125,6 +280,31 @@ TEST_F(PpuTest, TEST_CGDATA_Write_Twice)
 }
 
 
+TEST_F(PpuTest, TEST_OutputPalette)
+{
+    // Brightness starts at 0, so everything is black.
+    ppu->WriteRegister(eRegCGADD, 0x05);
+    ppu->WriteRegister(eRegCGDATA, 0x1F);
+    ppu->WriteRegister(eRegCGDATA, 0x7C);
+    EXPECT_EQ(GetOutputColor(5), 0xFF000000);
+
+    // Red and blue are 31, which expands to 0xFF at full brightness.
+    ppu->WriteRegister(eRegINIDISP, 0x0F);
+    EXPECT_EQ(GetOutputColor(5), 0xFFFF00FF);
+    EXPECT_EQ(GetOutputColor(0), 0xFF000000);
+
+    // Brightness is applied to the color, not the alpha channel.
+    ppu->WriteRegister(eRegINIDISP, 0x05);
+    EXPECT_EQ(GetOutputColor(5), 0xFF550055);
+
+    // Only the changed color is updated.
+    ppu->WriteRegister(eRegCGDATA, 0xE0);
+    ppu->WriteRegister(eRegCGDATA, 0x03);
+    EXPECT_EQ(GetOutputColor(5), 0xFF550055);
+    EXPECT_EQ(GetOutputColor(6), 0xFF005500);
+}
+
+
 TEST_F(PpuTest, TEST_OAMDATA_Write_Twice)
 {
     // This is a word address, so double it (0x20) when reading memory.
@@ -165,6 +345,817 @@ TEST_F(PpuTest, TEST_OAMDATA_Write_Twice)
 }
 
 
+TEST_F(PpuTest, TEST_SpritesOnScanline)
+{
+    std::array<Sprite, 32> sprites;
+
+    // Move every sprite off screen, at y=240.
+    for (int i = 0; i < 128; i++)
+        WriteSprite(i, 0, 240);
+    EXPECT_EQ(GetSpritesOnScanline(100, sprites), 0);
+
+    // 8x8 sprites.
+    WriteSprite(5, 10, 100);
+    EXPECT_EQ(GetSpritesOnScanline(99, sprites), 0);
+    EXPECT_EQ(GetSpritesOnScanline(107, sprites), 1);
+    EXPECT_EQ(GetSpritesOnScanline(108, sprites), 0);
+    ASSERT_EQ(GetSpritesOnScanline(100, sprites), 1);
+    EXPECT_EQ(sprites[0].xPos, 10);
+    EXPECT_EQ(sprites[0].tileId, 5);
+    EXPECT_EQ(sprites[0].priority, 3);
+
+    // Moving a sprite removes it from its old scanlines.
+    WriteSprite(5, 10, 50);
+    EXPECT_EQ(GetSpritesOnScanline(100, sprites), 0);
+    EXPECT_EQ(GetSpritesOnScanline(50, sprites), 1);
+
+    // Sprites are returned in OAM order.
+    WriteSprite(2, 20, 50);
+    ASSERT_EQ(GetSpritesOnScanline(50, sprites), 2);
+    EXPECT_EQ(sprites[0].tileId, 2);
+    EXPECT_EQ(sprites[1].tileId, 5);
+
+    // Set the size bit of sprite 5 in the high table, making it 16x16.
+    ppu->WriteRegister(eRegOAMADDL, 0x00);
+    ppu->WriteRegister(eRegOAMADDH, 0x01);
+    ppu->WriteRegister(eRegOAMDATA, 0x00);
+    ppu->WriteRegister(eRegOAMDATA, 0x08);
+    ASSERT_EQ(GetSpritesOnScanline(60, sprites), 1);
+    EXPECT_EQ(sprites[0].width, 16);
+
+    // Changing OBJSEL to 32x32/64x64 changes the size of every sprite.
+    ppu->WriteRegister(eRegOBJSEL, 0xA0);
+    EXPECT_EQ(GetSpritesOnScanline(110, sprites), 1);
+    EXPECT_EQ(GetSpritesOnScanline(80, sprites), 2);
+
+    // More than 32 sprites on a line sets the overflow flag.
+    EXPECT_EQ(GetStat77() & 0x40, 0);
+    for (int i = 0; i < 40; i++)
+        WriteSprite(i + 50, 0, 150);
+    EXPECT_EQ(GetSpritesOnScanline(150, sprites), 32);
+    EXPECT_EQ(GetStat77() & 0x40, 0x40);
+}
+
+
+TEST_F(PpuTest, TEST_SpriteTimeOver)
+{
+    // Make the first 4K of VRAM solid tiles of color 15.
+    ppu->WriteRegister(eRegVMAIN, 0x80);
+    ppu->WriteRegister(eRegVMADDL, 0x00);
+    ppu->WriteRegister(eRegVMADDH, 0x00);
+    for (int i = 0; i < 0x800; i++)
+    {
+        ppu->WriteRegister(eRegVMDATAL, 0xFF);
+        ppu->WriteRegister(eRegVMDATAH, 0xFF);
+    }
+
+    // Make every sprite 16x16.
+    ppu->WriteRegister(eRegOAMADDL, 0x00);
+    ppu->WriteRegister(eRegOAMADDH, 0x01);
+    for (int i = 0; i < 32; i++)
+        ppu->WriteRegister(eRegOAMDATA, 0xAA);
+
+    // 18 sprites with 2 tiles each on scanline 100. Sprite 0 is at x=0, and sprite 1 is at x=14.
+    for (int i = 0; i < 128; i++)
+        WriteSprite(i, i < 18 ? i * 14 : 0, i < 18 ? 100 : 240);
+
+    // 17 sprites is still under the limit.
+    WriteSprite(17, 0, 240);
+    ProcessVBlankEnd();
+    DrawObjLine(100);
+    EXPECT_EQ(GetStat77() & 0x80, 0);
+    EXPECT_EQ(GetObjColorId(0), 15);
+
+    // With 36 tiles, the 2 tiles of sprite 0 aren't drawn since they're fetched last.
+    WriteSprite(17, 17 * 14, 100);
+    DrawObjLine(100);
+    EXPECT_EQ(GetStat77() & 0x80, 0x80);
+    EXPECT_EQ(GetObjColorId(0), 0);
+    EXPECT_EQ(GetObjColorId(13), 0);
+    EXPECT_EQ(GetObjColorId(14), 15);
+    EXPECT_EQ(GetObjColorId(17 * 14 + 15), 15);
+}
+
+
+TEST_F(PpuTest, TEST_WindowMasks)
+{
+    // Window 1 is 10-20, and window 2 is 15-30.
+    ppu->WriteRegister(eRegWH0, 10);
+    ppu->WriteRegister(eRegWH1, 20);
+    ppu->WriteRegister(eRegWH2, 15);
+    ppu->WriteRegister(eRegWH3, 30);
+
+    // BG1 uses both windows with XNOR logic, and is on both screens, but only windowed on the main screen.
+    ppu->WriteRegister(eRegW12SEL, 0x0A);
+    ppu->WriteRegister(eRegW34SEL, 0x00);
+    ppu->WriteRegister(eRegWBGLOG, 0x03);
+    ppu->WriteRegister(eRegTM, 0x01);
+    ppu->WriteRegister(eRegTS, 0x01);
+    ppu->WriteRegister(eRegTMW, 0x01);
+    ppu->WriteRegister(eRegTSW, 0x00);
+
+    // The color window is window 1. Clip to black outside it, and prevent color math inside it.
+    ppu->WriteRegister(eRegWOBJSEL, 0x20);
+    ppu->WriteRegister(eRegWOBJLOG, 0x00);
+    ppu->WriteRegister(eRegCGWSEL, 0x60);
+
+    GenerateWindowMasks();
+
+    for (int x = 0; x < 256; x++)
+    {
+        // XNOR is inside where both windows or neither window cover the pixel.
+        bool isInside = (x >= 10 && x <= 20) == (x >= 15 && x <= 30);
+        EXPECT_EQ(GetLayerScreenMask(eBG1, x), isInside ? 0x02 : 0x03) << "x=" << x;
+        EXPECT_EQ(GetLayerScreenMask(eBG2, x), 0) << "x=" << x;
+
+        bool isInsideColor = x >= 10 && x <= 20;
+        EXPECT_EQ(GetColorClipMask(x), isInsideColor ? 0x00 : 0xFF) << "x=" << x;
+        EXPECT_EQ(GetColorPreventMask(x), isInsideColor ? 0xFF : 0x00) << "x=" << x;
+    }
+
+    // Windows where left is greater than right are empty, unless they're inverted.
+    ppu->WriteRegister(eRegWH0, 30);
+    ppu->WriteRegister(eRegWH1, 20);
+    ppu->WriteRegister(eRegW12SEL, 0x03);
+    GenerateWindowMasks();
+    EXPECT_EQ(GetLayerScreenMask(eBG1, 0), 0x02);
+    EXPECT_EQ(GetLayerScreenMask(eBG1, 25), 0x02);
+    EXPECT_EQ(GetLayerScreenMask(eBG1, 255), 0x02);
+}
+
+
+TEST_F(PpuTest, TEST_LayerPriority)
+{
+    const uint8_t both = MAIN_SCREEN | SUB_SCREEN;
+
+    // Nothing on the screen is the backdrop.
+    ppu->WriteRegister(eRegBGMODE, 0x00);
+    EXPECT_EQ(GetTopLayer(0), eCOL);
+
+    // Mode 0 has BG1 and BG2 tiles with priority 1 between sprites with priority 3 and 2.
+    SetLinePixel(eOBJ, 0, 2, both);
+    SetLinePixel(eBG4, 0, 1, both);
+    SetLinePixel(eBG2, 0, 1, both);
+    EXPECT_EQ(GetTopLayer(0), eBG2);
+    SetLinePixel(eBG2, 0, 0, both);
+    EXPECT_EQ(GetTopLayer(0), eOBJ);
+    SetLinePixel(eOBJ, 0, 0, both);
+    EXPECT_EQ(GetTopLayer(0), eBG2);
+
+    // Pixels only count on the screens they're on.
+    SetLinePixel(eBG2, 0, 0, MAIN_SCREEN);
+    EXPECT_EQ(GetTopLayer(0), eBG2);
+    EXPECT_EQ(GetTopSubLayer(0), eBG4);
+
+    // In mode 1, BG3 tiles with priority 1 are in front of everything only with bit 3 of BGMODE set.
+    SetLinePixel(eBG4, 0, 0, 0);
+    SetLinePixel(eBG2, 0, 0, 0);
+    SetLinePixel(eOBJ, 0, 3, both);
+    SetLinePixel(eBG3, 0, 1, both);
+    ppu->WriteRegister(eRegBGMODE, 0x01);
+    EXPECT_EQ(GetTopLayer(0), eOBJ);
+    ppu->WriteRegister(eRegBGMODE, 0x09);
+    EXPECT_EQ(GetTopLayer(0), eBG3);
+    SetLinePixel(eBG3, 0, 0, both);
+    EXPECT_EQ(GetTopLayer(0), eOBJ);
+
+    // Mode 1 doesn't have BG4, and modes 2 to 7 don't have BG3.
+    SetLinePixel(eOBJ, 0, 0, 0);
+    SetLinePixel(eBG4, 0, 1, both);
+    EXPECT_EQ(GetTopLayer(0), eBG3);
+    ppu->WriteRegister(eRegBGMODE, 0x02);
+    EXPECT_EQ(GetTopLayer(0), eCOL);
+
+    // Modes 2 to 5 put sprites with priority 2 between BG1 and BG2 tiles with priority 1.
+    SetLinePixel(eBG1, 0, 1, both);
+    SetLinePixel(eBG2, 0, 1, both);
+    SetLinePixel(eOBJ, 0, 2, both);
+    for (uint8_t mode : {2, 3, 4, 5})
+    {
+        ppu->WriteRegister(eRegBGMODE, mode);
+        EXPECT_EQ(GetTopLayer(0), eBG1) << "mode=" << static_cast<int>(mode);
+        SetLinePixel(eBG1, 0, 0, both);
+        EXPECT_EQ(GetTopLayer(0), eOBJ) << "mode=" << static_cast<int>(mode);
+        SetLinePixel(eBG1, 0, 1, both);
+    }
+
+    // Mode 7 BG1 is only in front of sprites with priority 0.
+    ppu->WriteRegister(eRegBGMODE, 0x07);
+    SetLinePixel(eBG1, 0, 0, both);
+    SetLinePixel(eOBJ, 0, 1, both);
+    EXPECT_EQ(GetTopLayer(0), eOBJ);
+    SetLinePixel(eOBJ, 0, 0, both);
+    EXPECT_EQ(GetTopLayer(0), eBG1);
+}
+
+TEST_F(PpuTest, TEST_Mode7Line)
+{
+    // Map tiles 0 and 1 of the first row are tiles 1 and 2. Each pixel of tile n is (n << 4) + its x offset.
+    for (int i = 0; i < 0x8000; i += 2)
+        SetVram(i, 0);
+    SetVram(0, 1);
+    SetVram(2, 2);
+    for (int tileId = 0; tileId < 3; tileId++)
+    {
+        for (int i = 0; i < 64; i++)
+            SetVram((tileId << 7) + (i << 1) + 1, (tileId << 4) + (i & 0x07));
+    }
+
+    ppu->WriteRegister(eRegM7SEL, 0x00);
+    WriteRegisterTwice(eRegBG1HOFS, 0);
+    WriteRegisterTwice(eRegBG1VOFS, 0);
+    WriteRegisterTwice(eRegM7B, 0);
+    WriteRegisterTwice(eRegM7C, 0);
+    WriteRegisterTwice(eRegM7D, 0x0100);
+    WriteRegisterTwice(eRegM7X, 0);
+    WriteRegisterTwice(eRegM7Y, 0);
+
+    // No scaling.
+    WriteRegisterTwice(eRegM7A, 0x0100);
+    DrawBgLineMode7(0);
+    for (int x = 0; x < 8; x++)
+    {
+        EXPECT_EQ(GetBgColorId(eBG1, x), 0x10 + x) << "x=" << x;
+        EXPECT_EQ(GetBgColorId(eBG1, x + 8), 0x20 + x) << "x=" << x;
+    }
+
+    // Twice as wide, so every other pixel is skipped.
+    WriteRegisterTwice(eRegM7A, 0x0200);
+    DrawBgLineMode7(0);
+    for (int x = 0; x < 4; x++)
+    {
+        EXPECT_EQ(GetBgColorId(eBG1, x), 0x10 + (x * 2)) << "x=" << x;
+        EXPECT_EQ(GetBgColorId(eBG1, x + 4), 0x20 + (x * 2)) << "x=" << x;
+    }
+
+    // Eight times as wide, so pixels 128 and up are outside the map. It repeats without extended fill.
+    WriteRegisterTwice(eRegM7A, 0x0800);
+    DrawBgLineMode7(0);
+    EXPECT_EQ(GetBgColorId(eBG1, 128), 0x10);
+    EXPECT_EQ(GetBgColorId(eBG1, 129), 0x20);
+
+    // Extended fill with transparent pixels.
+    ppu->WriteRegister(eRegM7SEL, 0x80);
+    DrawBgLineMode7(0);
+    EXPECT_EQ(GetBgColorId(eBG1, 127), 0x00);
+    EXPECT_EQ(GetBgColorId(eBG1, 128), 0x00);
+    EXPECT_EQ(GetBgColorId(eBG1, 129), 0x00);
+
+    // Extended fill with tile 0.
+    ppu->WriteRegister(eRegM7SEL, 0xC0);
+    DrawBgLineMode7(0);
+    EXPECT_EQ(GetBgColorId(eBG1, 0), 0x10);
+    EXPECT_EQ(GetBgColorId(eBG1, 128), 0x00);
+    EXPECT_EQ(GetBgColorId(eBG1, 129), 0x00);
+}
+
+
+TEST_F(PpuTest, TEST_OffsetPerTile)
+{
+    std::mt19937 rng(2468);
+    for (int i = 0; i < 0x10000; i++)
+        SetVram(i, rng());
+
+    // BG1's map is at 0, and its tiles at 0x2000. BG3's map is at 0x4000, and only has the entries set below.
+    for (int i = 0x4000; i < 0x4800; i++)
+        SetVram(i, 0);
+    ppu->WriteRegister(eRegBG1SC, 0x00);
+    ppu->WriteRegister(eRegBG3SC, 0x20);
+    ppu->WriteRegister(eRegBG12NBA, 0x01);
+    WriteRegisterTwice(eRegBG1HOFS, 3);
+    WriteRegisterTwice(eRegBG1VOFS, 0);
+    WriteRegisterTwice(eRegBG3HOFS, 0);
+    WriteRegisterTwice(eRegBG3VOFS, 0);
+    auto SetEntry = [this](uint16_t tileX, uint16_t tileY, uint16_t entry)
+    {
+        const uint16_t addr = 0x4000 + (((tileY * 32) + tileX) << 1);
+        SetVram(addr, Bytes::GetByte<0>(entry));
+        SetVram(addr + 1, Bytes::GetByte<1>(entry));
+    };
+    auto DrawLine = [this](uint8_t mode)
+    {
+        std::array<uint8_t, 256> colorIds;
+        ppu->WriteRegister(eRegBGMODE, mode);
+        DrawBgLine(eBG1, 10);
+        for (int x = 0; x < 256; x++)
+            colorIds[x] = GetBgColorId(eBG1, x);
+        return colorIds;
+    };
+
+    // Column 5 of BG1 gets new offsets, but keeps its fine horizontal scroll. Column 6 only has an entry for BG2.
+    const std::array<uint8_t, 256> before = DrawLine(0x02);
+    SetEntry(4, 0, 0x2000 | 0x0047);
+    SetEntry(4, 1, 0x2000 | 0x0010);
+    SetEntry(5, 0, 0x4000 | 0x0080);
+    const std::array<uint8_t, 256> columns = DrawLine(0x02);
+
+    // Mode 1 has the same BG1 without offset-per-tile.
+    WriteRegisterTwice(eRegBG1HOFS, 0x43);
+    WriteRegisterTwice(eRegBG1VOFS, 0x10);
+    const std::array<uint8_t, 256> scrolled = DrawLine(0x01);
+    for (int x = 0; x < 256; x++)
+    {
+        // Column 5 is x 40-47 after scrolling 3 pixels.
+        const bool isColumn5 = x >= 37 && x < 45;
+        EXPECT_EQ(columns[x], isColumn5 ? scrolled[x] : before[x]) << "x=" << x;
+    }
+
+    // Mode 4 has one entry per column, which is a vertical offset if bit 15 is set. Mode 3 is the same without
+    // offset-per-tile.
+    WriteRegisterTwice(eRegBG1HOFS, 3);
+    WriteRegisterTwice(eRegBG1VOFS, 0);
+    SetEntry(4, 0, 0x8000 | 0x2000 | 0x0010);
+    SetEntry(4, 1, 0);
+    SetEntry(5, 0, 0x2000 | 0x0040);
+    const std::array<uint8_t, 256> mode4 = DrawLine(0x04);
+    const std::array<uint8_t, 256> mode3 = DrawLine(0x03);
+    WriteRegisterTwice(eRegBG1VOFS, 0x10);
+    const std::array<uint8_t, 256> mode3V = DrawLine(0x03);
+    WriteRegisterTwice(eRegBG1HOFS, 0x43);
+    WriteRegisterTwice(eRegBG1VOFS, 0);
+    const std::array<uint8_t, 256> mode3H = DrawLine(0x03);
+    for (int x = 0; x < 256; x++)
+    {
+        const std::array<uint8_t, 256> &expected = (x >= 37 && x < 45) ? mode3V : (x >= 45 && x < 53) ? mode3H : mode3;
+        EXPECT_EQ(mode4[x], expected[x]) << "x=" << x;
+    }
+}
+
+TEST_F(PpuTest, TEST_Mosaic)
+{
+    std::mt19937 rng(1357);
+    for (int i = 0; i < 0x10000; i++)
+        SetVram(i, rng());
+
+    ppu->WriteRegister(eRegBGMODE, 0x01);
+    ppu->WriteRegister(eRegBG1SC, 0x00);
+    ppu->WriteRegister(eRegBG12NBA, 0x01);
+    WriteRegisterTwice(eRegBG1HOFS, 5);
+    WriteRegisterTwice(eRegBG1VOFS, 0);
+    auto GetLine = [this]()
+    {
+        std::array<uint8_t, 256> colorIds;
+        for (int x = 0; x < 256; x++)
+            colorIds[x] = GetBgColorId(eBG1, x);
+        return colorIds;
+    };
+
+    DrawBgLine(eBG1, 20);
+    const std::array<uint8_t, 256> line20 = GetLine();
+
+    // 4x4 blocks starting from the top of the frame, so lines 20 to 23 are all line 20 with each 4 pixels the same.
+    ppu->WriteRegister(eRegMOSAIC, 0x31);
+    for (int y = 20; y < 24; y++)
+    {
+        DrawMosaicBgLine(eBG1, y);
+        const std::array<uint8_t, 256> mosaic = GetLine();
+        for (int x = 0; x < 256; x++)
+            ASSERT_EQ(mosaic[x], line20[x & ~0x03]) << "x=" << x << " y=" << y;
+    }
+
+    // Changing the map entry of the first tile of line 20 draws the block's line again.
+    ppu->WriteRegister(eRegVMAIN, 0x80);
+    ppu->WriteRegister(eRegVMADDL, 0x40);
+    ppu->WriteRegister(eRegVMADDH, 0x00);
+    ppu->WriteRegister(eRegVMDATAL, 0x23);
+    ppu->WriteRegister(eRegVMDATAH, 0x01);
+    DrawMosaicBgLine(eBG1, 23);
+    const std::array<uint8_t, 256> mosaic = GetLine();
+    ppu->WriteRegister(eRegMOSAIC, 0x00);
+    DrawBgLine(eBG1, 20);
+    const std::array<uint8_t, 256> newLine20 = GetLine();
+    for (int x = 0; x < 256; x++)
+        ASSERT_EQ(mosaic[x], newLine20[x & ~0x03]) << "x=" << x;
+
+    // In mode 2, changing an offset-per-tile entry in BG3's map draws the block's line again too. BG3's map is at
+    // 0x4000, and starts out with no entries. BG1's tiles are moved to 0x8000, so the line doesn't read that region.
+    ppu->WriteRegister(eRegBGMODE, 0x02);
+    ppu->WriteRegister(eRegBG12NBA, 0x04);
+    ppu->WriteRegister(eRegBG3SC, 0x20);
+    WriteRegisterTwice(eRegBG3HOFS, 0);
+    WriteRegisterTwice(eRegBG3VOFS, 0);
+    ppu->WriteRegister(eRegVMADDL, 0x00);
+    ppu->WriteRegister(eRegVMADDH, 0x20);
+    for (int i = 0; i < 0x400; i++)
+    {
+        ppu->WriteRegister(eRegVMDATAL, 0x00);
+        ppu->WriteRegister(eRegVMDATAH, 0x00);
+    }
+    ppu->WriteRegister(eRegMOSAIC, 0x31);
+    DrawMosaicBgLine(eBG1, 20);
+
+    // Column 5 gets a horizontal offset of 0x40 for BG1.
+    ppu->WriteRegister(eRegVMADDL, 0x04);
+    ppu->WriteRegister(eRegVMADDH, 0x20);
+    ppu->WriteRegister(eRegVMDATAL, 0x40);
+    ppu->WriteRegister(eRegVMDATAH, 0x20);
+    DrawMosaicBgLine(eBG1, 22);
+    const std::array<uint8_t, 256> optMosaic = GetLine();
+    ppu->WriteRegister(eRegMOSAIC, 0x00);
+    DrawBgLine(eBG1, 20);
+    const std::array<uint8_t, 256> optLine20 = GetLine();
+    for (int x = 0; x < 256; x++)
+        ASSERT_EQ(optMosaic[x], optLine20[x & ~0x03]) << "x=" << x;
+}
+
+TEST_F(PpuTest, TEST_RenderThread)
+{
+    // The timer isn't needed, since lines are drawn by calling the HBlank functions directly.
+    std::unique_ptr<Memory> threadedMemory(new Memory());
+    std::unique_ptr<Ppu> threaded(new Ppu(threadedMemory.get(), nullptr, nullptr));
+    threaded->StartRenderThread();
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(threaded.get());
+
+    DrawTestFrame(threaded.get(), 5678);
+    ExpectSameFrame(GetFrameBuffer(threaded.get()), GetFrameBuffer(ppu));
+
+    // Reading the sprite overflow flags waits for the renderer.
+    EXPECT_EQ(threaded->ReadRegister(eRegSTAT77) & 0xC0, ppu->ReadRegister(eRegSTAT77) & 0xC0);
+}
+
+
+TEST_F(PpuTest, TEST_BandRendering)
+{
+    TestDisplay display;
+    std::unique_ptr<Memory> threadedMemory(new Memory());
+    std::unique_ptr<Ppu> threaded(new Ppu(threadedMemory.get(), nullptr, &display));
+    threaded->StartBandRendering(4);
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(threaded.get());
+
+    // The bands draw into the same buffer, which is shown at VBlank.
+    DrawTestFrame(threaded.get(), 1234);
+    ProcessVBlankStart(threaded.get());
+    GetFrameBuffer(threaded.get());
+    ASSERT_EQ(display.frameCount, 1);
+    ExpectSameFrame(display.lastFrame->pixels, GetFrameBuffer(ppu));
+
+    // Interlaced and overscan frames are laid out the way they were drawn, even though this thread starts the next
+    // frame before the bands publish.
+    const uint8_t modes[] = {0x01, 0x01, 0x04, 0x05, 0x00};
+    ppu->WriteRegister(eRegSETINI, modes[0]);
+    threaded->WriteRegister(eRegSETINI, modes[0]);
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(threaded.get());
+    for (int i = 0; i < 4; i++)
+    {
+        const int lineCount = (modes[i] & 0x04) ? 239 : 224;
+        for (int scanline = 0; scanline < lineCount; scanline++)
+        {
+            DrawLine(ppu, scanline);
+            DrawLine(threaded.get(), scanline);
+        }
+        ProcessVBlankStart(ppu);
+        ProcessVBlankStart(threaded.get());
+        ppu->WriteRegister(eRegSETINI, modes[i + 1]);
+        threaded->WriteRegister(eRegSETINI, modes[i + 1]);
+        ProcessVBlankEnd(ppu);
+        ProcessVBlankEnd(threaded.get());
+
+        GetFrameBuffer(threaded.get());
+        ASSERT_EQ(display.frameCount, i + 2);
+        const TripleBuffer::Frame &expected = GetLastPublished(ppu);
+        const FrameDescriptor &descriptor = display.lastFrame->descriptor;
+        ASSERT_EQ(descriptor.width, expected.descriptor.width) << "frame=" << i;
+        ASSERT_EQ(descriptor.height, expected.descriptor.height) << "frame=" << i;
+        ASSERT_EQ(descriptor.pitch, expected.descriptor.pitch) << "frame=" << i;
+        ASSERT_EQ(descriptor.format, expected.descriptor.format) << "frame=" << i;
+        for (int y = 0; y < descriptor.height; y++)
+        {
+            for (int x = 0; x < descriptor.width; x++)
+            {
+                ASSERT_EQ(display.lastFrame->pixels[y * SCREEN_X + x], expected.pixels[y * SCREEN_X + x]) <<
+                    "frame=" << i << " x=" << x << " y=" << y;
+            }
+        }
+    }
+    EXPECT_EQ(GetLastPublished(ppu).descriptor.height, 478);
+
+    // Reading the sprite overflow flags goes back to one renderer, which draws the next frame a line at a time.
+    EXPECT_EQ(threaded->ReadRegister(eRegSTAT77) & 0xC0, ppu->ReadRegister(eRegSTAT77) & 0xC0);
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(threaded.get());
+    DrawTestFrame(threaded.get(), 4321);
+    ExpectSameFrame(GetFrameBuffer(threaded.get()), GetFrameBuffer(ppu));
+}
+
+
+TEST_F(PpuTest, TEST_PixelFormats)
+{
+    std::unique_ptr<Memory> otherMemory(new Memory());
+    std::unique_ptr<Ppu> other(new Ppu(otherMemory.get(), nullptr, nullptr));
+
+    for (EPixelFormat format : {EPixelFormat::RGB565, EPixelFormat::BGR555})
+    {
+        other->SetPixelFormat(format);
+        ProcessVBlankEnd(ppu);
+        ProcessVBlankEnd(other.get());
+        DrawTestFrame(other.get(), 2468);
+
+        // Lines are 2 bytes per pixel, with the top bits of each channel of the XRGB8888 colors.
+        const std::array<uint32_t, SCREEN_X * SCREEN_Y> &expected = GetFrameBuffer(ppu);
+        const uint16_t *actual = reinterpret_cast<const uint16_t *>(GetFrameBuffer(other.get()).data());
+        for (int y = 0; y < 224; y++)
+        {
+            for (int x = 0; x < 256; x++)
+            {
+                const uint32_t color = expected[y * SCREEN_X + x];
+                const uint8_t r = (color >> 16) & 0xFF, g = (color >> 8) & 0xFF, b = color & 0xFF;
+                const uint16_t value = format == EPixelFormat::RGB565 ? ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3) :
+                                                                        ((b >> 3) << 10) | ((g >> 3) << 5) | (r >> 3);
+                ASSERT_EQ(actual[y * SCREEN_X + x], value) << "format=" << static_cast<int>(format) << " x=" << x <<
+                    " y=" << y;
+            }
+        }
+    }
+
+    // A format set partway through a frame waits for the next frame, even with a render thread.
+    std::unique_ptr<Memory> threadedMemory(new Memory());
+    std::unique_ptr<Ppu> threaded(new Ppu(threadedMemory.get(), nullptr, nullptr));
+    threaded->StartRenderThread();
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(threaded.get());
+    for (int scanline = 0; scanline < 100; scanline++)
+        DrawLine(threaded.get(), scanline);
+    threaded->SetPixelFormat(EPixelFormat::RGB565);
+    for (int scanline = 100; scanline < 224; scanline++)
+        DrawLine(threaded.get(), scanline);
+    ProcessVBlankStart(threaded.get());
+    GetFrameBuffer(threaded.get());
+    EXPECT_EQ(GetLastPublished(threaded.get()).descriptor.format, EPixelFormat::XRGB8888);
+    EXPECT_EQ(GetLastPublished(threaded.get()).descriptor.pitch, SCREEN_X * 4);
+
+    ProcessVBlankEnd(threaded.get());
+    for (int scanline = 0; scanline < 224; scanline++)
+        DrawLine(threaded.get(), scanline);
+    ProcessVBlankStart(threaded.get());
+    GetFrameBuffer(threaded.get());
+    EXPECT_EQ(GetLastPublished(threaded.get()).descriptor.format, EPixelFormat::RGB565);
+    EXPECT_EQ(GetLastPublished(threaded.get()).descriptor.pitch, SCREEN_X * 2);
+}
+
+
+TEST_F(PpuTest, TEST_NativeResolution)
+{
+    TestDisplay display;
+    std::unique_ptr<Memory> displayMemory(new Memory());
+    std::unique_ptr<Ppu> displayPpu(new Ppu(displayMemory.get(), nullptr, &display));
+    ProcessVBlankEnd(displayPpu.get());
+
+    // Only the backdrop, which is CGRAM color 0.
+    displayPpu->WriteRegister(eRegINIDISP, 0x0F);
+    displayPpu->WriteRegister(eRegBGMODE, 0x01);
+    displayPpu->WriteRegister(eRegTM, 0x00);
+    displayPpu->WriteRegister(eRegTS, 0x00);
+    displayPpu->WriteRegister(eRegCGWSEL, 0x00);
+    displayPpu->WriteRegister(eRegCGADSUB, 0x00);
+    displayPpu->WriteRegister(eRegCGADD, 0x00);
+    displayPpu->WriteRegister(eRegCGDATA, 0x1F);
+    displayPpu->WriteRegister(eRegCGDATA, 0x00);
+    const uint32_t red = 0xFFFF0000;
+
+    // Low-res frames are 256 pixels wide, one row per line.
+    for (int scanline = 0; scanline < 224; scanline++)
+        DrawLine(displayPpu.get(), scanline);
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 1);
+    EXPECT_EQ(display.lastFrame->descriptor.width, 256);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 224);
+    EXPECT_EQ(display.lastFrame->descriptor.pitch, SCREEN_X * 4);
+    EXPECT_EQ(display.lastFrame->descriptor.format, EPixelFormat::XRGB8888);
+    EXPECT_EQ(display.lastFrame->pixels[0], red);
+    EXPECT_EQ(display.lastFrame->pixels[223 * SCREEN_X + 255], red);
+
+    // One hi-res line makes the frame 512 wide, and the low-res lines are doubled to fill it.
+    for (int scanline = 0; scanline < 224; scanline++)
+    {
+        displayPpu->WriteRegister(eRegBGMODE, scanline == 100 ? 0x05 : 0x01);
+        DrawLine(displayPpu.get(), scanline);
+    }
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 2);
+    EXPECT_EQ(display.lastFrame->descriptor.width, SCREEN_X);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 224);
+    EXPECT_EQ(display.lastFrame->pixels[511], red);
+    EXPECT_EQ(display.lastFrame->pixels[100 * SCREEN_X + 511], red);
+    EXPECT_EQ(display.lastFrame->pixels[223 * SCREEN_X + 511], red);
+}
+
+
+TEST_F(PpuTest, TEST_DisplayModes)
+{
+    TestDisplay display;
+    std::unique_ptr<Memory> displayMemory(new Memory());
+    std::unique_ptr<Ppu> displayPpu(new Ppu(displayMemory.get(), nullptr, &display));
+    ProcessVBlankEnd(displayPpu.get());
+
+    // Only the backdrops. The main screen's is CGRAM color 0, and the sub screen's is the fixed color.
+    displayPpu->WriteRegister(eRegINIDISP, 0x0F);
+    displayPpu->WriteRegister(eRegBGMODE, 0x01);
+    displayPpu->WriteRegister(eRegTM, 0x00);
+    displayPpu->WriteRegister(eRegTS, 0x00);
+    displayPpu->WriteRegister(eRegCGWSEL, 0x00);
+    displayPpu->WriteRegister(eRegCGADSUB, 0x00);
+    displayPpu->WriteRegister(eRegCOLDATA, 0x9F);
+    displayPpu->WriteRegister(eRegCGADD, 0x00);
+    displayPpu->WriteRegister(eRegCGDATA, 0x1F);
+    displayPpu->WriteRegister(eRegCGDATA, 0x00);
+    const uint32_t red = 0xFFFF0000;
+    const uint32_t green = 0xFF00FF00;
+    const uint32_t blue = 0xFF0000FF;
+
+    // Pseudo hi-res lines are 512 wide, with the sub screen in the even pixels and the main screen in the odd ones.
+    displayPpu->WriteRegister(eRegSETINI, 0x08);
+    for (int scanline = 0; scanline < 224; scanline++)
+        DrawLine(displayPpu.get(), scanline);
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 1);
+    EXPECT_EQ(display.lastFrame->descriptor.width, SCREEN_X);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 224);
+    EXPECT_EQ(display.lastFrame->pixels[0], blue);
+    EXPECT_EQ(display.lastFrame->pixels[1], red);
+    EXPECT_EQ(display.lastFrame->pixels[223 * SCREEN_X + 510], blue);
+    EXPECT_EQ(display.lastFrame->pixels[223 * SCREEN_X + 511], red);
+
+    // Overscan adds 15 lines.
+    displayPpu->WriteRegister(eRegSETINI, 0x04);
+    ProcessVBlankEnd(displayPpu.get());
+    for (int scanline = 0; scanline < 240; scanline++)
+        DrawLine(displayPpu.get(), scanline);
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 2);
+    EXPECT_EQ(display.lastFrame->descriptor.width, 256);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 239);
+    EXPECT_EQ(display.lastFrame->pixels[238 * SCREEN_X + 255], red);
+
+    // The first interlaced frame doesn't have the other field yet, so its lines are doubled.
+    displayPpu->WriteRegister(eRegSETINI, 0x01);
+    ProcessVBlankEnd(displayPpu.get());
+    const uint8_t field = GetField(displayPpu.get());
+    for (int scanline = 0; scanline < 224; scanline++)
+        DrawLine(displayPpu.get(), scanline);
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 3);
+    EXPECT_EQ(display.lastFrame->descriptor.width, 256);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 448);
+    EXPECT_EQ(display.lastFrame->pixels[field * SCREEN_X], red);
+    EXPECT_EQ(display.lastFrame->pixels[(field ^ 1) * SCREEN_X], red);
+    EXPECT_EQ(display.lastFrame->pixels[447 * SCREEN_X + 255], red);
+
+    // The next field is drawn into the other rows, and the rows of the last one are kept.
+    displayPpu->WriteRegister(eRegCGADD, 0x00);
+    displayPpu->WriteRegister(eRegCGDATA, 0xE0);
+    displayPpu->WriteRegister(eRegCGDATA, 0x03);
+    ProcessVBlankEnd(displayPpu.get());
+    ASSERT_EQ(GetField(displayPpu.get()), field ^ 1);
+    for (int scanline = 0; scanline < 224; scanline++)
+        DrawLine(displayPpu.get(), scanline);
+    ProcessVBlankStart(displayPpu.get());
+    ASSERT_EQ(display.frameCount, 4);
+    EXPECT_EQ(display.lastFrame->descriptor.height, 448);
+    for (int y = 0; y < 448; y++)
+    {
+        ASSERT_EQ(display.lastFrame->pixels[y * SCREEN_X], (y & 1) == field ? red : green) << "y=" << y;
+        ASSERT_EQ(display.lastFrame->isLineChanged[y], (y & 1) != field) << "y=" << y;
+    }
+}
+
+TEST_F(PpuTest, TEST_LineSkipping)
+{
+    TestDisplay display;
+    std::unique_ptr<Memory> displayMemory(new Memory());
+    std::unique_ptr<Ppu> displayPpu(new Ppu(displayMemory.get(), nullptr, &display));
+    ProcessVBlankEnd(ppu);
+    ProcessVBlankEnd(displayPpu.get());
+
+    // Draws the same frame on both, with BG1 turned off on changedLine. Every line of ppu is drawn again, so it's
+    // what displayPpu should show.
+    auto DrawFrame = [this, &displayPpu](int changedLine)
+    {
+        ppu->InvalidateTileCache();
+        for (int scanline = 0; scanline < 224; scanline++)
+        {
+            ppu->WriteRegister(eRegTM, scanline == changedLine ? 0x10 : 0x11);
+            displayPpu->WriteRegister(eRegTM, scanline == changedLine ? 0x10 : 0x11);
+            DrawLine(ppu, scanline);
+            DrawLine(displayPpu.get(), scanline);
+        }
+    };
+    auto PublishFrame = [this, &displayPpu]()
+    {
+        ProcessVBlankStart(displayPpu.get());
+        ProcessVBlankEnd(displayPpu.get());
+    };
+
+    // Rewriting VRAM with the same data doesn't change anything, so after every buffer has held the frame once, lines
+    // are only kept.
+    DrawTestFrame(displayPpu.get(), 1357);
+    DrawFrame(-1);
+    PublishFrame();
+    for (int i = 0; i < 3; i++)
+    {
+        DrawFrame(-1);
+        PublishFrame();
+        for (int y = 0; y < 224; y++)
+            ASSERT_FALSE(display.lastFrame->isLineChanged[y]) << "frame=" << i << " y=" << y;
+    }
+
+    uint32_t &pixel = GetBackBuffer(displayPpu.get()).pixels[50 * SCREEN_X];
+    const uint32_t oldPixel = pixel;
+    pixel = 0x12345678;
+    DrawFrame(-1);
+    EXPECT_EQ(pixel, 0x12345678);
+    pixel = oldPixel;
+    ExpectSameFrame(GetFrameBuffer(displayPpu.get()), GetFrameBuffer(ppu));
+    PublishFrame();
+
+    // Only the changed line is drawn, and it's drawn again when it changes back.
+    for (int changedLine : {100, -1})
+    {
+        DrawFrame(changedLine);
+        ExpectSameFrame(GetFrameBuffer(displayPpu.get()), GetFrameBuffer(ppu));
+        PublishFrame();
+        for (int y = 0; y < 224; y++)
+            ASSERT_EQ(display.lastFrame->isLineChanged[y], y == 100) << "changedLine=" << changedLine << " y=" << y;
+    }
+}
+
+TEST_F(PpuTest, TEST_Capture)
+{
+    const std::string path = ::testing::TempDir() + "PpuTest.ppucap";
+    std::unique_ptr<Memory> otherMemory(new Memory());
+    std::unique_ptr<Ppu> other(new Ppu(otherMemory.get(), nullptr, nullptr));
+
+    // The first frame sets everything up, and the second only scrolls, so it needs the state the first one left.
+    ASSERT_TRUE(ppu->StartCapture(path));
+    ProcessVBlankEnd(ppu);
+    DrawTestFrame(other.get(), 1357);
+    ProcessVBlankStart(ppu);
+    std::vector<uint32_t> firstFrame(GetLastPublished(ppu).pixels.begin(), GetLastPublished(ppu).pixels.end());
+
+    ProcessVBlankEnd(ppu);
+    for (int scanline = 0; scanline < 224; scanline++)
+    {
+        if (scanline == 100)
+            WriteRegisterTwice(eRegBG1HOFS, 0x123);
+        DrawLine(ppu, scanline);
+    }
+    ProcessVBlankStart(ppu);
+    std::vector<uint32_t> secondFrame(GetLastPublished(ppu).pixels.begin(), GetLastPublished(ppu).pixels.end());
+
+    // The third frame switches to mode 7 partway down, using the mode 7 registers and latches set during VBlank.
+    // BG1's offsets share an address with mode 7's, and the M7A write between the offset bytes changes the mode 7
+    // latch, so the two scrolls start the frame different. A color is also left half written.
+    WriteRegisterTwice(eRegM7B, 0);
+    WriteRegisterTwice(eRegM7C, 0);
+    WriteRegisterTwice(eRegM7D, 0x0100);
+    WriteRegisterTwice(eRegM7X, 0x0080);
+    WriteRegisterTwice(eRegM7Y, 0x0080);
+    ppu->WriteRegister(eRegBG1HOFS, 0x34);
+    WriteRegisterTwice(eRegM7A, 0x0100);
+    ppu->WriteRegister(eRegBG1HOFS, 0x01);
+    ppu->WriteRegister(eRegCGADD, 0x00);
+    ppu->WriteRegister(eRegCGDATA, 0x1F);
+    ProcessVBlankEnd(ppu);
+    for (int scanline = 0; scanline < 224; scanline++)
+    {
+        if (scanline == 50)
+            ppu->WriteRegister(eRegCGDATA, 0x00);
+        if (scanline == 100)
+            ppu->WriteRegister(eRegBGMODE, 0x07);
+        DrawLine(ppu, scanline);
+    }
+    ProcessVBlankStart(ppu);
+    std::vector<uint32_t> thirdFrame(GetLastPublished(ppu).pixels.begin(), GetLastPublished(ppu).pixels.end());
+    ppu->StopCapture();
+
+    // Each frame is drawn the same on its own.
+    PpuCapture capture;
+    ASSERT_TRUE(capture.Load(path));
+    ASSERT_EQ(capture.GetFrameCount(), 3u);
+    for (size_t frame : {1, 0, 2, 1})
+    {
+        capture.StartFrame(frame);
+        PpuCapture::Line line;
+        int lineCount = 0;
+        while (capture.DrawNextLine(line))
+        {
+            EXPECT_EQ(line.scanline, lineCount);
+            EXPECT_EQ(line.bgMode, (frame == 2 && lineCount >= 100) ? 7 : 1);
+            EXPECT_EQ(line.width, 256);
+            lineCount++;
+        }
+        EXPECT_EQ(lineCount, 224);
+
+        const std::vector<uint32_t> &expected = frame == 0 ? firstFrame : frame == 1 ? secondFrame : thirdFrame;
+        for (int i = 0; i < SCREEN_X * 224; i++)
+            ASSERT_EQ(capture.GetLastFrame().pixels[i], expected[i]) << "frame=" << frame << " pixel=" << i;
+    }
+
+    std::remove(path.c_str());
+}
+
 TEST_F(PpuTest, TEST_TranslateVramAddress)
 {
     uint16_t addr = 0x1234;
@@ -182,6 +1173,38 @@ TEST_F(PpuTest, TEST_TranslateVramAddress)
 }
 
 
+TEST_F(PpuTest, TEST_TileCache)
+{
+    // Increment after writing the high byte. Word address 0x100 is byte address 0x200.
+    ppu->WriteRegister(eRegVMAIN, 0x80);
+    ppu->WriteRegister(eRegVMADDL, 0x00);
+    ppu->WriteRegister(eRegVMADDH, 0x01);
+
+    // First row of a 2bpp tile. The leftmost pixel is 1, and the rightmost is 2.
+    ppu->WriteRegister(eRegVMDATAL, 0x80);
+    ppu->WriteRegister(eRegVMDATAH, 0x01);
+
+    const uint8_t *tile = GetTile(0x200, 2);
+    EXPECT_EQ(tile[0], 1);
+    EXPECT_EQ(tile[1], 0);
+    EXPECT_EQ(tile[7], 2);
+    EXPECT_EQ(GetTile(0x200, 4)[0], 1);
+    EXPECT_EQ(GetTile(0x200, 8)[7], 2);
+
+    // Writing VRAM decodes the tile again, at every depth.
+    ppu->WriteRegister(eRegVMADDL, 0x00);
+    ppu->WriteRegister(eRegVMADDH, 0x01);
+    ppu->WriteRegister(eRegVMDATAL, 0x00);
+    ppu->WriteRegister(eRegVMDATAH, 0x81);
+
+    tile = GetTile(0x200, 2);
+    EXPECT_EQ(tile[0], 2);
+    EXPECT_EQ(tile[7], 2);
+    EXPECT_EQ(GetTile(0x200, 4)[0], 2);
+    EXPECT_EQ(GetTile(0x200, 8)[7], 2);
+}
+
+
 TEST_F(PpuTest, TEST_Multiplication)
 {
     // 0 * 10 = 0
@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "RomLibrary.h"
+#include "RomImage.h"
+
+
+class RomLibraryTest : public ::testing::Test
+{
+protected:
+    RomLibraryTest();
+    ~RomLibraryTest() override;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Writes a LoROM with copierHeaderLen bytes of copier header in front of it.
+    void WriteTestRom(const std::string &name, const char *title, size_t copierHeaderLen);
+
+    std::string dir;
+};
+
+
+RomLibraryTest::RomLibraryTest()
+{
+
+}
+
+RomLibraryTest::~RomLibraryTest()
+{
+
+}
+
+void RomLibraryTest::SetUp()
+{
+    char path[] = "/tmp/RomLibraryTestXXXXXX";
+    ASSERT_NE(mkdtemp(path), nullptr);
+    dir = path;
+}
+
+void RomLibraryTest::TearDown()
+{
+    std::string command = "rm -rf " + dir;
+    ASSERT_EQ(system(command.c_str()), 0);
+}
+
+void RomLibraryTest::WriteTestRom(const std::string &name, const char *title, size_t copierHeaderLen)
+{
+    std::vector<uint8_t> rom(copierHeaderLen + 0x20000);
+    for (size_t i = 0; i < 0x20000; i++)
+        rom[copierHeaderLen + i] = static_cast<uint8_t>(i * 3);
+
+    RomImage::StandardHeader header;
+    memset(header.title, ' ', sizeof(header.title));
+    memcpy(header.title, title, strlen(title));
+    header.mode = 0x20 | RomImage::ERomType::eLoROM;
+    header.ramSize = 3;
+    memcpy(&rom[copierHeaderLen + 0x7FC0], &header, sizeof(header));
+
+    std::ofstream file(dir + "/" + name, std::ios::binary);
+    file.write(reinterpret_cast<char *>(rom.data()), rom.size());
+}
+
+
+TEST_F(RomLibraryTest, TEST_XxHash64)
+{
+    // Reference values from the xxHash project.
+    EXPECT_EQ(RomLibrary::XxHash64(nullptr, 0), 0xEF46DB3751D8E999);
+    EXPECT_EQ(RomLibrary::XxHash64(reinterpret_cast<const uint8_t *>("abc"), 3), 0x44BC2CF5AD770999);
+
+    const char *text = "Nobody inspects the spammish repetition";
+    EXPECT_EQ(RomLibrary::XxHash64(reinterpret_cast<const uint8_t *>(text), strlen(text)), 0xFBCEA83C8A378BF1);
+}
+
+TEST_F(RomLibraryTest, TEST_Scan)
+{
+    WriteTestRom("a.sfc", "FIRST GAME", 0);
+    WriteTestRom("b.SMC", "FIRST GAME", 512);
+    WriteTestRom("c.sfc", "", 0);
+    WriteTestRom("ignored.bin", "NOT A ROM", 0);
+    {
+        std::ofstream file(dir + "/d.sfc");
+        file << "This isn't a ROM";
+    }
+
+    RomLibrary library(dir + "/index.txt");
+    EXPECT_EQ(library.Scan({dir}, 2), 4u);
+
+    const std::map<std::string, RomLibrary::Entry> &entries = library.GetEntries();
+    ASSERT_EQ(entries.size(), 4u);
+
+    const RomLibrary::Entry &a = entries.at(dir + "/a.sfc");
+    const RomLibrary::Entry &b = entries.at(dir + "/b.SMC");
+    EXPECT_TRUE(a.isValid);
+    EXPECT_EQ(a.title, "FIRST GAME");
+    EXPECT_EQ(a.mode, 0x20);
+    EXPECT_EQ(a.romSize, 0x20000u);
+    EXPECT_EQ(a.ramSize, 0x2000u);
+    EXPECT_EQ(a.fileSize, 0x20000u);
+    EXPECT_EQ(b.fileSize, 0x20200u);
+
+    // The copier header isn't part of the hash.
+    EXPECT_EQ(a.hash, b.hash);
+
+    EXPECT_TRUE(entries.at(dir + "/c.sfc").isValid);
+    EXPECT_FALSE(entries.at(dir + "/d.sfc").isValid);
+
+    // Only changed files are inspected again.
+    EXPECT_EQ(library.Scan({dir}), 0u);
+    WriteTestRom("c.sfc", "CHANGED", 512);
+    EXPECT_EQ(library.Scan({dir}), 1u);
+    EXPECT_EQ(library.GetEntries().at(dir + "/c.sfc").title, "CHANGED");
+}
+
+TEST_F(RomLibraryTest, TEST_Index)
+{
+    WriteTestRom("a.sfc", "FIRST GAME", 0);
+    WriteTestRom("b.sfc", "SECOND GAME", 0);
+
+    RomLibrary library(dir + "/index.txt");
+    EXPECT_FALSE(library.LoadIndex());
+    EXPECT_EQ(library.Scan({dir}), 2u);
+    ASSERT_TRUE(library.SaveIndex());
+
+    RomLibrary loaded(dir + "/index.txt");
+    ASSERT_TRUE(loaded.LoadIndex());
+    ASSERT_EQ(loaded.GetEntries().size(), 2u);
+    const RomLibrary::Entry &original = library.GetEntries().at(dir + "/b.sfc");
+    const RomLibrary::Entry &entry = loaded.GetEntries().at(dir + "/b.sfc");
+    EXPECT_EQ(entry.title, "SECOND GAME");
+    EXPECT_EQ(entry.hash, original.hash);
+    EXPECT_EQ(entry.mtime, original.mtime);
+    EXPECT_EQ(entry.ramSize, original.ramSize);
+
+    // Nothing changed since the index was saved, and removed files are dropped.
+    unlink((dir + "/a.sfc").c_str());
+    EXPECT_EQ(loaded.Scan({dir}), 0u);
+    EXPECT_EQ(loaded.GetEntries().size(), 1u);
+}
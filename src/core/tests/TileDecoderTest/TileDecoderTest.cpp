@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+#include <random>
+
+#include "TileDecoder.h"
+
+
+class TileDecoderTest : public ::testing::Test
+{
+protected:
+    TileDecoderTest();
+    ~TileDecoderTest() override;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Decodes one pixel at a time, the same way the PPU used to.
+    uint8_t GetPixel(const uint8_t *tileData, uint8_t x, uint8_t y, uint8_t bpp);
+
+    std::vector<uint8_t> vram;
+};
+
+
+TileDecoderTest::TileDecoderTest() :
+    vram(0x10000)
+{
+    std::mt19937 rng(1234);
+    for (uint8_t &value : vram)
+        value = rng();
+}
+
+TileDecoderTest::~TileDecoderTest()
+{
+
+}
+
+void TileDecoderTest::SetUp()
+{
+
+}
+
+void TileDecoderTest::TearDown()
+{
+
+}
+
+uint8_t TileDecoderTest::GetPixel(const uint8_t *tileData, uint8_t x, uint8_t y, uint8_t bpp)
+{
+    uint8_t pixelVal = 0;
+
+    for (int plane = 0; plane < bpp; plane++)
+    {
+        uint8_t planeByte = tileData[((plane >> 1) << 4) + (y << 1) + (plane & 1)];
+        pixelVal |= ((planeByte >> (7 - x)) & 0x01) << plane;
+    }
+
+    return pixelVal;
+}
+
+
+TEST_F(TileDecoderTest, TEST_DecodeTile)
+{
+    ASSERT_STREQ(TileDecoder::GetKernels().front().name, "scalar");
+
+    for (const TileDecoder::Kernel &kernel : TileDecoder::GetKernels())
+    {
+        for (uint8_t bpp : {2, 4, 8})
+        {
+            const int tileSize = bpp * 8;
+
+            for (int addr = 0; addr < 0x10000; addr += tileSize)
+            {
+                uint8_t pixels[64];
+                kernel.decodeTile(&vram[addr], bpp, pixels);
+
+                for (int i = 0; i < 64; i++)
+                    ASSERT_EQ(pixels[i], GetPixel(&vram[addr], i & 7, i >> 3, bpp)) << kernel.name << " bpp=" <<
+                        static_cast<int>(bpp) << " addr=" << addr << " pixel=" << i;
+            }
+        }
+    }
+}
+
+
+TEST_F(TileDecoderTest, TEST_DecodeMode7Tile)
+{
+    for (const TileDecoder::Kernel &kernel : TileDecoder::GetKernels())
+    {
+        for (int tileId = 0; tileId < 256; tileId++)
+        {
+            const uint8_t *tileData = &vram[tileId << 7];
+            uint8_t pixels[64];
+            kernel.decodeMode7Tile(tileData, pixels);
+
+            for (int i = 0; i < 64; i++)
+                ASSERT_EQ(pixels[i], tileData[(i << 1) + 1]) << kernel.name << " tile=" << tileId << " pixel=" << i;
+        }
+    }
+}
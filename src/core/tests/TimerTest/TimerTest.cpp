@@ -34,6 +34,9 @@ TimerTest::TimerTest()
     memory = new Memory();
     interrupts = new Interrupt();
     timer = new Timer(memory, interrupts);
+
+    // The mock memory isn't cleared, and the Ppu isn't there to own SETINI.
+    *memory->GetBytePtr(eRegSETINI) = 0x00;
 }
 
 TimerTest::~TimerTest()
@@ -99,4 +102,26 @@ TEST_F(TimerTest, TEST_VBlankInterrupt_On_NMITIMEN_Change)
     *memory->GetBytePtr(eRegNMITIMEN) = 0x00;
     WriteRegister(eRegNMITIMEN, 0x80);
     EXPECT_EQ(interrupts->IsNmi(), false);
-}
\ No newline at end of file
+}
+
+TEST_F(TimerTest, TEST_Overscan)
+{
+    // With overscan, VBlank doesn't start after line 224.
+    *memory->GetBytePtr(eRegNMITIMEN) = 0x80;
+    *memory->GetBytePtr(eRegSETINI) = 0x04;
+    SetVCount(224);
+    SetHCount(341);
+    SetClockCounter(1363);
+    timer->AddCycle(6);
+    EXPECT_EQ(timer->GetIsVBlank(), false);
+    EXPECT_EQ(interrupts->IsNmi(), false);
+
+    // It starts after line 239 instead, even if overscan was turned off since.
+    *memory->GetBytePtr(eRegSETINI) = 0x00;
+    SetVCount(239);
+    SetHCount(341);
+    SetClockCounter(1363);
+    timer->AddCycle(6);
+    EXPECT_EQ(timer->GetIsVBlank(), true);
+    EXPECT_EQ(interrupts->IsNmi(), true);
+}
@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+
+#include "TripleBuffer.h"
+
+
+class TripleBufferTest : public ::testing::Test
+{
+protected:
+    TripleBufferTest();
+    ~TripleBufferTest() override;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Fills the first line of the back buffer with value, and publishes it.
+    void PublishFrame(uint32_t value);
+
+    // Three frames are too big for the stack.
+    std::unique_ptr<TripleBuffer> frames;
+};
+
+
+TripleBufferTest::TripleBufferTest() :
+    frames(new TripleBuffer())
+{
+
+}
+
+TripleBufferTest::~TripleBufferTest()
+{
+
+}
+
+void TripleBufferTest::SetUp()
+{
+
+}
+
+void TripleBufferTest::TearDown()
+{
+
+}
+
+void TripleBufferTest::PublishFrame(uint32_t value)
+{
+    TripleBuffer::Frame &frame = frames->GetBackBuffer();
+    std::fill(frame.pixels.begin(), frame.pixels.begin() + SCREEN_X, value);
+    frames->Publish();
+}
+
+
+TEST_F(TripleBufferTest, TEST_AcquireLatest)
+{
+    // Nothing has been published, so the front buffer is shown.
+    const TripleBuffer::Frame *front = &frames->AcquireLatest();
+    EXPECT_EQ(front->pixels[0], 0u);
+
+    PublishFrame(1);
+    EXPECT_EQ(frames->AcquireLatest().pixels[0], 1u);
+    EXPECT_NE(&frames->GetBackBuffer(), &frames->AcquireLatest());
+
+    // The frame doesn't change until another one is published.
+    front = &frames->AcquireLatest();
+    EXPECT_EQ(front->pixels[0], 1u);
+
+    // Only the newest frame is shown, and the shown frame is never drawn over.
+    PublishFrame(2);
+    PublishFrame(3);
+    PublishFrame(4);
+    EXPECT_EQ(front->pixels[0], 1u);
+    EXPECT_EQ(frames->AcquireLatest().pixels[0], 4u);
+}
+
+
+TEST_F(TripleBufferTest, TEST_Threads)
+{
+    const uint32_t frameCount = 2000;
+
+    std::thread drawThread([this, frameCount]()
+    {
+        for (uint32_t i = 1; i <= frameCount; i++)
+            PublishFrame(i);
+    });
+
+    // Frames are only ever seen whole and in order.
+    uint32_t last = 0;
+    while (last < frameCount)
+    {
+        const TripleBuffer::Frame &frame = frames->AcquireLatest();
+        const uint32_t value = frame.pixels[0];
+        ASSERT_GE(value, last);
+        for (int x = 1; x < SCREEN_X; x++)
+            ASSERT_EQ(frame.pixels[x], value) << "x=" << x;
+        last = value;
+    }
+
+    drawThread.join();
+}
@@ -14,6 +14,7 @@
 #include "core/Memory.h"
 #include "core/Ppu.h"
 #include "core/PpuConstants.h"
+#include "core/TileDecoder.h"
 
 static const int MaxLayers[] = {4, 3, 2, 2, 2, 2, 1, 1};
 
@@ -116,7 +117,7 @@ void InfoWindow::GeneratePalette()
     {
         uint16_t color = Bytes::Make16Bit(cgram[(i * 2) + 1], cgram[i * 2]);
         Bgr555 bgr(color);
-        paletteData[i] = bgr.ToARGB888(0xFF);
+        paletteData[i] = bgr.ToARGB888(15);
     }
 
     // Make the palette icons for the tileset and sprite tabs.
@@ -526,12 +527,15 @@ void InfoWindow::UpdateTilesetView()
     {
         QImage img(8, 8, QImage::Format_RGB32);
 
+        uint16_t addr = ppu->bgChrAddr[layer] + (tileId * 8 * bpp);
+        uint8_t pixels[64];
+        TileDecoder::DecodeTile(&ppu->vram[addr], bpp, pixels);
+
         for (int x = 0; x < 8; x++)
         {
             for (int y = 0; y < 8; y++)
             {
-                uint16_t addr = ppu->bgChrAddr[layer] + (tileId * 8 * bpp);
-                uint8_t pixelVal = ppu->GetTilePixelData(addr, x, y, bpp);
+                uint8_t pixelVal = pixels[(y << 3) + x];
                 img.setPixel(x, y, paletteData[(tilesetBgPalette * (1 << bpp)) + pixelVal]);
             }
         }
@@ -569,13 +573,16 @@ void InfoWindow::UpdateTilemapView()
 
             QImage img(8, 8, QImage::Format_RGB32);
 
+            uint16_t tileAddr = ppu->bgChrAddr[eBG1] + (tileId * 8 * bpp);
+            uint8_t pixels[64];
+            TileDecoder::DecodeTile(&ppu->vram[tileAddr], bpp, pixels);
+
             // TODO: Handle 16x16 tiles.
             for (int x = 0; x < 8; x++)
             {
                 for (int y = 0; y < 8; y++)
                 {
-                    uint16_t tileAddr = ppu->bgChrAddr[eBG1] + (tileId * 8 * bpp);
-                    uint8_t pixelVal = ppu->GetTilePixelData(tileAddr, x, y, bpp);
+                    uint8_t pixelVal = pixels[(y << 3) + x];
                     img.setPixel(x, y, paletteData[pixelVal + (paletteId << bpp)]);
                 }
             }
@@ -747,12 +754,15 @@ void InfoWindow::DrawSpriteTable(uint16_t baseAddr, QGraphicsView *gv)
     {
         QImage img(8, 8, QImage::Format_RGB32);
 
+        uint16_t tileAddr = baseAddr + (tileId * 8  * OBJ_BPP); // 8px width * 4bpp;
+        uint8_t pixels[64];
+        TileDecoder::DecodeTile(&ppu->vram[tileAddr], OBJ_BPP, pixels);
+
         for (int x = 0; x < 8; x++)
         {
             for (int y = 0; y < 8; y++)
             {
-                uint16_t tileAddr = baseAddr + (tileId * 8  * OBJ_BPP); // 8px width * 4bpp;
-                uint8_t pixelVal = ppu->GetTilePixelData(tileAddr, x, y, OBJ_BPP);
+                uint8_t pixelVal = pixels[(y << 3) + x];
                 img.setPixel(x, y, paletteData[128 + (spritePaletteId * 16) + pixelVal]);
             }
         }
@@ -12,6 +12,7 @@
 #include "../core/Emulator.h"
 //#include "../Input.h"
 #include "../core/Logger.h"
+#include "../core/TripleBuffer.h"
 
 
 MainWindow::MainWindow(const QString &romFilename, bool startInDebug, uint32_t runToAddress, bool saveToRecent, QWidget *parent) :
@@ -34,7 +35,8 @@ MainWindow::MainWindow(const QString &romFilename, bool startInDebug, uint32_t r
     debuggerWindow(NULL),
     displayDebuggerWindowAction(NULL),
     emuSaveStateAction(NULL),
-    emuLoadStateAction(NULL)
+    emuLoadStateAction(NULL),
+    emuPpuCaptureAction(NULL)
     /*audioEnabled(true),
     audioOutput(NULL),
     audioBuffer(NULL),
@@ -250,6 +252,13 @@ void MainWindow::SetupMenuBar()
     emuMenu->addAction(emuLoadStateAction);
     connect(emuLoadStateAction, SIGNAL(triggered()), this, SLOT(SlotLoadState()));
 
+    // Emulator | Capture PPU Frames
+    emuPpuCaptureAction = new QAction("&Capture PPU Frames...", this);
+    emuPpuCaptureAction->setCheckable(true);
+    emuPpuCaptureAction->setEnabled(false);
+    emuMenu->addAction(emuPpuCaptureAction);
+    connect(emuPpuCaptureAction, SIGNAL(triggered(bool)), this, SLOT(SlotTogglePpuCapture(bool)));
+
     emuMenu->addSeparator();
 
     // Emulator | BG Layer 1
@@ -504,19 +513,21 @@ void MainWindow::OpenRom(const QString &filename, bool saveToRecent)
 
         emuSaveStateAction->setEnabled(true);
         emuLoadStateAction->setEnabled(true);
+        emuPpuCaptureAction->setEnabled(true);
+        emuPpuCaptureAction->setChecked(false);
 
         infoWindow->DrawFrame();
     }
 }
 
 
-void MainWindow::FrameReady(const std::array<uint32_t, SCREEN_X * SCREEN_Y> &displayFrameBuffer)
+void MainWindow::FrameReady(const std::shared_ptr<TripleBuffer> &readyFrames)
 {
     // This function runs in the thread context of the Emulator worker thread.
 
-    // Copy data so Emulator thread doesn't change data while we're drawing the screen.
-    //memcpy(frameBuffer, displayFrameBuffer, sizeof(frameBuffer));
-    frameBuffer = displayFrameBuffer;
+    // The main thread picks up the newest frame when it draws, so nothing is copied here.
+    if (std::atomic_load(&frames) != readyFrames)
+        std::atomic_store(&frames, readyFrames);
 
     // Signal the main thread to draw the screen.
     emit SignalFrameReady();
@@ -625,6 +636,8 @@ void MainWindow::SlotEndEmulation()
 
     emuSaveStateAction->setEnabled(false);
     emuLoadStateAction->setEnabled(false);
+    emuPpuCaptureAction->setEnabled(false);
+    emuPpuCaptureAction->setChecked(false);
 }
 
 
@@ -662,10 +675,29 @@ void MainWindow::SlotDrawFrame()
         frameCount++;
     }
 
-    QImage img((uchar *)(&frameBuffer[0]), SCREEN_X, SCREEN_Y, QImage::Format_ARGB32);
+    std::shared_ptr<TripleBuffer> latestFrames = std::atomic_load(&frames);
+    if (!latestFrames)
+        return;
+
+    // The frame stays put until the next call to AcquireLatest, so it can be used without copying it first.
+    const TripleBuffer::Frame &frame = latestFrames->AcquireLatest();
+    const FrameDescriptor &descriptor = frame.descriptor;
+    QImage::Format imageFormat = QImage::Format_RGB32;
+    if (descriptor.format == EPixelFormat::RGB565)
+        imageFormat = QImage::Format_RGB16;
+    else if (descriptor.format == EPixelFormat::BGR555)
+        imageFormat = QImage::Format_RGB555;
+    QImage img(reinterpret_cast<const uchar *>(frame.pixels.data()), descriptor.width, descriptor.height,
+               descriptor.pitch, imageFormat);
+    // Qt's 15 bit format has red in the high bits.
+    if (descriptor.format == EPixelFormat::BGR555)
+        img = img.rgbSwapped();
     graphicsView->scene()->clear();
     QGraphicsPixmapItem *pixmap = graphicsView->scene()->addPixmap(QPixmap::fromImage(img));
-    pixmap->setScale(displayScale);
+    // Frames are 256 or 512 pixels wide, and 224 lines high, or twice that when interlaced. Stretch them to fill the
+    // SCREEN_X by SCREEN_Y view.
+    const int lineScale = descriptor.height > SCREEN_Y / 2 ? 1 : 2;
+    pixmap->setTransform(QTransform::fromScale(displayScale * SCREEN_X / descriptor.width, displayScale * lineScale));
 
     // Only update infoWindow 60 time a second, this stops the program locking up when frame cap is off.
     if ((elapsedTime & 0x0F) == 0)
@@ -763,6 +795,20 @@ void MainWindow::SlotLoadState()
 }
 
 
+void MainWindow::SlotTogglePpuCapture(bool checked)
+{
+    if (!checked)
+    {
+        emulator->StopPpuCapture();
+        return;
+    }
+
+    QString filename = QFileDialog::getSaveFileName(this, "Capture PPU Frames", "", "PPU Captures (*.ppucap)");
+    if (filename == "" || !emulator->StartPpuCapture(filename.toLatin1().data()))
+        emuPpuCaptureAction->setChecked(false);
+}
+
+
 void MainWindow::SlotOpenSettings()
 {
     SettingsDialog dialog(this);
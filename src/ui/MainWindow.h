@@ -33,7 +33,7 @@ public:
 
     // DisplayInterface functions.
     // Callback for Emulator to signal a frame is ready to be drawn.
-    void FrameReady(const std::array<uint32_t, SCREEN_X * SCREEN_Y> &displayFrameBuffer) override;
+    void FrameReady(const std::shared_ptr<TripleBuffer> &frames) override;
     // Callback for Emulator to show message box.
     void RequestMessageBox(const std::string &message) override;
 
@@ -88,7 +88,8 @@ private:
     QGamepad *gamepad;
 #endif
 
-    std::array<uint32_t, SCREEN_X * SCREEN_Y> frameBuffer;
+    // Set by the Emulator thread, and read with atomic_load by the main thread.
+    std::shared_ptr<TripleBuffer> frames;
     int displayScale;
 
     InfoWindow *infoWindow;
@@ -100,6 +101,7 @@ private:
 
     QAction *emuSaveStateAction;
     QAction *emuLoadStateAction;
+    QAction *emuPpuCaptureAction;
 
     QAction *recentFilesActions[MAX_RECENT_FILES];
 
@@ -130,6 +132,7 @@ private slots:
     void SlotDebuggerWindowClosed();
     void SlotSaveState();
     void SlotLoadState();
+    void SlotTogglePpuCapture(bool checked);
     void SlotOpenSettings();
     //void SlotAudioStateChanged(QAudio::State state);
 #ifdef QT_GAMEPAD_LIB
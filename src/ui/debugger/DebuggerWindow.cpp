@@ -193,7 +193,7 @@ void DebuggerWindow::UpdateWidgets(Address pc)
         return;
 
     // This assumes we are executing code from a ROM bank. This could cause problems if the pc points to a wram mirror.
-    disassemblyModel->AddRow(pc, memory->GetBytePtr(pc.ToUint()), &cpu->reg);
+    disassemblyModel->AddRow(pc, memory->GetReadOnlyBytePtr(pc.ToUint()), &cpu->reg);
 
     int rowIndex = disassemblyModel->GetRowIndex(pc);
     if (rowIndex >= 0)
@@ -262,7 +262,7 @@ void DebuggerWindow::SlotProcessUpdate(Address pc)
     UpdateWidgets(pc);
 
     // Add current instruction to call stack.
-    Opcode opcode = Opcode::GetOpcode(pc, memory->GetBytePtr(pc.ToUint()), &cpu->reg);
+    Opcode opcode = Opcode::GetOpcode(pc, memory->GetReadOnlyBytePtr(pc.ToUint()), &cpu->reg);
     new QListWidgetItem(opcode.ToString(), ui->callStackView);
 }
 
@@ -351,7 +351,7 @@ void DebuggerWindow::SlotDisassembleAddress()
     if (ret == 1)
     {
         Address addr(dialog.address);
-        disassemblyModel->AddRow(addr, memory->GetBytePtr(addr.ToUint()), &cpu->reg);
+        disassemblyModel->AddRow(addr, memory->GetReadOnlyBytePtr(addr.ToUint()), &cpu->reg);
     }
 }
 